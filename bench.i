@@ -0,0 +1,294 @@
+/*
+ * bench.i --
+ *
+ * End-to-end I/O benchmark of the Yorick interface to SoX.
+ *
+ * Usage (from the build directory):
+ *
+ *     make bench
+ *
+ * or:
+ *
+ *     yorick -batch bench.i [--seconds=T] [--dir=DIR] [--report=FILE] [--keep]
+ *
+ * or, interactively:
+ *
+ *     include, "bench.i";
+ *     sox_bench, seconds=5;
+ *
+ *-----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2015 Éric Thiébaut <eric.thiebaut@univ-lyon1.fr>
+ *
+ */
+
+/* Load the plugin of the build directory and the interpreted code next to
+   this file. */
+plug_dir, _(".", plug_dir());
+_sox_bench_dir = current_include();
+_sox_bench_len = strfind("/", _sox_bench_dir, back=1)(2);
+_sox_bench_dir = (_sox_bench_len > 0 ?
+                  strpart(_sox_bench_dir, 1:_sox_bench_len) : "./");
+include, _sox_bench_dir + "sox.i";
+
+/* Tested formats: name, file type, encoding, bits per sample and whether
+   the files can be read back (headerless raw files cannot be opened for
+   reading without the signal parameters). */
+SOX_BENCH_NAMES = ["wav16", "wav24", "wav32", "float", "flac", "ima-adpcm",
+                   "raw"];
+SOX_BENCH_TYPES = ["wav", "wav", "wav", "wav", "flac", "wav", "raw"];
+SOX_BENCH_ENCODINGS = [SOX_ENCODING_SIGN2, SOX_ENCODING_SIGN2,
+                       SOX_ENCODING_SIGN2, SOX_ENCODING_FLOAT,
+                       SOX_ENCODING_FLAC, SOX_ENCODING_IMA_ADPCM,
+                       SOX_ENCODING_SIGN2];
+SOX_BENCH_BITS = [16, 24, 32, 32, 16, 4, 16];
+SOX_BENCH_READABLE = [1, 1, 1, 1, 1, 1, 0];
+
+func sox_bench(names, seconds=, rate=, block=, dir=, report=, keep=)
+/* DOCUMENT sox_bench;
+         or sox_bench, names;
+
+     Measure the throughput of the plugin.  For each of the formats given
+     by NAMES (by default all those of SOX_BENCH_NAMES), a deterministic
+     stereo test signal is encoded in a file and the following tests are
+     run:
+
+         write   - `sox_write` by blocks of samples;
+         read    - sequential `sox_read` by blocks of samples;
+         random  - `s(i1:i2)` slices of a block of samples at random
+                   offsets;
+         seek    - `sox_seek` to random offsets;
+
+     The random and seek tests are skipped for streams which are not
+     seekable.  Offsets are drawn from a fixed seed so that every run does
+     the same operations.
+
+     One line is printed for each format and test, with the following
+     whitespace separated columns (lines starting with a `#` are comments):
+
+         format      - name of the format;
+         test        - name of the test;
+         ops         - number of operations (calls);
+         frames      - number of frames transferred;
+         seconds     - total elapsed time;
+         frames_s    - number of frames per second;
+         mb_s        - megabytes of encoded data per second;
+         p50_us      - median latency of an operation (microseconds);
+         p99_us      - 99th percentile of the latency (microseconds);
+         libsox_pct  - percentage of the time spent in libSoX (see
+                       `sox_io_stats`).
+
+   KEYWORDS
+
+     seconds - Duration of the test signal (default 20).
+
+     rate - Sampling rate of the test signal (default 48000).
+
+     block - Number of frames per operation (default 4096).
+
+     dir - Directory for the test files (default ".").
+
+     report - Name of a file where to also write the report (by default,
+             the report is only printed).
+
+     keep - Keep the test files (they are removed by default).
+
+   SEE ALSO: sox_io_stats, sox_open_read, sox_open_write. */
+{
+  if (is_void(names)) names = SOX_BENCH_NAMES;
+  if (is_void(seconds)) seconds = 20.0;
+  if (is_void(rate)) rate = 48000;
+  if (is_void(block)) block = 4096;
+  if (is_void(dir)) dir = ".";
+  if (strpart(dir, strlen(dir):strlen(dir)) != "/") dir += "/";
+
+  f = (is_void(report) ? [] : create(report));
+  _sox_bench_line, f, swrite(format="# %d frames at %d Hz, %d frames per "+
+                             "operation", long(seconds*rate), long(rate),
+                             long(block));
+  _sox_bench_line, f, swrite(format="# %-9s %-6s %6s %9s %8s %11s %8s "+
+                             "%9s %9s %10s", "format", "test", "ops",
+                             "frames", "seconds", "frames_s", "mb_s",
+                             "p50_us", "p99_us", "libsox_pct");
+  x = _sox_bench_signal(long(seconds*rate), rate);
+  for (k = 1; k <= numberof(names); ++k) {
+    _sox_bench_format, f, names(k), x, rate, block, dir, keep;
+  }
+  if (! is_void(f)) close, f;
+}
+
+func _sox_bench_format(f, name, x, rate, block, dir, keep)
+{
+  j = where(SOX_BENCH_NAMES == name);
+  if (numberof(j) != 1) error, "unknown benchmark format \"" + name + "\"";
+  j = j(1);
+  path = dir + "bench-" + name + "." + SOX_BENCH_TYPES(j);
+  if (catch(-1)) {
+    _sox_bench_line, f, "# " + name + ": skipped (" + catch_message + ")";
+    _sox_bench_remove, path, keep;
+    return;
+  }
+
+  /* Write test (this also creates the file for the other tests). */
+  n = dimsof(x)(3);
+  nops = (n + block - 1)/block;
+  lat = array(double, nops);
+  s = sox_open_write(path, rate=rate, channels=2,
+                     filetype=SOX_BENCH_TYPES(j),
+                     encoding=SOX_BENCH_ENCODINGS(j),
+                     bits_per_sample=SOX_BENCH_BITS(j), overwrite=1);
+  t = _sox_bench_clock();
+  for (i = 1; i <= nops; ++i) {
+    i1 = (i - 1)*block + 1;
+    i2 = min(i*block, n);
+    t0 = _sox_bench_clock();
+    sox_write, s, x(, i1:i2);
+    lat(i) = _sox_bench_clock() - t0;
+  }
+  stats = s.stats;
+  sox_close, s;
+  s = [];
+  elapsed = _sox_bench_clock() - t;
+  size = _sox_bench_size(path);
+  _sox_bench_result, f, name, "write", nops, n, size, elapsed, lat, stats;
+
+  if (! SOX_BENCH_READABLE(j)) {
+    _sox_bench_line, f, "# " + name + ": read tests skipped " +
+      "(headerless file)";
+    _sox_bench_remove, path, keep;
+    return;
+  }
+
+  /* Sequential read test. */
+  s = sox_open_read(path);
+  lat = array(double, nops + 1);
+  frames = 0;
+  t = _sox_bench_clock();
+  for (i = 1; ; ++i) {
+    t0 = _sox_bench_clock();
+    b = sox_read(s, block);
+    lat(i) = _sox_bench_clock() - t0;
+    if (is_void(b)) break;
+    frames += numberof(b)/2;
+  }
+  elapsed = _sox_bench_clock() - t;
+  _sox_bench_result, f, name, "read", i, frames, size, elapsed, lat(1:i),
+    s.stats;
+
+  if (! s.seekable) {
+    _sox_bench_line, f, "# " + name + ": random and seek tests skipped " +
+      "(not seekable)";
+    s = [];
+    _sox_bench_remove, path, keep;
+    return;
+  }
+
+  /* Random access test. */
+  nops = 200;
+  random_seed, 0.25;
+  off = long(random(nops)*max(n - block, 1)) + 1;
+  sox_reset_io_stats, s;
+  lat = array(double, nops);
+  frames = 0;
+  t = _sox_bench_clock();
+  for (i = 1; i <= nops; ++i) {
+    t0 = _sox_bench_clock();
+    b = s(off(i):off(i) + block - 1);
+    lat(i) = _sox_bench_clock() - t0;
+    frames += numberof(b)/2;
+  }
+  elapsed = _sox_bench_clock() - t;
+  _sox_bench_result, f, name, "random", nops, frames, size*frames/double(n),
+    elapsed, lat, s.stats;
+
+  /* Seek test. */
+  nops = 1000;
+  random_seed, 0.75;
+  off = long(random(nops)*n);
+  sox_reset_io_stats, s;
+  lat = array(double, nops);
+  t = _sox_bench_clock();
+  for (i = 1; i <= nops; ++i) {
+    t0 = _sox_bench_clock();
+    sox_seek, s, off(i);
+    lat(i) = _sox_bench_clock() - t0;
+  }
+  elapsed = _sox_bench_clock() - t;
+  _sox_bench_result, f, name, "seek", nops, 0, 0.0, elapsed, lat, s.stats;
+  s = [];
+  _sox_bench_remove, path, keep;
+}
+
+/* Deterministic test signal: a slow sweep on the first channel, a pure tone
+   on the second one and low level noise on both. */
+func _sox_bench_signal(n, rate)
+{
+  t = (indgen(n) - 1.0)/rate;
+  random_seed, 0.5;
+  x = array(double, 2, n);
+  x(1,) = 0.4*sin(2*pi*(440.0 + 40.0*t)*t) + 0.05*(random(n) - 0.5);
+  x(2,) = 0.4*sin(2*pi*997.0*t) + 0.05*(random(n) - 0.5);
+  return x;
+}
+
+func _sox_bench_result(f, name, test, nops, frames, bytes, elapsed, lat,
+                       stats)
+{
+  lat = lat(sort(lat));
+  p50 = lat(max(1, long(ceil(0.50*numberof(lat)))));
+  p99 = lat(max(1, long(ceil(0.99*numberof(lat)))));
+  elapsed = max(elapsed, 1e-9);
+  _sox_bench_line, f, swrite(format="%-11s %-6s %6d %9d %8.3f %11.4g %8.2f "+
+                             "%9.1f %9.1f %10.1f", name, test, long(nops),
+                             long(frames), elapsed, frames/elapsed,
+                             bytes/elapsed/1e6, 1e6*p50, 1e6*p99,
+                             min(100.0*stats(10)/elapsed, 100.0));
+}
+
+func _sox_bench_line(f, str)
+{
+  write, format="%s\n", str;
+  if (! is_void(f)) write, f, format="%s\n", str;
+}
+
+func _sox_bench_clock(nil)
+{
+  t = array(double, 3);
+  timer, t;
+  return t(3);
+}
+
+func _sox_bench_remove(path, keep)
+{
+  if (! keep && open(path, "r", 1)) remove, path;
+}
+
+func _sox_bench_size(path)
+{
+  return double(sizeof(open(path, "rb")));
+}
+
+/* Run the benchmark when called in batch mode. */
+func _sox_bench_option(name, def)
+{
+  key = "--" + name + "=";
+  len = strlen(key);
+  argv = get_argv();
+  for (i = numberof(argv); i >= 1; --i) {
+    if (strpart(argv(i), 1:len) == key) {
+      return strpart(argv(i), len+1:strlen(argv(i)));
+    }
+  }
+  return def;
+}
+
+if (batch()) {
+  _sox_bench_seconds = _sox_bench_option("seconds");
+  if (! is_void(_sox_bench_seconds)) {
+    _sox_bench_seconds = tonum(_sox_bench_seconds);
+  }
+  sox_bench, seconds=_sox_bench_seconds, dir=_sox_bench_option("dir"),
+    report=_sox_bench_option("report"),
+    keep=anyof(get_argv() == "--keep");
+  quit;
+}
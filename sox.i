@@ -12,20 +12,32 @@
 if (is_func(plug_in)) plug_in, "ysox";
 
 extern sox_open_read;
-/* DOCUMENT s = sox_open_read(path);
+/* DOCUMENT s = sox_open_read(path, type=, gain=, rate=, channels=,
+                             precision=, prefetch=, index=, cache=,
+                             layout=, filetype=);
+         or s = sox_open_read(buf, filetype=, ...);
 
      Open sound file PATH for reading and  return a handle for it.  The handle
      can be indexed to read some audio samples:
 
         s(i)         yields i-th sample;
         s(i1:i2)     yields samples in the range i1 to i2;
+        s(i1:i2:k)   yields every k-th sample in the range i1 to i2;
+        s(idx)       yields the samples at the indices given by the integer
+                     array idx (the result is NC-by-dimsof(idx));
         s() or s(:)  yield all remaining samples;
 
      the same indexing rules as in Yorick apply (i.e., indices less or equal 0
      refer to the end  of the stream).  If i1 or i2  are omitted, they default
      to the  current stream position and  the end of the  stream respectively.
-     Fewer samples, or even no data, may  be returned if the end of the stream
-     is encountered.  See sox_read for more details.
+     The step k may be negative to  read samples in reverse order, in which
+     case i1 and i2 default to the end  and to the beginning of the stream.
+     Strided  ranges are  decoded by  blocks  of bounded  size, the  regions
+     between the selected samples are skipped  by seeking if the stream is
+     seekable.  Samples at a list of indices are read in a single forward
+     sweep whatever the order of the indices (see sox_read_segments).
+     Fewer samples, or even no data, may be returned if the end of the
+     stream is encountered.  See sox_read for more details.
 
      The handle can also be used as a structure to retrieve some informations:
 
@@ -48,6 +60,12 @@ extern sox_open_read;
         s.mode        = read or write mode ('r' or 'w');
         s.duration    = duration in seconds;
         s.encoding    = encoding (integer code);
+        s.cache_hits  = number of blocks found in the block cache;
+        s.cache_misses = number of blocks decoded into the block cache;
+        s.queued      = number of blocks waiting to be encoded (output
+                        stream opened with `async=`);
+        s.queue_size  = maximum number of queued blocks;
+        s.stats       = I/O counters of the stream (see `sox_io_stats`);
 
      For instance, the duration (in seconds) is given by:
 
@@ -59,21 +77,116 @@ extern sox_open_read;
 
      The stream is automatically closed when S is no longer in use.
 
+     The data of  uncompressed integer PCM  files (WAV, RF64, Wave64, AIFF,
+     AIFF-C and raw files) are mapped in memory and decoded directly from
+     the mapped pages: seeking costs nothing and reading a slice of a large
+     recording amounts to page cache hits.  Keyword PREFETCH is ignored for
+     such files.
+
+     Instead of a path, the contents of an audio file may be given as an
+     array BUF of bytes (char), for instance received from the network.  The
+     data are decoded from the array which is referenced by the handle (its
+     contents should not be modified while S is in use).  The same rules as
+     for files apply: uncompressed PCM data are directly decoded from BUF
+     and random access is instantaneous.  Other in-memory streams are not
+     seekable unless `index=1` is specified (no sidecar file is used).
+
+
+   KEYWORDS
+
+     type -  The  type  of  the  samples  returned  by  indexing  the  handle:
+             int  (the  default)  for  raw  SoX  audio  samples, short or
+             char for narrowed samples, float  or double for  floating-point
+             values  (see `sox_read`  for details).
+
+     gain - A multiplier for floating-point samples (default is 1).
+
+     rate - The  sampling rate  (in Hz)  seen by  the reader.   Samples  are
+             resampled  on  the  fly  by  band-limited  interpolation  (with a
+             windowed-sinc kernel and a low-pass filter to prevent aliasing
+             when down-sampling).
+
+     channels - The number of channels seen  by the reader.  Down-mixing
+             averages groups of consecutive channels (all channels for a
+             single output channel), up-mixing replicates channels.
+
+     precision - The number of bits  per sample seen  by the reader  (it
+             cannot exceed the precision of the file).  Samples are rounded
+             to this precision with saturation.
+
+     When any of RATE, CHANNELS or PRECISION is specified, indexing the
+     handle, `sox_read`, `sox_read_into` and `sox_seek` all operate in the
+     target space, so do the members `s.offset`, `s.samples`, `s.length`,
+     `s.rate`, `s.channels`, `s.precision` and `s.duration`.  For instance:
+
+        s = sox_open_read(path, rate=16000, channels=1, precision=16);
+        x = s(1:16000); // first second of audio, mono, at 16 kHz
+
+     Converted streams cannot be used as the input of an effects chain.
+
+     prefetch - If  set with  a  positive  number  N,  a background thread
+             decodes the stream ahead of  the reader into a ring buffer of
+             (at least) N samples per channel; `prefetch=1` selects a default
+             size of 262144 samples per channel.  This hides the cost of
+             decoding compressed formats behind the processing of the
+             samples on multi-core machines.  Seeking flushes the buffer
+             and restarts the decoding at the new position.
+
+     index - If  true,  make  random  access  exact  for  streams  that are
+             not seekable, or only approximately, with libSoX.  For MPEG
+             audio files  (mp2, mp3),  the frame headers are  scanned and the
+             whole file is decoded once to build an index which is stored in
+             the sidecar file PATH+".ysoxidx" (INDEX may also be the name of
+             the sidecar file); the index is reused as long as the file does
+             not change.  Seeking then restarts the decoder a few frames
+             before the target, locates the exact position of the decoder by
+             matching the decoded samples against the index, and discards the
+             samples up to the target.  For other unseekable streams, seeking
+             reopens the file and decodes up to the target.  This keyword has
+             no effect on streams which are already seekable.
+
+     cache - If set with a positive number N, the most recently read blocks
+             of 4096 decoded samples per channel are kept in a cache of
+             (about) N bytes; `cache=1` selects a default size of 16 MiB.
+             Reading is served from the cache when possible, seeking merely
+             sets the offset and the decoder is only moved (or restarted)
+             when a block is missing.  This makes code which repeatedly
+             reads scattered samples close to each other, e.g. `s(i)` for
+             nearby values of `i`, much faster.  Members `s.cache_hits` and
+             `s.cache_misses` count the accesses to the blocks.
+
+     layout - The layout of the samples returned by indexing the handle:
+             "interleaved" (the default) for NC-by-NP arrays, or "planar"
+             for NP-by-NC arrays (one column per channel) as expected by
+             most signal processing code.  The samples are transposed by
+             blocks while decoding, without any full-size temporary array.
+
+     filetype - The type of the file (e.g. "wav" or "flac") if it cannot be
+             determined by header inspection.  It is recommended to specify
+             it for in-memory streams.
 
    SEE ALSO: sox_read, sox_open_write, sox_close. */
 
 extern sox_close;
 /* DOCUMENT sox_close, s;
+         or buf = sox_close(s);
 
      Close the audio stream S.  No input/output can be done with S after that.
      This function is probably not  needed as streams get automatically closed
-     when no longer in use.
+     when no longer in use.  For an output stream opened with `async=`, the
+     queued samples are written before closing the stream and a deferred
+     write error, if any, is reported (an error occuring while a stream is
+     automatically closed is only reported by a warning).
+
+     When called as a function on an in-memory output stream (see
+     `sox_open_write`), the encoded data are returned as an array of bytes
+     (char); otherwise, nothing is returned.
 
    SEE ALSO: sox_open_read, sox_open_write.
  */
 
 extern sox_read;
-/* DOCUMENT b = sox_read(s, n);
+/* DOCUMENT b = sox_read(s, n, type=, gain=, channels=, mix=, layout=);
 
      Read N  samples from sound  stream S.  The result  is an array  of 32-bit
      integers of dimension  NC-by-NP where NC is the number  of audio channels
@@ -81,10 +194,242 @@ extern sox_read;
      end of the audio stream is reached.  If there is no more samples to read,
      a void result is returned.
 
+     Keyword TYPE  can be set  with float or  double to directly  decode the
+     samples  as floating-point  values  in the  range  [-1,1), that  is the
+     inverse of the conversion  performed by `sox_write`.  Keyword GAIN can be
+     used to specify  a multiplier for the floating-point  values.  Both are
+     applied by  the decoder in a single  pass without any temporary  array.
+     By default, the settings given when opening S are used.
+
+     Keyword TYPE can also be set  with short or char to narrow the samples
+     to signed  16-bit integers  or to unsigned  8-bit integers  (offset by
+     128, as in  8-bit PCM files) which takes respectively half  or a quarter
+     of the memory of raw samples.  The samples are rounded to the nearest
+     value by the decoder, samples clipped by the rounding are counted in
+     `s.clips`.  These are the exact inverses of the conversions performed
+     by `sox_write` for short and char arrays.
+
+     Keyword CHANNELS can be set with  the (1-based) indices of the channels
+     to keep, the result  is then NC'-by-NP with NC' = numberof(CHANNELS).
+     Keyword MIX can be set  with a NC'-by-NC mixing matrix to  combine the
+     (selected) channels,  a vector of  NC coefficients yields  a single
+     channel.  For instance, to downmix a stereo stream to mono:
+
+         b = sox_read(s, n, type=float, mix=[0.5, 0.5]);
+
+     Selection and mixing  are applied by the decoder  on blocks of samples,
+     so the memory used is proportional to NC'.  With mixing and integer
+     results, values are rounded to the nearest integer and clipped.
+
+     Keyword LAYOUT can be set with "planar" to get an NP-by-NC' result
+     (one column per channel) instead of the "interleaved" NC'-by-NP
+     layout; the default is the layout given when opening S.
+
      Note that, compared  to the behavior of SoX library,  the total number of
      samples is not N but N times the number of channels.
 
-   SEE ALSO: sox_seek. */
+   SEE ALSO: sox_seek, sox_open_read, sox_read_into. */
+
+extern sox_read_into;
+/* DOCUMENT n = sox_read_into(s, buf);
+         or n = sox_read_into(s, buf, i, cnt);
+
+     Read  samples from  sound stream  S  directly into  the existing  array
+     BUF  and return  the number  of samples  actually stored  (which may  be
+     smaller than requested  if the end of the stream  is reached).  BUF must
+     be an array of char, short, int, float or double values of dimension
+     NC-by-NP where NC is the number of audio channels (if NC=1, the first
+     dimension can be missing).  The conversion of the samples depends on
+     the type of BUF (see `sox_read`), keyword GAIN can be specified for
+     floating-point buffers.
+
+     Optional arguments I and CNT specify  the index of the first sample in
+     BUF to store and the maximum number of samples to store, by default all
+     samples of BUF are considered.  For instance:
+
+         buf = array(float, s.channels, 4096);
+         while ((n = sox_read_into(s, buf)) > 0) {
+           process, buf(, 1:n);
+         }
+
+     processes the stream by blocks without allocating any new buffer.
+
+   SEE ALSO: sox_read, sox_open_read. */
+
+extern sox_read_segments;
+/* DOCUMENT buf = sox_read_segments(s, starts, lengths, type=, gain=,
+                                   layout=);
+
+     Read  segments of  samples from  sound  stream  S.   STARTS  gives  the
+     (1-based) indices of the first sample  of the segments (indices less or
+     equal 0 refer  to the end of  the stream) and LENGTHS  their number of
+     samples.  If LENGTHS is a scalar, all segments have the same length and
+     the result  is  an array  of dimensions NC-by-LENGTHS-by-dimsof(STARTS)
+     where NC  is the number of  channels; otherwise, LENGTHS must have as
+     many elements as STARTS and the result is an NC-by-NP array with the
+     segments concatenated in the order of STARTS (NP = sum(LENGTHS)).
+
+     The segments are sorted by increasing  offsets and overlapping or
+     adjacent segments are merged so that each region of the stream is
+     decoded once in a single forward sweep, the samples are then scattered
+     in the order of the request.  For instance, to extract windows of 256
+     samples around a list of events:
+
+         win = sox_read_segments(s, events - 128, 256, type=float);
+
+     Keywords TYPE, GAIN and LAYOUT have the same meaning as for `sox_read`
+     and default to the options of the stream; with a "planar" layout, the
+     channel dimension comes last (e.g. LENGTHS-by-dimsof(STARTS)-by-NC).
+     It is an error if a segment
+     extends beyond the end of the stream.
+
+   SEE ALSO: sox_read, sox_open_read. */
+
+extern sox_frames;
+/* DOCUMENT it = sox_frames(s, len, hop, window=, type=, gain=, pad=);
+
+     Create an iterator yielding successive frames of LEN samples from the
+     input stream S, the first sample of each frame being HOP samples after
+     the first sample of the previous one (by default, HOP = LEN, i.e. no
+     overlap).  The first frame starts at the current offset of S.  Calling
+     the iterator without arguments yields the next frame as an NC-by-LEN
+     array, where NC is the number of channels, or nil when there are no
+     more frames:
+
+         it = sox_frames(s, 1024, 256, window="hann");
+         while (! is_void((x = it()))) {
+           process, x;
+         }
+
+     The samples of the current frame are kept in a ring buffer so that
+     only the HOP new samples are decoded for each frame, and the window is
+     applied while converting the samples to floating-point values.  The
+     iterator has members `it.length`, `it.hop`, `it.channels`, `it.count`
+     (number of frames yielded so far) and `it.offset` (offset of the first
+     sample of the next frame).
+
+   KEYWORDS
+
+     window - The window: "rect" (the default), "hann", "hamming" or
+             "blackman" for periodic windows (as suited for spectral
+             analysis), or a vector of LEN values.
+
+     type - The type of the frames: float (the default) or double.
+
+     gain - A multiplier for the samples (default is the gain of S).
+
+     pad - If true, the last frames are padded with zeros instead of being
+             dropped when the end of the stream is reached.
+
+   SEE ALSO: sox_open_read, sox_read, sox_read_segments,
+             sox_spectrogram. */
+
+extern sox_spectrogram;
+/* DOCUMENT sp = sox_spectrogram(s, nfft=, hop=, window=, range=, scale=,
+                                 mel=, threads=);
+
+     Compute the short-time spectrum of the input stream S.  The channels
+     are averaged, the frames of NFFT samples (1024 by default) separated
+     by HOP samples (NFFT/4 by default) are multiplied by the window and
+     transformed by a built-in real FFT (any NFFT is supported, lengths
+     with small prime factors are the fastest).  The result is an
+     NOUT-by-NFRAMES array of floats with NOUT = NFFT/2 + 1 frequency bins
+     from 0 to the Nyquist frequency (or NOUT = MEL bands, see below).
+
+     The stream is decoded by batches of bounded size so that memory does
+     not depend on the number of samples (except for the result): while the
+     frames of a batch are transformed by a pool of threads, the next batch
+     is being decoded.  Sample values are expressed in the range [-1,1)
+     (see `sox_read`).  The stream is left positioned after the last
+     decoded sample.
+
+   KEYWORDS
+
+     nfft - The number of samples per frame.
+
+     hop - The number of samples between the starts of successive frames.
+
+     window - The window: "hann" (the default), "rect", "hamming" or
+             "blackman" for periodic windows, or a vector of NFFT values.
+
+     range - A range I1:I2 of samples to consider (all samples by
+             default).
+
+     scale - The values to compute: "power" (the default) for the squared
+             modulus of the Fourier transform, "magnitude" for its modulus,
+             or "db" for the power in decibels (10*log10(power)).
+
+     mel - If set to a number of bands, the spectrum is summed in as many
+             triangular filters equally spaced on the mel scale (HTK
+             formula) from 0 to the Nyquist frequency.  With scale="db",
+             the logarithm is applied after the mel filtering.
+
+     threads - The number of threads (by default, the number of
+             processors).
+
+   SEE ALSO: sox_open_read, sox_frames, sox_stats. */
+
+extern sox_stats;
+/* DOCUMENT st = sox_stats(s);
+         or st = sox_stats(s, i1:i2);
+
+     Compute per-channel statistics of the samples of the input stream S
+     (all samples or those in the range I1:I2).  The stream is scanned by
+     blocks of bounded size so that memory does not depend on the number of
+     samples, the reductions use SIMD instructions when available.  The
+     result is an 8-by-NC array of doubles, where NC is the number of
+     channels, with, for each channel:
+
+         st(1,) = minimum value;
+         st(2,) = maximum value;
+         st(3,) = mean value (DC offset);
+         st(4,) = root mean square value;
+         st(5,) = peak level in dBFS;
+         st(6,) = number of zero crossings;
+         st(7,) = number of samples at full scale (clips);
+         st(8,) = number of samples;
+
+     sample values being  expressed in the range [-1,1) (see `sox_read`).
+     The statistics are for the samples seen by the reader (i.e., after
+     conversion, see `sox_open_read`).  The stream is left positioned after
+     the last sample scanned.
+
+   SEE ALSO: sox_read, sox_overview, sox_open_read. */
+
+extern sox_load_many;
+/* DOCUMENT buf = sox_load_many(paths, offs, errs, type=, gain=, rate=,
+                                 channels=, precision=, threads=);
+
+     Decode all the sound files whose names are  given by the array of strings
+     PATHS and return their samples concatenated  in a single NC-by-NP array
+     (NC is  the number  of channels  and NP  the total number of samples).
+     The files are decoded in parallel by a pool of threads.
+
+     Optional output  arguments OFFS and  ERRS are variables that are set to
+     the offsets  of the  files in  the  result and  to  the per-file error
+     messages.  OFFS is a vector of N+1 integers (with N = numberof(PATHS))
+     such that the samples of the i-th file are `buf(,offs(i)+1:offs(i+1))`.
+     ERRS is an array of strings with the same dimensions as PATHS which is
+     nil (i.e., string(0)) for files  successfully decoded and the  reason of
+     the failure otherwise.  Files which cannot be decoded contribute no
+     samples and do not abort the batch.  For instance:
+
+         buf = sox_load_many(paths, offs, errs, type=float, rate=16000,
+                             channels=1);
+         for (i = 1; i <= numberof(paths); ++i) {
+           if (errs(i)) write, format="%s: %s\n", paths(i), errs(i);
+           else process, buf(, offs(i)+1:offs(i+1));
+         }
+
+     Keywords TYPE and  GAIN have the same meaning as in `sox_read`, keywords
+     RATE, CHANNELS and PRECISION have the  same meaning as in `sox_open_read`.
+     All files must have the same number of channels (after conversion), the
+     number of channels  is  given by the first successfully decoded file if
+     keyword CHANNELS is  not specified.  Keyword  THREADS  specifies the
+     number  of threads (by default, the number of processors).  Nil is
+     returned if there are no samples.
+
+   SEE ALSO: sox_open_read, sox_read. */
 
 extern sox_seek;
 /* DOCUMENT sox_seek, s, off;
@@ -99,8 +444,46 @@ extern sox_seek;
 
    SEE ALSO: sox_read. */
 
+extern sox_overview;
+extern sox_envelope;
+/* DOCUMENT ov = sox_overview(s, block=, cache=);
+         or env = sox_envelope(ov, i1, i2, npix);
+
+     `sox_overview` builds  an overview of  the sound stream S (open for
+     reading) for rendering waveforms at any zoom level.  The overview is a
+     multi-resolution pyramid of the minimum, maximum and mean square values
+     of each channel computed in one pass over the stream.  The finest level
+     has blocks of BLOCK samples (256 by default), each coarser level groups
+     4 blocks of the previous level.  The stream is positioned at its end
+     after the pass.
+
+     The overview is saved in a sidecar file (by default, the name of the
+     audio file with suffix ".ysoxov") keyed by  the  path, size  and
+     modification time of the audio file and by the signal seen by the reader
+     (see keywords RATE and CHANNELS of `sox_open_read`).  A subsequent call
+     with the same audio file reloads the overview from the sidecar file
+     without decoding the audio file.  Keyword CACHE can be set with the name
+     of the sidecar file or with false to neither load nor save a sidecar
+     file.  Failure to save the sidecar file is silently ignored.
+
+     `sox_envelope` yields the envelope of the samples I1 to I2 (inclusive,
+     nil for the first and the last samples, nonpositive values are relative
+     to the end) for NPIX pixels.  The result is a 3-by-NC-by-NPIX array of
+     doubles where NC is the number of channels and where `env(1,c,p)`,
+     `env(2,c,p)` and `env(3,c,p)` are the minimum, the maximum and the RMS
+     value of the samples of the c-th channel in the p-th pixel (in units of
+     `sox_read` with `type=float`).  The audio file is not accessed and the
+     cost is proportional to NPIX.  The envelope is computed over whole blocks
+     so its resolution is limited to BLOCK samples.
+
+     An overview has members `ov.channels`, `ov.samples`, `ov.rate`,
+     `ov.block` and `ov.levels`.
+
+   SEE ALSO: sox_open_read, sox_read. */
+
 extern sox_open_write;
-/* DOCUMENT s = sox_open_write(path);
+/* DOCUMENT s = sox_open_write(path, ...);
+         or s = sox_open_write(, filetype=, ...);
 
      Open sound file PATH for writing and  return a handle for it.  The handle
      can be used as a function or as a subroutine to write some audio samples:
@@ -112,9 +495,30 @@ extern sox_open_write;
      The handle can also be used  as a structure to retrieve some informations
      (see `sox_open_read`).
 
+     If PATH is omitted or nil, the data are encoded in memory and the
+     encoded data are retrieved by `buf = sox_close(s)`.  Keyword FILETYPE
+     (or a template) must then be given.  For instance:
+
+        s = sox_open_write(, filetype="wav", channels=1, rate=16000);
+        sox_write, s, samples;
+        buf = sox_close(s); // array of bytes with the contents of the file
+
+     The sizes and the number of frames in the header of a WAV, AIFF or
+     AIFF-C file are fixed when the stream is closed.  Wave64 files cannot
+     be encoded in memory.  For other formats which store the length of the
+     data in their header, the stored length may be wrong.
+
 
    KEYWORDS
 
+     async - If set to a number N > 1, samples are encoded and written by
+             a background thread: writing to S merely converts and queues
+             the samples, at most N blocks (one per call) being queued;
+             `async=1` selects a default of 8 blocks.  The writer waits when
+             the queue is full, member `s.queued` gives the current number
+             of queued blocks.  A write error is reported by the next write
+             or by `sox_close`.
+
      bits_per_sample - The number of bits per sample.
 
      channels - The number of audio channels.  Default is 2 (stereo) unless
@@ -133,14 +537,18 @@ extern sox_open_write;
 
      rate - The rate (in Hz) of the audio stream.
 
+     layout - The default layout of the samples written to S: "interleaved"
+             (the default) for NC-by-NS arrays, or "planar" for NS-by-NC
+             arrays (see `sox_write`).
+
      template - An audio stream to serve  as a template to define the settings
              of the created output stream.  The comments are not copied.
 
    SEE ALSO: sox_open_read, sox_write. */
 
 extern sox_write;
-/* DOCUMENT sox_write, s, buf;
-         or samp = sox_write(s, buf);
+/* DOCUMENT sox_write, s, buf, layout=;
+         or samp = sox_write(s, buf, layout=);
 
      Write  the audio  samples in  BUF to  audio stream  S.  BUF  should be  a
      NC-by-NS array with NC the number of  audio channels and NS the number of
@@ -154,13 +562,153 @@ extern sox_write;
         [MIN,MAX] using rounding to nearest integer, clipping may occurs.
 
       - Integer values are converted from  their respective [MIN,MAX] range to
-        the [MIN,MAX] range of a 32-bit integer.
+        the [MIN,MAX] range of a 32-bit integer; char values are unsigned
+        bytes offset by 128 (as in 8-bit PCM files).
 
      When  called as  a function  the, possibly  converted, audio  samples are
      returned.
 
+     Keyword LAYOUT can be set with "planar" to write a NS-by-NC array (one
+     column per channel) instead; the samples are interleaved by blocks
+     while being converted.  The default is the layout given when opening S.
+
    SEE ALSO: sox_open_write. */
 
+extern sox_convert;
+/* DOCUMENT res = sox_convert(inpath, outpath, comments=, ...);
+
+     Transcode the audio file INPATH into the audio file OUTPATH.  The
+     samples are directly transferred between the two libSoX streams with a
+     single buffer, without being converted into Yorick arrays.  The result
+     is `[NFRAMES, NCLIPS]` with NFRAMES the number of frames (a sample for
+     each channel) written and NCLIPS the number of clipped samples.
+
+     The keywords are the same as for `sox_open_write` (`async` is ignored),
+     the settings of the output stream default to the rate, number of
+     channels and precision of the input stream.  If they differ, the
+     samples are converted as they are read (see `sox_open_read`).  For
+     instance:
+
+        sox_convert, "in.wav", "out.flac", precision=16, overwrite=1;
+
+     Keyword COMMENTS specifies whether to copy the comments of the input
+     file (true by default).
+
+   SEE ALSO: sox_open_read, sox_open_write, sox_convert_many,
+             sox_effects_chain. */
+
+extern sox_convert_many;
+/* DOCUMENT res = sox_convert_many(inpaths, outpaths, errs, threads=,
+                                   comments=, ...);
+
+     Transcode the audio files whose names are given by the array of
+     strings INPATHS into the audio files whose names are given by the
+     array of strings OUTPATHS (with as many elements as INPATHS).  The
+     files are converted in parallel by a pool of threads, each thread
+     claiming the next file not yet converted.  The result is a 4-by-N
+     array of doubles (with N = numberof(INPATHS), the trailing dimensions
+     are those of INPATHS) with, for the i-th file:
+
+         res(1,i) = status (0 if converted, 1 if failed, 2 if not started);
+         res(2,i) = number of frames written;
+         res(3,i) = number of clipped samples;
+         res(4,i) = elapsed time (in seconds) for the conversion;
+
+     Optional output argument ERRS is a variable set to an array of strings
+     with the same dimensions as INPATHS which is nil for files
+     successfully converted and the reason of the failure otherwise.  A
+     failed conversion does not abort the batch and its incomplete output
+     file is removed.  In case of interruption (Ctrl-C), the conversions in
+     progress are cancelled (their output files are removed), the remaining
+     files are not started and the interruption is reported once all the
+     threads have terminated.
+
+     Keyword THREADS specifies the number of threads (by default, the number
+     of processors), the other keywords are the same as for `sox_convert`.
+
+   SEE ALSO: sox_convert, sox_load_many. */
+
+extern sox_io_stats;
+extern sox_reset_io_stats;
+/* DOCUMENT stats = sox_io_stats();
+         or sox_reset_io_stats, s;
+         or sox_reset_io_stats;
+
+     The function `sox_io_stats` yields the I/O counters summed over all the
+     sound streams (including those opened by `sox_load_many`,
+     `sox_convert` and `sox_convert_many`) since the plugin was loaded or
+     since the last call to `sox_reset_io_stats` with no arguments.  The
+     counters of a single sound stream S are given by `s.stats` and are
+     reset by `sox_reset_io_stats,s`.  The result is a vector of 11
+     doubles:
+
+         stats(1)  = number of frames decoded;
+         stats(2)  = number of bytes of encoded data read;
+         stats(3)  = number of frames encoded;
+         stats(4)  = number of bytes of encoded data written;
+         stats(5)  = number of seeks;
+         stats(6)  = number of frames decoded and discarded to reach a
+                     position;
+         stats(7)  = number of read calls;
+         stats(8)  = number of write calls;
+         stats(9)  = time (in seconds) spent converting samples;
+         stats(10) = time (in seconds) spent in libSoX decoding, encoding
+                     or seeking;
+         stats(11) = number of clipped samples;
+
+     Times are measured by a monotonic clock.  The data decoded ahead by a
+     background decoder (`prefetch=`) and the data encoded by a background
+     encoder (`async=`) are counted in the number of frames but not in the
+     number of bytes.  For a background decoder, the time spent waiting for
+     decoded samples is counted as time spent in libSoX, the time spent by
+     a background encoder is not counted.  Clipped samples are added to the
+     global counters when a stream is closed.
+
+   SEE ALSO: sox_open_read, sox_open_write, sox_stats. */
+
+extern sox_effects_chain;
+extern sox_add_effect;
+extern sox_flow_effects;
+/* DOCUMENT c = sox_effects_chain(inp);
+         or c = sox_effects_chain(inp, out);
+         sox_add_effect, c, name, arg1, arg2, ...;
+         n = sox_flow_effects(c);
+         or buf = sox_flow_effects(c, type=, gain=);
+
+     Build  and run  a chain  of SoX  effects.  `sox_effects_chain`  creates a
+     new, empty,  chain of effects  reading samples from  input stream INP  (a
+     stream open for reading) and writing  the result into output stream OUT
+     (a stream open for writing) or, if OUT is not specified, into an array.
+
+     `sox_add_effect` appends  effect NAME  to the chain  C, the  options of
+     the effect are given by the remaining arguments as scalar strings or
+     numbers (numbers are formatted as strings).  For instance:
+
+         c = sox_effects_chain(sox_open_read("in.wav"),
+                               sox_open_write("out.flac"));
+         sox_add_effect, c, "highpass", 50;
+         sox_add_effect, c, "gain", -3;
+         sox_add_effect, c, "trim", "0", "=60";
+         sox_flow_effects, c;
+
+     `sox_flow_effects` runs the chain C  until the end of the input stream.
+     If the chain has an output stream,  "rate" and "channels" effects are
+     automatically appended  if the  signal at the  end of the  chain does not
+     match the output stream and the  number of samples written so far into
+     the output stream is  returned.  Otherwise, the samples produced by the
+     chain are returned as an NC-by-NP array (or nil if there are none) whose
+     type is set by keyword TYPE (int  by default) and, for floating-point
+     types, scaled by GAIN (see `sox_read`).
+
+     The samples  are streamed through  the chain by  blocks, so files of any
+     size can be processed in constant memory when an output stream is given.
+     A chain can only be run once.  Members `c.length`, `c.rate`,
+     `c.channels` and `c.clips` give the number of effects in the chain, the
+     sampling rate and number  of channels at the end of the  chain and the
+     number of clipped samples.
+
+   SEE ALSO: sox_open_read, sox_open_write, sox_read. */
+
 extern sox_get_metadata;
 extern sox_set_metadata;
 extern sox_append_comment;
@@ -17,6 +17,12 @@
 #include <ctype.h>
 #include <math.h>
 #include <float.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include <sox.h>
 
@@ -30,6 +36,44 @@
 #define ON    1
 #define OFF   0
 
+/* Scale factor between SoX audio samples and floating-point values in the
+   range [-1,1). */
+#define SAMPLE_SCALE (1.0 + (double)SOX_SAMPLE_MAX)
+
+/* Number of SoX audio samples in temporary buffers. */
+#define SCRATCH_SIZE 65536
+
+/* Size (in bytes) of the blocks of interleaved values transposed from/to
+   the planar layout. */
+#define LAYOUT_BLOCK 8192
+
+/* Suffix of the sidecar files of the seek indexes. */
+#define INDEX_SUFFIX ".ysoxidx"
+
+/* Default size (in bytes) of the block cache and number of frames per
+   cached block. */
+#define CACHE_SIZE  (16L*1024L*1024L)
+#define CACHE_BLOCK 4096
+
+/* Default number of blocks queued by an asynchronous writer. */
+#define WRITER_QUEUE 8
+
+/* Default number of frames buffered by a background decoder and number of
+   samples it decodes at a time. */
+#define PREFETCH_FRAMES 262144
+#define PREFETCH_CHUNK  16384
+
+/* Use SIMD instructions (with runtime detection) on x86 processors with
+   compilers supporting per-function target attributes. */
+#if ! defined(YSOX_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) \
+  && (defined(__clang__) || (defined(__GNUC__) &&                       \
+                             (__GNUC__ > 4 || (__GNUC__ == 4 &&         \
+                                               __GNUC_MINOR__ >= 9))))
+#  define YSOX_X86_SIMD 1
+#  include <immintrin.h>
+#  define TARGET(isa) __attribute__ ((target(isa)))
+#endif
+
 /* Define some macros to get rid of some GNU extensions when not compiling
    with GCC. */
 #if ! (defined(__GNUC__) && __GNUC__ > 1)
@@ -47,24 +91,231 @@ static void critical(void);
 /* Structure to store a SoX stream. */
 typedef struct _ysox ysox_t;
 
-/* Push array for samples on top of the stack. */
-static void* push_samples(long channels, long samples);
+/* Push array of given type for samples on top of the stack. */
+static void* push_samples(int type, long channels, long samples);
+
+/* Push an array of given element type and dimension list. */
+static void* push_array(int type, long dims[]);
+
+/* Get the size of an element of a given Yorick type. */
+static size_t type_size(int type);
+
+/* Get the Yorick type specified by a keyword value (e.g., type=float). */
+static int get_type(int iarg);
+
+/* Get the layout specified by a keyword value, returns TRUE for "planar"
+   and FALSE for "interleaved". */
+static int get_layout(int iarg);
 
 /* Define a Yorick global symbol with an int/long/double value. */
 static void define_int_const(const char* name, int value);
 static void define_long_const(const char* name, long value);
 static void define_double_const(const char* name, double value);
 
+/* Options for reading samples. */
+typedef struct _read_opts read_opts_t;
+
 /* Read a given number of samples and left the result on top of the stack. */
-static void read_samples(ysox_t* obj, long samples);
+static void read_samples(ysox_t* obj, long samples, const read_opts_t* opts);
+
+/* Check options for reading samples. */
+static void check_read_opts(read_opts_t* opts);
+
+/* Decode at most a given number of samples into an array, the type of the
+   elements of the array is given by the options.  Returns the number of
+   samples actually decoded. */
+static long decode_samples(ysox_t* obj, void* arr, long samples,
+                           const read_opts_t* opts);
 
-/* Write samples, IARG is the stack position of the data to write.  If
-   conversion occurs, this stack element is replaced by the converted data. */
-static void write_samples(ysox_t* obj, int iarg);
+/* Write samples, IARG is the stack position of the data to write (a
+   SAMPLES-by-CHANNELS array if PLANAR is true).  If conversion occurs, this
+   stack element is replaced by the converted data. */
+static void write_samples(ysox_t* obj, int iarg, int planar);
+
+/* Read samples at offsets FIRST + k*STEP for k = 0, ..., COUNT - 1 and
+   left the result on top of the stack.  STEP may be negative. */
+static void read_strided(ysox_t* obj, long first, long step, long count,
+                         const read_opts_t* opts);
+
+/* A segment of frames to read: offset of first frame, number of frames
+   and index of first frame in the destination array. */
+typedef struct _segment {
+  long offset;
+  long count;
+  long index;
+} segment_t;
+
+/* Read a list of segments into an array (whose element type is given by the
+   options) in a single forward sweep over the stream.  The segments are
+   sorted in place by increasing offsets.  Returns the number of frames that
+   could not be read because of a premature end of stream. */
+static long read_segments(ysox_t* obj, void* arr, segment_t* seg, long nseg,
+                          const read_opts_t* opts);
 
 /* Seek to given offset. */
 static void seek_to(ysox_t* obj, long offset);
 
+/* Move forward to given offset by seeking or by decoding and discarding the
+   samples in-between.  BUF is a workspace for NBUF samples. */
+static void skip_to(ysox_t* obj, long offset, sox_sample_t* buf, long nbuf);
+
+/* Store raw samples for a number of frames (a frame is a sample for all
+   channels) at a given frame index of an array.  The element type of the
+   array and the selection and mixing of channels are given by the
+   options. */
+static void store_frames(ysox_t* obj, void* arr, long index,
+                         const sox_sample_t* src, long frames,
+                         const read_opts_t* opts);
+
+/* Get the number of channels of the result of a read operation. */
+static long output_channels(ysox_t* obj, const read_opts_t* opts);
+
+/* Push an array for the result of a read operation with CHANNELS channels
+   and frames indexed by the RANK dimensions in FDIMS.  The channel index
+   is the first dimension or the last one for a planar layout. */
+static void* push_frames(const read_opts_t* opts, long channels, long rank,
+                         const long fdims[]);
+
+/* Replace the array on top of the stack, with CHANNELS channels and FRAMES
+   frames, by a new array with COUNT frames starting at frame FIRST. */
+static void* shrink_frames(const read_opts_t* opts, long channels,
+                           long frames, long first, long count);
+
+/* Decode raw samples (for all channels), returning the number of samples
+   actually decoded.  The block cache, if any, is used by read_raw and
+   bypassed by decode_raw. */
+static long read_raw(ysox_t* obj, sox_sample_t* buf, long samples);
+static long decode_raw(ysox_t* obj, sox_sample_t* buf, long samples);
+
+/* Same as decode_raw but does not throw errors (nor check for
+   interrupts). */
+static long fetch_raw(ysox_t* obj, sox_sample_t* buf, long samples);
+
+/* Move the decoder to given offset (bypassing the block cache). */
+static void move_to(ysox_t* obj, long offset);
+
+/* Move the decoder from frame offset POS (-1 if unknown) to frame OFFSET.
+   On success, SOX_SUCCESS is returned and OBJ->offset is set to OFFSET;
+   otherwise OBJ->offset is left unchanged.  This function does not throw
+   errors. */
+static int seek_decoder(ysox_t* obj, long pos, long offset);
+
+/* Converter for the sampling rate, number of channels and precision of an
+   input stream. */
+typedef struct _converter converter_t;
+
+/* Get the signal seen by the reader of a stream (i.e., after conversion). */
+static const sox_signalinfo_t* stream_signal(ysox_t* obj);
+
+/* Attach a converter to an input stream, RATE, CHANNELS and PRECISION are
+   the target parameters.  Returns 0 on success (including when no
+   conversion is needed) and -1 on failure.  This function does not throw
+   errors. */
+static int attach_converter(ysox_t* obj, double rate, long channels,
+                            long precision);
+
+/* Produce converted samples, same semantics as read_raw but does not throw
+   errors. */
+static long convert_raw(ysox_t* obj, sox_sample_t* buf, long samples);
+
+/* Seek a converting stream to a given offset in the target space, same
+   semantics as seek_decoder. */
+static int convert_seek(ysox_t* obj, long offset);
+
+/* Background decoder of an input stream. */
+typedef struct _prefetch prefetch_t;
+
+/* Start/stop decoding ahead in a background thread, FRAMES is the size of
+   the ring buffer. */
+static void start_prefetch(ysox_t* obj, long frames);
+static void stop_prefetch(ysox_t* obj);
+
+/* Background encoder of an output stream. */
+typedef struct _writer writer_t;
+
+/* Start encoding in a background thread with a queue of NSLOTS blocks. */
+static void start_writer(ysox_t* obj, long nslots);
+
+/* Wait until all queued blocks have been written (FINISH = FALSE) or stop
+   the background encoder (FINISH = TRUE).  Returns the number of samples
+   that could not be written because of deferred errors.  This function
+   does not throw errors. */
+static long drain_writer(ysox_t* obj, int finish);
+
+/* Copy samples into a new block and queue it for the background encoder,
+   CLIPS is the number of samples clipped by the conversion. */
+static void queue_block(ysox_t* obj, const sox_sample_t* buf, size_t n,
+                        long clips);
+
+/* Get the number of queued blocks (WHICH = 0) or the maximum number of
+   queued blocks (WHICH = 1) of an output stream, 0 if no background
+   encoder. */
+static long writer_counter(ysox_t* obj, int which);
+
+/* Lowest level decoding and seeking, the arguments and the returned value
+   are the same as sox_read and sox_seek.  These functions do not throw
+   errors. */
+static size_t decode_source(ysox_t* obj, sox_sample_t* buf, size_t len);
+static size_t fetch_source(ysox_t* obj, sox_sample_t* buf, size_t len);
+static int seek_source(ysox_t* obj, sox_uint64_t offset);
+
+/* Seek index of an input stream. */
+typedef struct _seek_index seek_index_t;
+
+/* Attach a seek index to an input stream, CACHE is the name of the sidecar
+   file (NULL for none). */
+static void attach_index(ysox_t* obj, const char* cache);
+static void free_index(seek_index_t* idx);
+
+/* Seek using the index, same semantics as seek_source. */
+static int index_seek(ysox_t* obj, sox_uint64_t offset);
+
+/* Get the libSoX stream currently used for decoding. */
+static sox_format_t* active_decoder(ysox_t* obj);
+
+/* Check whether random access is possible for a stream. */
+static int stream_seekable(ysox_t* obj);
+
+/* Open a new decoder for the input of a stream, NULL on failure. */
+static sox_format_t* reopen_input(ysox_t* obj);
+
+/* Memory mapped PCM data of an input stream. */
+typedef struct _pcm_map pcm_map_t;
+
+/* Map the data of an input stream if it is uncompressed PCM.  Returns 0 on
+   success, -1 if the data cannot be mapped.  This function does not throw
+   errors. */
+static int attach_pcm_map(ysox_t* obj);
+static void free_pcm_map(pcm_map_t* map);
+
+/* Decode and seek mapped data, same semantics as sox_read and sox_seek. */
+static size_t map_read(pcm_map_t* map, sox_sample_t* buf, size_t len);
+static int map_seek(pcm_map_t* map, sox_uint64_t offset);
+
+/* Fix the length fields in the header of a WAV, AIFF or AIFF-C file of
+   FRAMES frames encoded in memory (which libSoX cannot rewind to write the
+   final sizes). */
+static void fix_header_sizes(unsigned char* p, size_t size,
+                             sox_uint64_t frames);
+
+/* Cache of decoded blocks of an input stream. */
+typedef struct _block_cache block_cache_t;
+
+/* Attach a block cache of given size (in bytes) to an input stream. */
+static void attach_cache(ysox_t* obj, long size);
+static void free_cache(block_cache_t* bc);
+
+/* Get the number of hits (WHICH = 0) or misses (WHICH = 1) of the block
+   cache of a stream, 0 if no cache. */
+static long cache_counter(ysox_t* obj, int which);
+
+/* Read samples through the block cache, same semantics as read_raw. */
+static long cached_read(ysox_t* obj, sox_sample_t* buf, long samples);
+
+/* Move the decoder of a stream with a block cache to the current offset
+   before decoding without the cache. */
+static void sync_cache(ysox_t* obj);
+
 /* Format an id=value metadata. */
 static char* format_metadata(char* buffer, const char* id, size_t id_len,
                              const char* value, size_t value_len);
@@ -72,6 +323,106 @@ static char* format_metadata(char* buffer, const char* id, size_t id_len,
 /* Switch SIGFPE on/off. */
 static void switch_fpemask(int on);
 
+/* Select the fastest conversion kernels for this machine. */
+static void init_kernels(void);
+
+/* Indices of the I/O counters of a stream (see s.stats).  Times are in
+   nanoseconds. */
+#define IO_FRAMES_IN     0 /* frames decoded */
+#define IO_BYTES_IN      1 /* bytes of encoded data read */
+#define IO_FRAMES_OUT    2 /* frames encoded */
+#define IO_BYTES_OUT     3 /* bytes of encoded data written */
+#define IO_SEEKS         4 /* number of seeks of the decoder */
+#define IO_SKIPPED       5 /* frames decoded and discarded to move forward */
+#define IO_READS         6 /* number of reading operations */
+#define IO_WRITES        7 /* number of writing operations */
+#define IO_CONVERT_TIME  8 /* time spent converting samples */
+#define IO_CODEC_TIME    9 /* time spent decoding, encoding and seeking */
+#define IO_CLIPS        10 /* number of clipped samples */
+#define IO_COUNTERS     11
+
+/* Add N to the I/O counter K of a stream and to the global total.  This
+   function may be called by any thread, provided the stream is not
+   shared. */
+static void count_io(ysox_t* obj, int k, int64_t n);
+
+/* Read the monotonic clock, in nanoseconds. */
+static int64_t clock_ns(void);
+
+/* Start and end the accounting of a read or write call of kind K (IO_READS
+   or IO_WRITES).  The time spent in the call, less the time spent in
+   libSoX, is counted as conversion time.  The conversions are thus timed
+   once per call, not for every block or sample. */
+static int64_t start_io_call(ysox_t* obj, int k);
+static void end_io_call(ysox_t* obj, int64_t mark);
+
+/* Add the clips of a stream which is being closed to the global total. */
+static void account_clips(ysox_t* obj);
+
+/* Add clips which do not belong to a sound stream to the global total. */
+static void count_clips(int64_t n);
+
+/* Push the I/O counters IO on top of the stack, CLIPS is the number of
+   clipped samples. */
+static void push_io_stats(const int64_t* io, int64_t clips);
+
+/* Convert SoX audio samples to floating-point values multiplied by SCALE.
+   Conversion can be done in-place: for single precision, DST and SRC may
+   be the same address; for double precision, SRC may be the second half of
+   the storage for DST. */
+static void (*samples_to_float)(float* dst, const sox_sample_t* src,
+                                long n, float scale);
+static void (*samples_to_double)(double* dst, const sox_sample_t* src,
+                                 long n, double scale);
+
+/* Narrow SoX audio samples to signed 16-bit integers or to unsigned bytes
+   (offset by 128) with rounding to nearest, returns the number of clipped
+   samples. */
+static long (*samples_to_short)(int16_t* dst, const sox_sample_t* src,
+                                long n);
+static long (*samples_to_uchar)(uint8_t* dst, const sox_sample_t* src,
+                                long n);
+
+/* Convert N SoX audio samples to values of type TYPE (Y_CHAR, Y_SHORT,
+   Y_INT, Y_FLOAT or Y_DOUBLE), floating-point values being multiplied by
+   GAIN, returns the number of clipped samples.  The same in-place rules as
+   for samples_to_float and samples_to_double apply. */
+static long samples_to_values(void* dst, const sox_sample_t* src, long n,
+                              int type, double gain);
+
+/* Convert values to SoX audio samples.  The kernels for floating-point
+   values return the number of clipped samples. */
+static void (*uchar_to_samples)(sox_sample_t* dst, const uint8_t* src, long n);
+static void (*short_to_samples)(sox_sample_t* dst, const int16_t* src, long n);
+static void (*int64_to_samples)(sox_sample_t* dst, const int64_t* src, long n);
+static long (*float_to_samples)(sox_sample_t* dst, const float* src, long n);
+static long (*double_to_samples)(sox_sample_t* dst, const double* src, long n);
+
+/* Copy N frames of CHANNELS interleaved values of ELSIZE bytes from SRC to
+   the planar array DST (with STRIDE frames per channel) starting at frame
+   INDEX, and conversely. */
+static void interleaved_to_planar(void* dst, long stride, long index,
+                                  const void* src, long n, long channels,
+                                  size_t elsize);
+static void planar_to_interleaved(void* dst, const void* src, long stride,
+                                  long index, long n, long channels,
+                                  size_t elsize);
+
+/* Statistics of a channel. */
+typedef struct _channel_stats {
+  sox_sample_t min, max; /* extreme values */
+  sox_sample_t last;     /* last sample */
+  double sum, sumsq;     /* sum of values and of squared values */
+  long count;            /* number of samples */
+  long crossings;        /* number of zero crossings */
+  long clips;            /* number of samples at full scale */
+} channel_stats_t;
+
+/* Update the statistics of all channels given N interleaved samples (N is
+   a multiple of the number of channels and less than 2^31). */
+static void (*channel_stats)(channel_stats_t* st, const sox_sample_t* src,
+                             long n, long channels);
+
 /*---------------------------------------------------------------------------*/
 /* PSEUDO-OBJECTS FOR AUDIO STREAM */
 
@@ -80,9 +431,38 @@ static void ysox_print(void*);
 static void ysox_eval(void*, int);
 static void ysox_extract(void*, char*);
 
+struct _read_opts {
+  int type;          /* type of result: Y_INT (raw samples), Y_SHORT or
+                        Y_CHAR (narrowed samples), Y_FLOAT or Y_DOUBLE */
+  double gain;       /* multiplier for floating-point results */
+  long nsel;         /* number of selected channels, 0 for all */
+  const long* sel;   /* 1-based indices of the selected channels */
+  long nmix;         /* number of mixed channels, 0 for no mixing */
+  const double* mix; /* NMIX-by-NIN mixing matrix with NIN the number of
+                        selected channels */
+  int planar;        /* channels are the last dimension of the result */
+  long stride;       /* number of frames of the result (planar layout) */
+};
+
 struct _ysox {
   sox_format_t* format;
   long offset;
+  read_opts_t rd;    /* default options for reading */
+  converter_t* conv; /* converter for reading, NULL if none */
+  prefetch_t* pf;    /* background decoder, NULL if none */
+  seek_index_t* idx; /* seek index, NULL if none */
+  pcm_map_t* map;    /* mapped PCM data, NULL if none */
+  block_cache_t* cache; /* cache of decoded blocks, NULL if none */
+  writer_t* wr;      /* background encoder, NULL if none */
+  void* mem;         /* use of the Yorick array of an in-memory input
+                        stream, NULL if none */
+  char* membuf;      /* bytes of an in-memory stream: the contents of the
+                        array for input, the encoded data (owned by the
+                        stream) for output */
+  size_t memsize;    /* number of bytes in membuf */
+  int64_t io[IO_COUNTERS]; /* I/O counters, io[IO_CLIPS] is the number of
+                              clips of the libSoX stream when the counters
+                              were reset */
 };
 
 static y_userobj_t ysox_type = {
@@ -93,9 +473,34 @@ static void
 ysox_free(void* addr)
 {
   ysox_t* obj = (ysox_t*)addr;
+  if (obj->wr != NULL && drain_writer(obj, TRUE) > 0) {
+    fprintf(stderr, "WARNING deferred write error for \"%s\"\n",
+            obj->format->filename);
+  }
+  if (obj->pf != NULL) {
+    stop_prefetch(obj);
+  }
+  if (obj->idx != NULL) {
+    free_index(obj->idx);
+  }
+  if (obj->map != NULL) {
+    free_pcm_map(obj->map);
+  }
+  if (obj->cache != NULL) {
+    free_cache(obj->cache);
+  }
+  if (obj->conv != NULL) {
+    free(obj->conv);
+  }
   if (obj->format != NULL) {
+    account_clips(obj);
     sox_close(obj->format);
   }
+  if (obj->mem != NULL) {
+    ydrop_use(obj->mem);
+  } else if (obj->membuf != NULL) {
+    free(obj->membuf);
+  }
 }
 
 static void
@@ -103,6 +508,7 @@ ysox_print(void* addr)
 {
   ysox_t* obj = (ysox_t*)addr;
   sox_format_t* ft = obj->format;
+  const sox_signalinfo_t* sig;
 
   if (ft == NULL) {
     y_print("SoX instance with no input/output stream", TRUE);
@@ -113,13 +519,18 @@ ysox_print(void* addr)
     y_print("SoX instance", TRUE);
     y_print("  Encoding: ", FALSE);
     y_print(sox_encodings_info[ft->encoding.encoding].name, TRUE);
-    sprintf(buf, "  Channels: %u @ %u-bit", ft->signal.channels,
-            ft->signal.precision);
+    sig = stream_signal(obj);
+    sprintf(buf, "  Channels: %u @ %u-bit", sig->channels, sig->precision);
     y_print(buf, TRUE);
-    sprintf(buf, "  Samplerate: %gHz", ft->signal.rate);
+    sprintf(buf, "  Samplerate: %gHz", sig->rate);
     y_print(buf, TRUE);
+    if (obj->conv != NULL) {
+      sprintf(buf, "  Converted from: %u channel(s) @ %u-bit, %gHz",
+              ft->signal.channels, ft->signal.precision, ft->signal.rate);
+      y_print(buf, TRUE);
+    }
 
-    seconds = ft->signal.length/ft->signal.channels/ft->signal.rate;
+    seconds = sig->length/sig->channels/sig->rate;
     if (seconds >= 60.0) {
       minutes = floor(seconds/60.0);
       seconds -= 60.0*minutes;
@@ -162,6 +573,19 @@ ysox_print(void* addr)
     }
     INFO("Title");
 #undef INFO
+
+    if (obj->io[IO_READS] > 0 || obj->io[IO_WRITES] > 0) {
+      sprintf(buf, "  I/O: %lld frame(s) decoded, %lld encoded, "
+              "%lld seek(s), %lld frame(s) skipped",
+              (long long)obj->io[IO_FRAMES_IN],
+              (long long)obj->io[IO_FRAMES_OUT],
+              (long long)obj->io[IO_SEEKS],
+              (long long)obj->io[IO_SKIPPED]);
+      y_print(buf, TRUE);
+      sprintf(buf, "  I/O time: %.3fs in codec, %.3fs in conversions",
+              1e-9*obj->io[IO_CODEC_TIME], 1e-9*obj->io[IO_CONVERT_TIME]);
+      y_print(buf, TRUE);
+    }
   }
 }
 
@@ -179,7 +603,7 @@ ysox_eval(void* addr, int argc)
   if (obj->format->mode == 'r') {
     /* Input audio stream. */
     long offset, samples;
-    long ntot = obj->format->signal.length/obj->format->signal.channels;
+    long ntot = stream_signal(obj)->length/stream_signal(obj)->channels;
     int type = yarg_typeid(0);
     int rank = yarg_rank(0);
     if (rank == 0 && (type == Y_CHAR || type == Y_SHORT || type == Y_INT
@@ -188,6 +612,30 @@ ysox_eval(void* addr, int argc)
       if (i <= 0) i += ntot;
       offset = i - 1; /* Yorick indices start at 1 */
       samples = 1;
+    } else if (rank > 0 && (type == Y_CHAR || type == Y_SHORT
+                            || type == Y_INT || type == Y_LONG)) {
+      /* Gather the samples at a list of indices. */
+      long dims[Y_DIMSIZE], n, j;
+      const long* idx = ygeta_l(0, &n, dims);
+      read_opts_t rd = obj->rd;
+      segment_t* seg;
+      void* arr;
+      rd.stride = n;
+      arr = push_frames(&rd, output_channels(obj, &rd), dims[0], dims + 1);
+      seg = ypush_scratch(n*sizeof(segment_t), NULL);
+      for (j = 0; j < n; ++j) {
+        long i = idx[j];
+        if (i <= 0) i += ntot;
+        if (i <= 0 || (ntot > 0 && i > ntot)) y_error("out of range index");
+        seg[j].offset = i - 1;
+        seg[j].count = 1;
+        seg[j].index = j;
+      }
+      if (read_segments(obj, arr, seg, n, &rd) > 0) {
+        y_error("premature end of stream");
+      }
+      yarg_drop(1); /* drop scratch buffer */
+      return;
     } else if (type == Y_VOID) {
       /* Read all remaing data. */
       offset = obj->offset;
@@ -204,17 +652,29 @@ ysox_eval(void* addr, int argc)
       }
       if (flags == Y_RUBBER1) {
         offset = 0;
-        samples = obj->format->signal.length/obj->format->signal.channels;
+        samples = ntot;
       } else {
-        long imin = ((flags & Y_MIN_DFLT) != 0 ? obj->offset + 1 : mms[0]);
-        long imax = ((flags & Y_MAX_DFLT) != 0 ? ntot : mms[1]);
-        if (mms[2] != 1) y_error("subsampling or reversing not "
-                                 "yet implemented");
-        if (imin <= 0) imin += ntot;
-        if (imax <= 0) imax += ntot;
-        if (imin > imax || imin <= 0 || imax > ntot) y_error("invalid range");
-        offset = imin - 1;
-        samples = imax - imin + 1;
+        /* For a negative step, the first and last indices default to the
+           end and to the beginning of the stream. */
+        long step = mms[2];
+        long i1, i2;
+        if (step > 0) {
+          i1 = ((flags & Y_MIN_DFLT) != 0 ? obj->offset + 1 : mms[0]);
+          i2 = ((flags & Y_MAX_DFLT) != 0 ? ntot : mms[1]);
+        } else {
+          i1 = ((flags & Y_MIN_DFLT) != 0 ? ntot : mms[0]);
+          i2 = ((flags & Y_MAX_DFLT) != 0 ? 1 : mms[1]);
+        }
+        if (i1 <= 0) i1 += ntot;
+        if (i2 <= 0) i2 += ntot;
+        if (i1 <= 0 || i1 > ntot || i2 <= 0 || i2 > ntot ||
+            (step > 0 ? i1 > i2 : i1 < i2)) y_error("invalid range");
+        offset = i1 - 1;
+        samples = (i2 - i1)/step + 1;
+        if (step != 1) {
+          read_strided(obj, offset, step, samples, &obj->rd);
+          return;
+        }
       }
     } else {
       y_error("unexpected type of argument");
@@ -223,10 +683,10 @@ ysox_eval(void* addr, int argc)
     if (offset != obj->offset) {
       seek_to(obj, offset);
     }
-    read_samples(obj, samples);
+    read_samples(obj, samples, &obj->rd);
   } else if (obj->format->mode == 'w') {
     /* Ouput audio stream. */
-    write_samples(obj, 0);
+    write_samples(obj, 0, obj->rd.planar);
   } else {
     y_error("unexpected input/output mode");
   }
@@ -237,9 +697,11 @@ ysox_extract(void* addr, char* member)
 {
   ysox_t* obj = (ysox_t*)addr;
   sox_format_t* ft = obj->format;
+  const sox_signalinfo_t* sig;
   if (ft == NULL) {
     y_error("sound stream has been closed");
   }
+  sig = stream_signal(obj);
   switch (member != NULL ? member[0] : '\0') {
   case 'b':
     if (strcmp(member, "bits_per_sample") == 0) {
@@ -248,8 +710,16 @@ ysox_extract(void* addr, char* member)
     }
     break;
   case 'c':
+    if (strcmp(member, "cache_hits") == 0) {
+      ypush_long(cache_counter(obj, 0));
+      return;
+    }
+    if (strcmp(member, "cache_misses") == 0) {
+      ypush_long(cache_counter(obj, 1));
+      return;
+    }
     if (strcmp(member, "channels") == 0) {
-      ypush_long(ft->signal.channels);
+      ypush_long(sig->channels);
       return;
     }
     if (strcmp(member, "clips") == 0) {
@@ -263,7 +733,7 @@ ysox_extract(void* addr, char* member)
     break;
   case 'd':
     if (strcmp(member, "duration") == 0) {
-      ypush_double(ft->signal.length/ft->signal.channels/ft->signal.rate);
+      ypush_double(sig->length/sig->channels/sig->rate);
       return;
     }
     break;
@@ -297,7 +767,7 @@ ysox_extract(void* addr, char* member)
     break;
   case 'l':
      if (strcmp(member, "length") == 0) {
-       ypush_long(ft->signal.length);
+       ypush_long(sig->length);
        return;
      }
      break;
@@ -315,13 +785,23 @@ ysox_extract(void* addr, char* member)
     break;
   case 'p':
     if (strcmp(member, "precision") == 0) {
-      ypush_long(ft->signal.precision);
+      ypush_long(sig->precision);
+      return;
+    }
+    break;
+  case 'q':
+    if (strcmp(member, "queued") == 0) {
+      ypush_long(writer_counter(obj, 0));
+      return;
+    }
+    if (strcmp(member, "queue_size") == 0) {
+      ypush_long(writer_counter(obj, 1));
       return;
     }
     break;
   case 'r':
     if (strcmp(member, "rate") == 0) {
-      ypush_double(ft->signal.rate);
+      ypush_double(sig->rate);
       return;
     }
     if (strcmp(member, "readable") == 0) {
@@ -331,11 +811,15 @@ ysox_extract(void* addr, char* member)
     break;
   case 's':
     if (strcmp(member, "samples") == 0) {
-      ypush_long(ft->signal.length/ft->signal.channels);
+      ypush_long(sig->length/sig->channels);
       return;
     }
     if (strcmp(member, "seekable") == 0) {
-      ypush_int(ft->seekable ? TRUE : FALSE);
+      ypush_int(stream_seekable(obj) ? TRUE : FALSE);
+      return;
+    }
+    if (strcmp(member, "stats") == 0) {
+      push_io_stats(obj->io, ft->clips - obj->io[IO_CLIPS]);
       return;
     }
     break;
@@ -385,6 +869,12 @@ Y_sox_init(int argc)
     init |= 2;
   }
 
+  /* The conversion kernels assume that SoX samples are Yorick int's. */
+  if (sizeof(sox_sample_t) != sizeof(int)) {
+    y_error("expecting 32-bit integers for SoX audio samples");
+  }
+  init_kernels();
+
   /* Audio stream objects can be used as a function. */
   if (ysox_type.uo_ops == NULL) {
     yfunc_obj(&ysox_type);
@@ -452,441 +942,5891 @@ void
 Y_sox_close(int argc)
 {
   ysox_t* obj;
+  char* bytes = NULL;
+  size_t nbytes = 0;
+  sox_uint64_t frames = 0;
 
   if (argc != 1) y_error("expecting exactly one argument");
   obj = ysox_fetch(0);
   if (obj->format != NULL) {
+    long lost = 0;
     critical();
+    if (obj->wr != NULL) {
+      lost = drain_writer(obj, TRUE);
+    }
+    if (obj->pf != NULL) {
+      stop_prefetch(obj);
+    }
+    if (obj->idx != NULL) {
+      free_index(obj->idx);
+      obj->idx = NULL;
+    }
+    if (obj->map != NULL) {
+      free_pcm_map(obj->map);
+      obj->map = NULL;
+    }
+    if (obj->cache != NULL) {
+      free_cache(obj->cache);
+      obj->cache = NULL;
+    }
+    if (obj->conv != NULL) {
+      free(obj->conv);
+      obj->conv = NULL;
+    }
+    account_clips(obj);
+    if (obj->format->mode == 'w' && obj->format->signal.channels > 0) {
+      frames = obj->format->olength/obj->format->signal.channels;
+    }
     sox_close(obj->format);
     obj->format = NULL;
     obj->offset = 0;
-  }
-}
-
-void
-Y_sox_open_read(int argc)
-{
-  if (argc != 1) {
-    y_error("expecting exactly one argument");
-  } else {
-    const char *path = fetch_path(0);
-    ysox_t* obj = ysox_push();
-    critical();
-    obj->format = sox_open_read(path, NULL, NULL, NULL);
-    if (obj->format == NULL) y_error("failed to open audio file");
-    obj->offset = 0;
-  }
-}
-
-void
-Y_sox_read(int argc)
-{
-  if (argc != 2) {
-    y_error("expecting exactly two arguments");
-  } else {
-    ysox_t* obj = ysox_fetch(1);
-    long samples = ygets_l(0);
-    read_samples(obj, samples);
-  }
-}
-
-static void
-read_samples(ysox_t* obj, long samples)
-{
-  void *buf, *tmp;
-  long channels, n, np;
-  if (obj->format == NULL || obj->format->mode != 'r') {
-    y_error("sound stream not open for reading");
-  }
-  channels = obj->format->signal.channels;
-  if (samples <= 0) {
-    if (samples < 0) {
-      y_error("invalid number of samples");
-    }
-    ypush_nil();
-    return;
-  }
-  buf = push_samples(channels, samples);
-  critical();
-  n = sox_read(obj->format, buf, channels*samples);
-  np = (n > 0 ? n/channels : 0);
-  obj->offset += np;
-  if (n < 0) y_errorn("unexpected negative count (%ld)", n);
-  if (n%channels != 0) y_warnn("number of samples (%ld) is not a "
-                               "multiple of the number of channels", n);
-  if (np < samples) {
-    if (np == 0) {
-      /* Probably end of stream. */
-      yarg_drop(1);
-      ypush_nil();
+    if (obj->mem != NULL) {
+      ydrop_use(obj->mem);
+      obj->mem = NULL;
     } else {
-      /* Short stream. */
-      tmp = push_samples(channels, np);
-      memcpy(tmp, buf, channels*np*sizeof(sox_sample_t));
-      yarg_swap(1, 0);
-      yarg_drop(1);
+      /* The encoded data of an in-memory output stream are complete. */
+      bytes = obj->membuf;
+      nbytes = obj->memsize;
+    }
+    obj->membuf = NULL;
+    obj->memsize = 0;
+    if (lost > 0) {
+      free(bytes);
+      y_errorn("deferred write error (%ld samples lost)", lost);
     }
   }
-}
-
-void
-Y_sox_seek(int argc)
-{
-  if (argc != 2) {
-    y_error("expecting exactly two arguments");
-  } else {
-    ysox_t* obj = ysox_fetch(1);
-    long offset = ygets_l(0);
-    seek_to(obj, offset);
-    yarg_drop(1); /* left the sound stream on top of the stack */
-  }
-}
-
-static void
-seek_to(ysox_t* obj, long offset)
-{
-  long channels, length;
-  if (obj->format == NULL || obj->format->mode != 'r') {
-    y_error("sound stream not open for reading");
-  }
-  channels = obj->format->signal.channels;
-  length = obj->format->signal.length;
-  if (offset < 0) y_error("offset must be nonnegative");
-  if (offset*channels < 0) y_error("integer overflow");
-  if (offset*channels > length) offset = length/channels;
-  if (obj->offset != offset) {
-    critical();
-    if (sox_seek(obj->format, offset*channels, SOX_SEEK_SET) != SOX_SUCCESS) {
-      y_errorq("sox_seek failed (%s)", obj->format->sox_errstr);
+  if (bytes != NULL) {
+    if (! yarg_subroutine() && nbytes > 0) {
+      long dims[2];
+      dims[0] = 1;
+      dims[1] = nbytes;
+      fix_header_sizes((unsigned char*)bytes, nbytes, frames);
+      memcpy(ypush_c(dims), bytes, nbytes);
     }
-    obj->offset = offset;
+    free(bytes);
   }
 }
 
-/*---------------------------------------------------------------------------*/
-/* WRITING AUDIO */
-
-static sox_bool
-overwrite_permitted(char const * filename)
-{
-  return sox_true;
-}
-
-static sox_bool
-overwrite_forbidden(char const * filename)
-{
-  return sox_false;
-}
-
 void
-Y_sox_open_write(int argc)
+Y_sox_open_read(int argc)
 {
-  sox_signalinfo_t signal;
-  sox_encodinginfo_t encodinginfo;
-  sox_format_t* ft = NULL;
-  /*sox_oob_t oob;*/
-  double rate = SOX_DEFAULT_RATE;
-  double compression = HUGE_VAL;
   ysox_t* obj;
   char* path = NULL;
+  read_opts_t rd;
+  double rate = 0.0;
+  long channels = 0, precision = 0, prefetch = 0, cache_size = 0;
+  char* cache = NULL;
   char* filetype = NULL;
-  unsigned int bits_per_sample = SOX_UNSPEC;
-  unsigned int precision = SOX_DEFAULT_PRECISION;
-  unsigned int channels = SOX_DEFAULT_CHANNELS;
-  int encoding = SOX_DEFAULT_ENCODING;
-  int overwrite = FALSE;
-  int iarg;
-  static long bits_per_sample_index = -1L;
+  int iarg, imem = -1, index_mode = 0;
+  static long cache_index = -1L;
   static long channels_index = -1L;
-  static long compression_index = -1L;
-  static long encoding_index = -1L;
   static long filetype_index = -1L;
-  static long overwrite_index = -1L;
+  static long gain_index = -1L;
+  static long index_index = -1L;
+  static long layout_index = -1L;
   static long precision_index = -1L;
+  static long prefetch_index = -1L;
   static long rate_index = -1L;
-  static long template_index = -1L;
+  static long type_index = -1L;
 
   /* Initialize all keyword indexes. */
 #define INIT(s) if (s##_index == -1L) s##_index = yget_global(#s, 0)
-  INIT(bits_per_sample);
+  INIT(cache);
   INIT(channels);
-  INIT(compression);
-  INIT(encoding);
   INIT(filetype);
-  INIT(overwrite);
+  INIT(gain);
+  INIT(index);
+  INIT(layout);
   INIT(precision);
+  INIT(prefetch);
   INIT(rate);
-  INIT(template);
+  INIT(type);
 #undef INIT
 
-  /* Initialize encoding information. */
-  sox_init_encodinginfo(&encodinginfo);
-  encodinginfo.encoding = encoding;
-  encodinginfo.bits_per_sample = bits_per_sample;
-  encodinginfo.compression = compression;
-  encodinginfo.compression = 1.0;
-
-  /* Initialize signal information. */
-  signal.rate = rate;
-  signal.channels = channels;
-  signal.precision = precision;
-  /*precision = sox_precision(encoding, bits_per_sample);*/
-  signal.length = SOX_UNKNOWN_LEN;
-  signal.mult = NULL;
-
-  /* First parse template keyword. */
-  for (iarg = argc - 1; iarg >= 0; --iarg) {
-    long index = yarg_key(iarg);
-    if (index == template_index) {
-      --iarg;
-      ft = ysox_fetch(iarg)->format;
-      if (ft == NULL) {
-        y_error("input/output of template stream has been closed");
-      }
-      memcpy(&signal, &ft->signal, sizeof(signal));
-      signal.length = SOX_UNKNOWN_LEN;
-      if (signal.mult != NULL) {
-        fprintf(stderr, "WARNING non-NULL signal.mult = 0x%lx\n",
-                (unsigned long)signal.mult);
-      }
-      memcpy(&encodinginfo, &ft->encoding, sizeof(encodinginfo));
-      filetype = ft->filetype;
-    }
-  }
-
-  /* Parse positional arguments and other keywords. */
+  /* Parse arguments. */
+  memset(&rd, 0, sizeof(rd));
+  rd.type = Y_INT;
+  rd.gain = 1.0;
   for (iarg = argc - 1; iarg >= 0; --iarg) {
     long index = yarg_key(iarg);
     if (index < 0) {
       /* Positional argument. */
-      if (path == NULL) {
-        path = fetch_path(iarg);
-      } else {
+      if (path != NULL || imem >= 0) {
         y_error("too many arguments");
+      } else if (yarg_typeid(iarg) == Y_CHAR && yarg_rank(iarg) > 0) {
+        imem = iarg;
+      } else {
+        path = fetch_path(iarg);
       }
     } else {
       /* Keyword argument. */
       --iarg;
-      if (index == bits_per_sample_index) {
-        long value = ygets_l(iarg);
-        bits_per_sample_index = (unsigned int)value;
-        if (value <= 0 || bits_per_sample_index != value) {
-          y_error("illegal bits per sample");
+      if (index == cache_index) {
+        if (! yarg_nil(iarg)) {
+          cache_size = ygets_l(iarg);
+          if (cache_size < 0) y_error("illegal cache size");
+          if (cache_size == 1) cache_size = CACHE_SIZE;
         }
       } else if (index == channels_index) {
-        long value = ygets_l(iarg);
-        channels = (unsigned int)value;
-        if (value <= 0 || channels != value) {
-          y_error("illegal number of channels");
-        }
-      } else if (index == compression_index) {
-        compression = ygets_d(iarg);
-        if (compression <= 0.0) {
-          y_error("illegal compression");
-        }
-      } else if (index == encoding_index) {
-        long value = ygets_l(iarg);
-        encoding = (unsigned int)value;
-        if (value <= 0 || encoding != value) {
-          y_error("illegal encoding");
+        if (! yarg_nil(iarg)) {
+          channels = ygets_l(iarg);
+          if (channels <= 0) y_error("illegal number of channels");
         }
       } else if (index == filetype_index) {
         filetype = ygets_q(iarg);
-      } else if (index == overwrite_index) {
-        overwrite = yarg_true(iarg);
+      } else if (index == gain_index) {
+        if (! yarg_nil(iarg)) rd.gain = ygets_d(iarg);
+      } else if (index == index_index) {
+        if (yarg_typeid(iarg) == Y_STRING) {
+          cache = fetch_path(iarg);
+          index_mode = (cache != NULL ? 2 : 0);
+        } else {
+          index_mode = yarg_true(iarg);
+        }
+      } else if (index == layout_index) {
+        if (! yarg_nil(iarg)) rd.planar = get_layout(iarg);
       } else if (index == precision_index) {
-        long value = ygets_l(iarg);
-        precision = (unsigned int)value;
-        if (value <= 0 || precision != value) {
-          y_error("illegal precision");
+        if (! yarg_nil(iarg)) {
+          precision = ygets_l(iarg);
+          if (precision <= 0 || precision > SOX_SAMPLE_PRECISION) {
+            y_error("illegal precision");
+          }
+        }
+      } else if (index == prefetch_index) {
+        if (! yarg_nil(iarg)) {
+          prefetch = ygets_l(iarg);
+          if (prefetch == 1) prefetch = PREFETCH_FRAMES;
         }
       } else if (index == rate_index) {
-        rate = ygets_d(iarg);
-        if (rate <= 0.0) {
-          y_error("illegal rate");
+        if (! yarg_nil(iarg)) {
+          rate = ygets_d(iarg);
+          if (! (rate > 0.0) || rate == HUGE_VAL) y_error("illegal rate");
         }
-      } else if (index != template_index) {
+      } else if (index == type_index) {
+        if (! yarg_nil(iarg)) rd.type = get_type(iarg);
+      } else {
         y_error("unsupported keyword");
       }
     }
   }
-  if (path == NULL) y_error("path argument is missing");
-
+  if (path == NULL && imem < 0) y_error("path argument is missing");
+  check_read_opts(&rd);
 
   obj = ysox_push();
   critical();
-  switch_fpemask(OFF);
-  obj->format = sox_open_write(path, &signal, &encodinginfo,
-                               filetype, NULL,
-                               (overwrite ? overwrite_permitted :
-                                overwrite_forbidden));
-  switch_fpemask(ON);
-  if (obj->format == NULL) y_error("failed to open audio file");
+  if (imem >= 0) {
+    /* The array is referenced by the stream which decodes it in-place. */
+    long size;
+    obj->membuf = ygeta_c(imem + 1, &size, NULL);
+    obj->memsize = size;
+    obj->mem = yget_use(imem + 1);
+    obj->format = sox_open_mem_read(obj->membuf, obj->memsize, NULL, NULL,
+                                    filetype);
+    if (obj->format == NULL) y_error("failed to open audio data");
+  } else {
+    obj->format = sox_open_read(path, NULL, NULL, filetype);
+    if (obj->format == NULL) y_error("failed to open audio file");
+  }
   obj->offset = 0;
+  obj->rd = rd;
+  attach_pcm_map(obj);
+  if ((rate > 0.0 || channels > 0 || precision > 0) &&
+      attach_converter(obj, rate, channels, precision) != 0) {
+    y_error("insufficient memory");
+  }
+  if (index_mode != 0) {
+    /* In-memory streams have no default sidecar file. */
+    if (index_mode == 1 && obj->mem != NULL) index_mode = 0;
+    if (index_mode == 1 && obj->format->filename != NULL) {
+      /* Default sidecar file. */
+      char** arr = ypush_q(NULL);
+      size_t len = strlen(obj->format->filename);
+      arr[0] = p_malloc(len + sizeof(INDEX_SUFFIX));
+      memcpy(arr[0], obj->format->filename, len);
+      memcpy(arr[0] + len, INDEX_SUFFIX, sizeof(INDEX_SUFFIX));
+      cache = arr[0];
+    }
+    attach_index(obj, cache);
+    if (index_mode == 1 && obj->format->filename != NULL) {
+      yarg_drop(1); /* left the stream on top of the stack */
+    }
+  }
+  if (prefetch > 0 && obj->map == NULL) {
+    start_prefetch(obj, prefetch);
+  }
+  if (cache_size > 0) {
+    attach_cache(obj, cache_size);
+  }
 }
 
 void
-Y_sox_write(int argc)
+Y_sox_read(int argc)
 {
-  if (argc != 2) y_error("expecting exactly two arguments");
-  write_samples(ysox_fetch(1), 0);
-}
+  ysox_t* obj = NULL;
+  read_opts_t rd = {Y_INT, 1.0};
+  long samples = 0;
+  long dims[Y_DIMSIZE], nin = 0;
+  int iarg, nargs = 0;
+  static long channels_index = -1L;
+  static long gain_index = -1L;
+  static long layout_index = -1L;
+  static long mix_index = -1L;
+  static long type_index = -1L;
 
-static void
-write_samples(ysox_t* obj, int iarg)
-{
-  void* buf;
-  long samples, channels, ntot, n;
-  long dims[Y_DIMSIZE];
-  int type, integer;
-  size_t nbits;
+  /* Initialize all keyword indexes. */
+#define INIT(s) if (s##_index == -1L) s##_index = yget_global(#s, 0)
+  INIT(channels);
+  INIT(gain);
+  INIT(layout);
+  INIT(mix);
+  INIT(type);
+#undef INIT
 
-  if (obj->format == NULL || obj->format->mode != 'w') {
-    y_error("sound stream not open for writing");
+  /* First fetch the stream to get the default options, then parse
+     the other arguments. */
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    if (yarg_key(iarg) >= 0) {
+      --iarg;
+    } else if (nargs++ == 0) {
+      obj = ysox_fetch(iarg);
+      rd = obj->rd;
+    } else if (nargs == 2) {
+      samples = ygets_l(iarg);
+    }
+  }
+  if (nargs != 2) y_error("expecting exactly two arguments");
+  if (obj->format == NULL || obj->format->mode != 'r') {
+    y_error("sound stream not open for reading");
+  }
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    long index = yarg_key(iarg);
+    if (index >= 0) {
+      --iarg;
+      if (index == channels_index) {
+        if (! yarg_nil(iarg)) {
+          long i, n, channels = stream_signal(obj)->channels;
+          rd.sel = ygeta_l(iarg, &n, dims);
+          if (dims[0] > 1) y_error("channels must be a scalar or a vector");
+          for (i = 0; i < n; ++i) {
+            if (rd.sel[i] < 1 || rd.sel[i] > channels) {
+              y_error("out of range channel index");
+            }
+          }
+          rd.nsel = n;
+        }
+      } else if (index == gain_index) {
+        rd.gain = (yarg_nil(iarg) ? 1.0 : ygets_d(iarg));
+      } else if (index == layout_index) {
+        if (! yarg_nil(iarg)) rd.planar = get_layout(iarg);
+      } else if (index == mix_index) {
+        if (! yarg_nil(iarg)) {
+          long n;
+          rd.mix = ygeta_d(iarg, &n, dims);
+          if (dims[0] == 2) {
+            rd.nmix = dims[1];
+            nin = dims[2];
+          } else if (dims[0] == 1) {
+            rd.nmix = 1;
+            nin = dims[1];
+          } else {
+            y_error("mix must be a vector or a matrix");
+          }
+        }
+      } else if (index == type_index) {
+        if (! yarg_nil(iarg)) rd.type = get_type(iarg);
+      } else {
+        y_error("unsupported keyword");
+      }
+    }
+  }
+  if (rd.nmix > 0 && nin != (rd.nsel > 0 ? rd.nsel :
+                             (long)stream_signal(obj)->channels)) {
+    y_error("mix matrix not conformable with the number of channels");
+  }
+  check_read_opts(&rd);
+  read_samples(obj, samples, &rd);
+}
+
+static void
+check_read_opts(read_opts_t* opts)
+{
+  if (opts->type != Y_CHAR && opts->type != Y_SHORT && opts->type != Y_INT
+      && opts->type != Y_FLOAT && opts->type != Y_DOUBLE) {
+    y_error("type of samples must be char, short, int, float or double");
+  }
+  if (opts->gain != 1.0 && opts->type != Y_FLOAT && opts->type != Y_DOUBLE) {
+    y_error("gain can only be applied to floating-point samples");
+  }
+}
+
+static void
+read_samples(ysox_t* obj, long samples, const read_opts_t* opts)
+{
+  read_opts_t rd;
+  void* arr;
+  long channels, np;
+  if (obj->format == NULL || obj->format->mode != 'r') {
+    y_error("sound stream not open for reading");
+  }
+  channels = output_channels(obj, opts);
+  if (samples <= 0) {
+    if (samples < 0) {
+      y_error("invalid number of samples");
+    }
+    ypush_nil();
+    return;
+  }
+  rd = *opts;
+  rd.stride = samples;
+  arr = push_frames(&rd, channels, 1, &samples);
+  np = decode_samples(obj, arr, samples, &rd);
+  if (np < samples) {
+    if (np == 0) {
+      /* Probably end of stream. */
+      yarg_drop(1);
+      ypush_nil();
+    } else {
+      /* Short stream. */
+      shrink_frames(&rd, channels, samples, 0, np);
+    }
+  }
+}
+
+static long
+decode_samples(ysox_t* obj, void* arr, long samples, const read_opts_t* opts)
+{
+  sox_sample_t* buf;
+  long channels, nbuf, np, n, got;
+  int64_t mark;
+
+  mark = start_io_call(obj, IO_READS);
+  channels = stream_signal(obj)->channels;
+  if (opts->nsel == 0 && opts->nmix == 0 && ! opts->planar
+      && type_size(opts->type) >= sizeof(sox_sample_t)) {
+    /* Samples are decoded directly into the destination array and then
+       converted in-place.  For double precision results, the raw samples
+       are decoded in the second half of the array so that the conversion
+       never overwrites samples not yet converted.  Narrowed samples do not
+       fit in the destination array and are decoded by blocks. */
+    buf = (opts->type == Y_DOUBLE ? (sox_sample_t*)arr + channels*samples :
+           (sox_sample_t*)arr);
+    np = read_raw(obj, buf, samples);
+    store_frames(obj, arr, 0, buf, np, opts);
+    end_io_call(obj, mark);
+    return np;
+  }
+
+  /* Selected or mixed channels (or narrowed samples or samples stored in
+     planar layout) are decoded by blocks in a scratch buffer. */
+  nbuf = SCRATCH_SIZE/channels;
+  if (nbuf < 1) nbuf = 1;
+  buf = ypush_scratch(nbuf*channels*sizeof(sox_sample_t), NULL);
+  for (np = 0; np < samples; np += got) {
+    n = samples - np;
+    if (n > nbuf) n = nbuf;
+    got = read_raw(obj, buf, n);
+    store_frames(obj, arr, np, buf, got, opts);
+    if (got < n) {
+      np += got;
+      break;
+    }
+  }
+  end_io_call(obj, mark);
+  yarg_drop(1); /* drop scratch buffer */
+  return np;
+}
+
+static long
+read_raw(ysox_t* obj, sox_sample_t* buf, long samples)
+{
+  if (obj->cache != NULL) {
+    return cached_read(obj, buf, samples);
+  }
+  return decode_raw(obj, buf, samples);
+}
+
+static long
+decode_raw(ysox_t* obj, sox_sample_t* buf, long samples)
+{
+  long channels, n;
+  if (obj->conv != NULL) {
+    critical();
+    return convert_raw(obj, buf, samples);
   }
   channels = obj->format->signal.channels;
-  buf = ygeta_any(iarg, &ntot, dims, &type);
+  critical();
+  n = decode_source(obj, buf, channels*samples);
+  if (n < 0) y_errorn("unexpected negative count (%ld)", n);
+  if (n%channels != 0) y_warnn("number of samples (%ld) is not a "
+                               "multiple of the number of channels", n);
+  n /= channels;
+  obj->offset += n;
+  return n;
+}
+
+static long
+fetch_raw(ysox_t* obj, sox_sample_t* buf, long samples)
+{
+  long channels, n;
+  if (obj->conv != NULL) {
+    return convert_raw(obj, buf, samples);
+  }
+  channels = obj->format->signal.channels;
+  n = decode_source(obj, buf, channels*samples);
+  n = (n > 0 ? n/channels : 0);
+  obj->offset += n;
+  return n;
+}
+
+static void
+read_strided(ysox_t* obj, long first, long step, long count,
+             const read_opts_t* opts)
+{
+  /* The stream is scanned forward from the lowest to the highest offset
+     through a bounded scratch buffer, picked samples are stored in reverse
+     order for a negative step.  Regions between picked samples are skipped
+     by seeking when the stream is seekable and they are larger than the
+     scratch buffer. */
+  read_opts_t rd;
+  sox_sample_t* buf;
+  long channels, nout, stride, lo, nbuf, j, k;
+  int64_t mark;
+  void* arr;
+  if (obj->format == NULL || obj->format->mode != 'r') {
+    y_error("sound stream not open for reading");
+  }
+  channels = stream_signal(obj)->channels;
+  nout = output_channels(obj, opts);
+  if (count <= 0) {
+    ypush_nil();
+    return;
+  }
+  mark = start_io_call(obj, IO_READS);
+  stride = (step >= 0 ? step : -step);
+  lo = (step >= 0 ? first : first + (count - 1)*step);
+  rd = *opts;
+  rd.stride = count;
+  arr = push_frames(&rd, nout, 1, &count);
+  nbuf = SCRATCH_SIZE/channels;
+  if (nbuf < 1) nbuf = 1;
+  buf = ypush_scratch(nbuf*channels*sizeof(sox_sample_t), NULL);
+  j = 0;
+  while (j < count) {
+    long i, n, got;
+    skip_to(obj, lo + j*stride, buf, nbuf);
+    n = (stride >= nbuf ? 1 : (count - 1 - j)*stride + 1);
+    if (n > nbuf) n = nbuf;
+    got = read_raw(obj, buf, n);
+    for (i = 0; i < got && j < count; i += stride, ++j) {
+      k = (step >= 0 ? j : count - 1 - j);
+      store_frames(obj, arr, k, buf + i*channels, 1, &rd);
+    }
+    if (got < n) break;
+  }
+  end_io_call(obj, mark);
+  yarg_drop(1); /* drop scratch buffer */
+  if (j < count) {
+    /* Premature end of stream, keep only the samples that were read. */
+    if (j == 0) {
+      yarg_drop(1);
+      ypush_nil();
+      return;
+    }
+    shrink_frames(&rd, nout, count, (step >= 0 ? 0 : count - j), j);
+  }
+}
+
+static void
+store_frames(ysox_t* obj, void* arr, long index, const sox_sample_t* src,
+             long frames, const read_opts_t* opts)
+{
+  long channels, nout, nin, i, j, k, clips = 0;
+  double scale;
+  float fscale;
+
+  channels = stream_signal(obj)->channels;
+  nout = output_channels(obj, opts);
+  if (opts->planar) {
+    /* Store blocks of frames in a small interleaved buffer and transpose
+       them into the destination. */
+    read_opts_t rd = *opts;
+    double blk[LAYOUT_BLOCK/sizeof(double)];
+    size_t elsize = type_size(opts->type);
+    long nb = sizeof(blk)/(nout*elsize), n;
+    void* tmp = blk;
+    if (nb < 1) {
+      nb = 1;
+      tmp = ypush_scratch(nout*elsize, NULL);
+    }
+    rd.planar = FALSE;
+    for (j = 0; j < frames; j += n) {
+      n = (frames - j < nb ? frames - j : nb);
+      store_frames(obj, tmp, 0, src + j*channels, n, &rd);
+      interleaved_to_planar(arr, opts->stride, index + j, tmp, n, nout,
+                            elsize);
+    }
+    if (tmp != blk) yarg_drop(1);
+    return;
+  }
+  nin = (opts->nsel > 0 ? opts->nsel : channels);
+  switch (opts->type) {
+  case Y_CHAR:  scale = 1.0/(1 << 24); break;
+  case Y_SHORT: scale = 1.0/(1 << 16); break;
+  case Y_INT:   scale = 1.0; break;
+  default:      scale = opts->gain/SAMPLE_SCALE;
+  }
+  fscale = (float)scale;
+  if (opts->nsel == 0 && opts->nmix == 0) {
+    /* All channels without mixing, use fast conversion kernels. */
+    obj->format->clips += samples_to_values((char*)arr +
+                                            index*nout*type_size(opts->type),
+                                            src, frames*nout, opts->type,
+                                            opts->gain);
+  } else if (opts->nmix == 0) {
+    /* Selected channels without mixing. */
+    const long* sel = opts->sel;
+    SOX_SAMPLE_LOCALS;
+    if (opts->type == Y_CHAR) {
+      uint8_t* dst = (uint8_t*)arr + index*nout;
+      for (j = 0; j < frames; ++j, src += channels, dst += nout) {
+        for (k = 0; k < nout; ++k) {
+          dst[k] = SOX_SAMPLE_TO_UNSIGNED_8BIT(src[sel[k] - 1], clips);
+        }
+      }
+    } else if (opts->type == Y_SHORT) {
+      int16_t* dst = (int16_t*)arr + index*nout;
+      for (j = 0; j < frames; ++j, src += channels, dst += nout) {
+        for (k = 0; k < nout; ++k) {
+          dst[k] = SOX_SAMPLE_TO_SIGNED_16BIT(src[sel[k] - 1], clips);
+        }
+      }
+    } else if (opts->type == Y_FLOAT) {
+      float* dst = (float*)arr + index*nout;
+      for (j = 0; j < frames; ++j, src += channels, dst += nout) {
+        for (k = 0; k < nout; ++k) {
+          dst[k] = fscale*(float)src[sel[k] - 1];
+        }
+      }
+    } else if (opts->type == Y_DOUBLE) {
+      double* dst = (double*)arr + index*nout;
+      for (j = 0; j < frames; ++j, src += channels, dst += nout) {
+        for (k = 0; k < nout; ++k) {
+          dst[k] = scale*(double)src[sel[k] - 1];
+        }
+      }
+    } else {
+      sox_sample_t* dst = (sox_sample_t*)arr + index*nout;
+      for (j = 0; j < frames; ++j, src += channels, dst += nout) {
+        for (k = 0; k < nout; ++k) {
+          dst[k] = src[sel[k] - 1];
+        }
+      }
+    }
+    obj->format->clips += clips;
+  } else {
+    /* Mixing of (selected) channels.  The matrix is stored in column-major
+       order: MIX(k,i) = mix[k + i*NMIX]. */
+    const double* mix = opts->mix;
+    const long* sel = opts->sel;
+    double sum[16], *acc = sum;
+    if (nout > 16) acc = ypush_scratch(nout*sizeof(double), NULL);
+    for (j = 0; j < frames; ++j, src += channels) {
+      for (k = 0; k < nout; ++k) {
+        acc[k] = 0.0;
+      }
+      for (i = 0; i < nin; ++i) {
+        double x = (double)src[sel != NULL ? sel[i] - 1 : i];
+        const double* m = mix + i*nout;
+        for (k = 0; k < nout; ++k) {
+          acc[k] += m[k]*x;
+        }
+      }
+      if (opts->type == Y_FLOAT) {
+        float* dst = (float*)arr + (index + j)*nout;
+        for (k = 0; k < nout; ++k) {
+          dst[k] = (float)(scale*acc[k]);
+        }
+      } else if (opts->type == Y_DOUBLE) {
+        double* dst = (double*)arr + (index + j)*nout;
+        for (k = 0; k < nout; ++k) {
+          dst[k] = scale*acc[k];
+        }
+      } else if (opts->type != Y_INT) {
+        /* Round to nearest narrow integer with saturation, bytes are
+           offset by 128. */
+        const double lo = (opts->type == Y_SHORT ? INT16_MIN : INT8_MIN);
+        const double hi = (opts->type == Y_SHORT ? INT16_MAX : INT8_MAX);
+        for (k = 0; k < nout; ++k) {
+          double x = scale*acc[k];
+          long v;
+          if (x < lo - 0.5) {
+            ++clips;
+            v = (long)lo;
+          } else if (x >= hi + 0.5) {
+            ++clips;
+            v = (long)hi;
+          } else {
+            v = (long)floor(x + 0.5);
+          }
+          if (opts->type == Y_SHORT) {
+            ((int16_t*)arr)[(index + j)*nout + k] = (int16_t)v;
+          } else {
+            ((uint8_t*)arr)[(index + j)*nout + k] = (uint8_t)(v + 128);
+          }
+        }
+      } else {
+        /* Round to nearest integer with saturation. */
+        sox_sample_t* dst = (sox_sample_t*)arr + (index + j)*nout;
+        for (k = 0; k < nout; ++k) {
+          double x = acc[k];
+          if (x < (double)SOX_SAMPLE_MIN - 0.5) {
+            ++clips;
+            dst[k] = SOX_SAMPLE_MIN;
+          } else if (x >= (double)SOX_SAMPLE_MAX + 0.5) {
+            ++clips;
+            dst[k] = SOX_SAMPLE_MAX;
+          } else {
+            dst[k] = (sox_sample_t)floor(x + 0.5);
+          }
+        }
+      }
+    }
+    if (acc != sum) yarg_drop(1);
+    obj->format->clips += clips;
+  }
+}
+
+static long
+samples_to_values(void* dst, const sox_sample_t* src, long n, int type,
+                  double gain)
+{
   switch (type) {
   case Y_CHAR:
-    nbits = 8*sizeof(char);
-    integer = TRUE;
-    break;
+    return samples_to_uchar(dst, src, n);
   case Y_SHORT:
-    nbits = 8*sizeof(short);
-    integer = TRUE;
-    break;
-  case Y_INT:
-    nbits = 8*sizeof(int);
-    integer = TRUE;
-    break;
-  case Y_LONG:
-    nbits = 8*sizeof(long);
-    integer = TRUE;
-    break;
+    return samples_to_short(dst, src, n);
   case Y_FLOAT:
-    nbits = 8*sizeof(float);
-    integer = FALSE;
+    samples_to_float(dst, src, n, (float)(gain/SAMPLE_SCALE));
     break;
   case Y_DOUBLE:
-    nbits = 8*sizeof(double);
-    integer = FALSE;
+    samples_to_double(dst, src, n, gain/SAMPLE_SCALE);
     break;
   default:
-    y_error("invalid audio data type");
+    if (dst != src) memcpy(dst, src, n*sizeof(sox_sample_t));
+  }
+  return 0;
+}
+
+static long
+output_channels(ysox_t* obj, const read_opts_t* opts)
+{
+  return (opts->nmix > 0 ? opts->nmix :
+          opts->nsel > 0 ? opts->nsel : (long)stream_signal(obj)->channels);
+}
+
+void
+Y_sox_read_into(int argc)
+{
+  ysox_t* obj = NULL;
+  read_opts_t rd = {Y_INT, 1.0};
+  void* arr = NULL;
+  long dims[Y_DIMSIZE];
+  long ntot, channels, samples, first = 1, count = -1;
+  int iarg, nargs = 0;
+  static long gain_index = -1L;
+
+  /* Initialize all keyword indexes. */
+#define INIT(s) if (s##_index == -1L) s##_index = yget_global(#s, 0)
+  INIT(gain);
+#undef INIT
+
+  /* Parse arguments. */
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    long index = yarg_key(iarg);
+    if (index < 0) {
+      /* Positional argument. */
+      switch (++nargs) {
+      case 1:
+        obj = ysox_fetch(iarg);
+        rd.gain = obj->rd.gain;
+        break;
+      case 2:
+        arr = ygeta_any(iarg, &ntot, dims, &rd.type);
+        break;
+      case 3:
+        if (! yarg_nil(iarg)) first = ygets_l(iarg);
+        break;
+      case 4:
+        if (! yarg_nil(iarg)) count = ygets_l(iarg);
+        break;
+      default:
+        y_error("too many arguments");
+      }
+    } else {
+      /* Keyword argument. */
+      --iarg;
+      if (index == gain_index) {
+        rd.gain = (yarg_nil(iarg) ? 1.0 : ygets_d(iarg));
+      } else {
+        y_error("unsupported keyword");
+      }
+    }
+  }
+  if (nargs < 2) y_error("too few arguments");
+  if (obj->format == NULL || obj->format->mode != 'r') {
+    y_error("sound stream not open for reading");
+  }
+  check_read_opts(&rd);
+
+  /* Check dimensions of the buffer and the range of samples to fill. */
+  channels = output_channels(obj, &rd);
+  if ((dims[0] == 1 || dims[0] == 2) && dims[1] == channels) {
+    samples = ntot/channels;
+  } else if (channels == 1 && dims[0] <= 1) {
+    samples = ntot;
+  } else {
+    y_error("expecting CHANNELS-by-SAMPLES buffer");
     return;
   }
-  if ((dims[0] == 1 || dims[0] == 2) && dims[1] == channels) {
-    samples = ntot/channels;
-  } else if (channels == 1 && dims[0] <= 1) {
-    samples = ntot;
-  } else {
-    y_error("expecting CHANNELS-by-SAMPLES audio data");
+  if (first < 1 || first > samples + 1) y_error("out of range first sample");
+  if (count < 0) {
+    count = samples + 1 - first;
+  } else if (first + count > samples + 1) {
+    y_error("too many samples for buffer");
+  }
+  if (count > 0) {
+    arr = (char*)arr + (first - 1)*channels*type_size(rd.type);
+    count = decode_samples(obj, arr, count, &rd);
+  }
+  ypush_long(count);
+}
+
+void
+Y_sox_seek(int argc)
+{
+  if (argc != 2) {
+    y_error("expecting exactly two arguments");
+  } else {
+    ysox_t* obj = ysox_fetch(1);
+    long offset = ygets_l(0);
+    seek_to(obj, offset);
+    yarg_drop(1); /* left the sound stream on top of the stack */
+  }
+}
+
+/* Compare segments by offset (and by index to have a stable order). */
+static int
+compare_segments(const void* a, const void* b)
+{
+  const segment_t* s1 = (const segment_t*)a;
+  const segment_t* s2 = (const segment_t*)b;
+  if (s1->offset != s2->offset) return (s1->offset < s2->offset ? -1 : 1);
+  return (s1->index < s2->index ? -1 : (s1->index > s2->index ? 1 : 0));
+}
+
+static long
+read_segments(ysox_t* obj, void* arr, segment_t* seg, long nseg,
+              const read_opts_t* opts)
+{
+  /* Segments are sorted by offset and coalesced into regions of
+     overlapping or adjacent segments.  Each region is read once, by chunks
+     in a bounded scratch buffer, and every chunk is scattered into all the
+     segments it overlaps.  Within a region, FIRST is the first segment
+     which may not be complete. */
+  sox_sample_t* buf;
+  long channels, nbuf, missing = 0, r, first, last, end;
+  int64_t mark;
+
+  if (nseg <= 0) return 0;
+  if (obj->format == NULL || obj->format->mode != 'r') {
+    y_error("sound stream not open for reading");
+  }
+  mark = start_io_call(obj, IO_READS);
+  qsort(seg, nseg, sizeof(segment_t), compare_segments);
+  channels = stream_signal(obj)->channels;
+  nbuf = SCRATCH_SIZE/channels;
+  if (nbuf < 1) nbuf = 1;
+  buf = ypush_scratch(nbuf*channels*sizeof(sox_sample_t), NULL);
+  for (r = 0; r < nseg; r = last) {
+    long pos;
+    end = seg[r].offset + seg[r].count;
+    for (last = r + 1; last < nseg && seg[last].offset <= end; ++last) {
+      if (seg[last].offset + seg[last].count > end) {
+        end = seg[last].offset + seg[last].count;
+      }
+    }
+    pos = seg[r].offset;
+    first = r;
+    if (pos < end) {
+      skip_to(obj, pos, buf, nbuf);
+    }
+    while (pos < end) {
+      long n = end - pos, got, j;
+      if (n > nbuf) n = nbuf;
+      got = read_raw(obj, buf, n);
+      for (j = first; j < last && seg[j].offset < pos + got; ++j) {
+        long lo = (seg[j].offset > pos ? seg[j].offset : pos);
+        long hi = seg[j].offset + seg[j].count;
+        if (hi > pos + got) hi = pos + got;
+        if (hi > lo) {
+          store_frames(obj, arr, seg[j].index + (lo - seg[j].offset),
+                       buf + (lo - pos)*channels, hi - lo, opts);
+        }
+      }
+      pos += got;
+      while (first < last && seg[first].offset + seg[first].count <= pos) {
+        ++first;
+      }
+      if (got < n) break;
+    }
+    if (pos < end) {
+      /* Premature end of stream, count the frames not read. */
+      long j;
+      for (j = first; j < nseg; ++j) {
+        long lo = (seg[j].offset > pos ? seg[j].offset : pos);
+        if (seg[j].offset + seg[j].count > lo) {
+          missing += seg[j].offset + seg[j].count - lo;
+        }
+      }
+      break;
+    }
+  }
+  end_io_call(obj, mark);
+  yarg_drop(1); /* drop scratch buffer */
+  return missing;
+}
+
+void
+Y_sox_read_segments(int argc)
+{
+  ysox_t* obj = NULL;
+  read_opts_t rd = {Y_INT, 1.0};
+  const long* starts = NULL;
+  const long* lengths = NULL;
+  long dims[Y_DIMSIZE], odims[Y_DIMSIZE], nseg = 0, nlen = 0, ntot, total;
+  long j, length;
+  segment_t* seg;
+  void* arr;
+  int iarg, nargs = 0, iarg_starts = -1, iarg_lengths = -1;
+  static long gain_index = -1L;
+  static long layout_index = -1L;
+  static long type_index = -1L;
+
+  /* Initialize all keyword indexes. */
+#define INIT(s) if (s##_index == -1L) s##_index = yget_global(#s, 0)
+  INIT(gain);
+  INIT(layout);
+  INIT(type);
+#undef INIT
+
+  /* First fetch the stream to get the default options, then parse
+     the other arguments. */
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    if (yarg_key(iarg) >= 0) {
+      --iarg;
+    } else {
+      switch (++nargs) {
+      case 1:
+        obj = ysox_fetch(iarg);
+        rd.type = obj->rd.type;
+        rd.gain = obj->rd.gain;
+        rd.planar = obj->rd.planar;
+        break;
+      case 2:
+        iarg_starts = iarg;
+        break;
+      case 3:
+        iarg_lengths = iarg;
+        break;
+      default:
+        y_error("too many arguments");
+      }
+    }
+  }
+  if (nargs != 3) y_error("expecting exactly three arguments");
+  if (obj->format == NULL || obj->format->mode != 'r') {
+    y_error("sound stream not open for reading");
+  }
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    long index = yarg_key(iarg);
+    if (index >= 0) {
+      --iarg;
+      if (index == gain_index) {
+        rd.gain = (yarg_nil(iarg) ? 1.0 : ygets_d(iarg));
+      } else if (index == layout_index) {
+        if (! yarg_nil(iarg)) rd.planar = get_layout(iarg);
+      } else if (index == type_index) {
+        if (! yarg_nil(iarg)) rd.type = get_type(iarg);
+      } else {
+        y_error("unsupported keyword");
+      }
+    }
+  }
+  check_read_opts(&rd);
+  lengths = ygeta_l(iarg_lengths, &nlen, odims);
+  starts = ygeta_l(iarg_starts, &nseg, dims);
+  if (odims[0] != 0 && nlen != nseg) {
+    y_error("STARTS and LENGTHS must have the same number of elements");
+  }
+
+  /* Build the list of segments. */
+  ntot = stream_signal(obj)->length/stream_signal(obj)->channels;
+  seg = ypush_scratch(nseg*sizeof(segment_t), NULL);
+  total = 0;
+  for (j = 0; j < nseg; ++j) {
+    long i = starts[j];
+    length = lengths[odims[0] != 0 ? j : 0];
+    if (i <= 0) i += ntot;
+    if (length < 0) y_error("invalid segment length");
+    if (i <= 0 || (ntot > 0 && i - 1 + length > ntot)) {
+      y_error("out of range segment");
+    }
+    seg[j].offset = i - 1;
+    seg[j].count = length;
+    seg[j].index = total;
+    total += length;
+  }
+
+  /* Push the result: NC-by-LENGTH-by-dimsof(STARTS) for a scalar length,
+     NC-by-sum(LENGTHS) otherwise (the channel index is last for the planar
+     layout). */
+  if (total <= 0) {
+    yarg_drop(1);
+    ypush_nil();
+    return;
+  }
+  rd.stride = total;
+  if (odims[0] == 0) {
+    if (dims[0] + 2 >= Y_DIMSIZE) y_error("too many dimensions");
+    odims[0] = lengths[0];
+    memcpy(odims + 1, dims + 1, dims[0]*sizeof(long));
+    arr = push_frames(&rd, output_channels(obj, &rd), dims[0] + 1, odims);
+  } else {
+    arr = push_frames(&rd, output_channels(obj, &rd), 1, &total);
+  }
+  if (read_segments(obj, arr, seg, nseg, &rd) > 0) {
+    y_error("premature end of stream");
+  }
+  yarg_swap(1, 0);
+  yarg_drop(1); /* drop scratch buffer */
+}
+
+static void
+seek_to(ysox_t* obj, long offset)
+{
+  long channels, length;
+  if (obj->format == NULL || obj->format->mode != 'r') {
+    y_error("sound stream not open for reading");
+  }
+  channels = stream_signal(obj)->channels;
+  length = stream_signal(obj)->length;
+  if (offset < 0) y_error("offset must be nonnegative");
+  if (offset*channels < 0) y_error("integer overflow");
+  if (offset*channels > length) offset = length/channels;
+  if (obj->cache != NULL) {
+    /* The decoder is moved when a missing block is loaded. */
+    obj->offset = offset;
+  } else {
+    move_to(obj, offset);
+  }
+}
+
+static void
+move_to(ysox_t* obj, long offset)
+{
+  critical();
+  if (seek_decoder(obj, obj->offset, offset) != SOX_SUCCESS) {
+    y_errorq("sox_seek failed (%s)", obj->format->sox_errstr);
+  }
+}
+
+static int
+seek_decoder(ysox_t* obj, long pos, long offset)
+{
+  if (obj->conv != NULL) {
+    return convert_seek(obj, offset);
+  }
+  if (pos != offset && seek_source(obj, offset*obj->format->signal.channels)
+      != SOX_SUCCESS) {
+    return SOX_EOF;
+  }
+  obj->offset = offset;
+  return SOX_SUCCESS;
+}
+
+static void
+skip_to(ysox_t* obj, long offset, sox_sample_t* buf, long nbuf)
+{
+  if (offset < obj->offset ||
+      obj->cache != NULL ||
+      (stream_seekable(obj) && (offset - obj->offset >= nbuf ||
+                                (obj->map != NULL && obj->conv == NULL)))) {
+    seek_to(obj, offset);
+  } else {
+    while (obj->offset < offset) {
+      long n = offset - obj->offset, got;
+      if (n > nbuf) n = nbuf;
+      got = read_raw(obj, buf, n);
+      count_io(obj, IO_SKIPPED, got);
+      if (got < n) break;
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* FORMAT CONVERSION */
+
+/* Input streams can be converted on the fly to a given sampling rate,
+   number of channels and precision.  The converter sits between the decoder
+   and all other reading functions (see read_raw and seek_to) so that
+   offsets, lengths, etc. are expressed in the target space.
+
+   Channels are converted first: down-mixing averages consecutive groups of
+   channels (e.g., all channels for a single output channel), up-mixing
+   replicates channels.  Resampling is done by band-limited interpolation
+   with a Kaiser-windowed sinc kernel whose bandwidth is reduced when
+   down-sampling to avoid aliasing.  The kernel is tabulated and linearly
+   interpolated so that any (even irrational) ratio of sampling rates can
+   be used.  Output samples are rounded to the target precision with
+   saturation. */
+
+/* Number of zero-crossings on each side of the interpolation kernel,
+   number of table entries per zero-crossing, Kaiser window parameter and
+   relative bandwidth of the low-pass filter. */
+#define RESAMPLE_ZEROS   24
+#define RESAMPLE_PHASES  512
+#define RESAMPLE_BETA    9.0
+#define RESAMPLE_ROLLOFF 0.95
+
+/* Number of source frames decoded at a time by a converter. */
+#define CONVERT_BLOCK 4096
+
+struct _converter {
+  sox_signalinfo_t signal; /* signal seen by the reader */
+  double ratio;            /* input rate over output rate */
+  long num, den;           /* idem as an irreducible fraction if both rates
+                              are integers, 0 otherwise */
+  double cutoff;           /* bandwidth relative to input Nyquist frequency */
+  long half;               /* half-width of the kernel in input frames */
+  long nin, nout;          /* number of input and output channels */
+  int resample;            /* the sampling rate is changed */
+  double step;             /* quantization step */
+  double qmin, qmax;       /* bounds for quantized values (in steps) */
+  double* hist;            /* buffered input frames (with NOUT channels) */
+  double* acc;             /* NOUT accumulators */
+  sox_sample_t* raw;       /* decoded frames (CONVERT_BLOCK frames) */
+  long base;               /* source index of first buffered frame */
+  long len;                /* number of buffered frames */
+  long cap;                /* maximum number of buffered frames */
+  long src_end;            /* number of source frames, -1 if not yet known */
+};
+
+/* Interpolation kernel shared by all converters. */
+static double* resample_table = NULL;
+
+static const sox_signalinfo_t*
+stream_signal(ysox_t* obj)
+{
+  return (obj->conv != NULL ? &obj->conv->signal : &obj->format->signal);
+}
+
+static double
+bessel_i0(double x)
+{
+  double sum = 1.0, term = 1.0, y = x*x/4.0;
+  int k;
+  for (k = 1; k < 100 && term > 1e-17*sum; ++k) {
+    term *= y/((double)k*(double)k);
+    sum += term;
+  }
+  return sum;
+}
+
+static int
+init_resample_table(void)
+{
+  const long n = RESAMPLE_ZEROS*RESAMPLE_PHASES;
+  double* tab;
+  double scl;
+  long j;
+  if (resample_table != NULL) return 0;
+  tab = malloc((n + 2)*sizeof(double));
+  if (tab == NULL) return -1;
+  scl = 1.0/bessel_i0(RESAMPLE_BETA);
+  tab[0] = 1.0;
+  for (j = 1; j < n; ++j) {
+    double u = (double)j/RESAMPLE_PHASES;
+    double r = (double)j/n;
+    tab[j] = (sin(M_PI*u)/(M_PI*u))*
+      bessel_i0(RESAMPLE_BETA*sqrt(1.0 - r*r))*scl;
+  }
+  tab[n] = tab[n + 1] = 0.0;
+  resample_table = tab;
+  return 0;
+}
+
+static long
+gcd(long a, long b)
+{
+  while (b != 0) {
+    long t = a%b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static int
+attach_converter(ysox_t* obj, double rate, long channels, long precision)
+{
+  const sox_signalinfo_t* src = &obj->format->signal;
+  converter_t* conv;
+  long nin, nout, half, cap;
+  double ratio, cutoff;
+  size_t size;
+
+  nin = src->channels;
+  nout = (channels > 0 ? channels : nin);
+  if (rate <= 0.0) rate = src->rate;
+  if (precision >= (long)src->precision) {
+    /* Precision cannot be increased. */
+    precision = 0;
+  }
+  if (rate == src->rate && nout == nin && precision == 0) {
+    /* Nothing to convert. */
+    return 0;
+  }
+  ratio = src->rate/rate;
+  cutoff = RESAMPLE_ROLLOFF*(ratio > 1.0 ? 1.0/ratio : 1.0);
+  half = (rate == src->rate ? 0 : (long)ceil(RESAMPLE_ZEROS/cutoff));
+  cap = 2*(half + CONVERT_BLOCK + 1);
+  size = (sizeof(converter_t) + (cap + 1)*nout*sizeof(double)
+          + CONVERT_BLOCK*nin*sizeof(sox_sample_t));
+  if (half > 0 && init_resample_table() != 0) return -1;
+  conv = malloc(size);
+  if (conv == NULL) return -1;
+  memset(conv, 0, sizeof(converter_t));
+  conv->hist = (double*)(conv + 1);
+  conv->acc = conv->hist + cap*nout;
+  conv->raw = (sox_sample_t*)(conv->acc + nout);
+  conv->cap = cap;
+  conv->base = 0;
+  conv->len = 0;
+  conv->src_end = -1;
+  conv->nin = nin;
+  conv->nout = nout;
+  conv->ratio = ratio;
+  conv->cutoff = cutoff;
+  conv->half = half;
+  conv->resample = (half > 0);
+  if (rate == floor(rate) && src->rate == floor(src->rate)
+      && rate <= 1e9 && src->rate <= 1e9) {
+    long g = gcd((long)src->rate, (long)rate);
+    conv->num = (long)src->rate/g;
+    conv->den = (long)rate/g;
+  }
+
+  /* Without a given precision, samples are only rounded to integers. */
+  conv->signal = *src;
+  if (precision <= 0) {
+    precision = SOX_SAMPLE_PRECISION;
+  } else {
+    conv->signal.precision = precision;
+  }
+  conv->step = ldexp(1.0, SOX_SAMPLE_PRECISION - precision);
+  conv->qmin = ldexp(-1.0, precision - 1);
+  conv->qmax = ldexp(1.0, precision - 1) - 1.0;
+
+  /* Target signal, the length is preserved if unknown. */
+  conv->signal.rate = rate;
+  conv->signal.channels = nout;
+  conv->signal.mult = NULL;
+  if (src->length != 0 && src->length != SOX_UNKNOWN_LEN) {
+    long n = src->length/nin;
+    if (conv->resample) {
+      n = (conv->num > 0 ? (n*conv->den + conv->num - 1)/conv->num :
+           (long)ceil(n/ratio));
+    }
+    conv->signal.length = n*nout;
+  }
+  obj->conv = conv;
+  return 0;
+}
+
+/* Append decoded frames to the history buffer of a converter, mixing
+   channels. */
+static void
+append_frames(converter_t* conv, const sox_sample_t* src, long frames)
+{
+  long nin = conv->nin, nout = conv->nout, i, j, k;
+  double* dst = conv->hist + conv->len*nout;
+  if (nout == nin) {
+    for (j = 0; j < frames*nin; ++j) {
+      dst[j] = (double)src[j];
+    }
+  } else if (nout < nin) {
+    /* Output channel K is the average of input channels I such that
+       floor(I*NOUT/NIN) = K. */
+    for (j = 0; j < frames; ++j, src += nin, dst += nout) {
+      for (k = 0; k < nout; ++k) {
+        dst[k] = 0.0;
+      }
+      for (i = 0; i < nin; ++i) {
+        dst[(i*nout)/nin] += (double)src[i];
+      }
+      for (k = 0; k < nout; ++k) {
+        long i0 = (k*nin + nout - 1)/nout;
+        long i1 = ((k + 1)*nin + nout - 1)/nout;
+        dst[k] /= (double)(i1 - i0);
+      }
+    }
+  } else {
+    /* Output channel K is input channel floor(K*NIN/NOUT). */
+    for (j = 0; j < frames; ++j, src += nin, dst += nout) {
+      for (k = 0; k < nout; ++k) {
+        dst[k] = (double)src[(k*nin)/nout];
+      }
+    }
+  }
+  conv->len += frames;
+}
+
+/* Make the history buffer of a converter start at source index LO (or
+   after) and extend up to source index HI (excluded) if possible.  The
+   buffered frames are always the ones just before the position of the
+   decoder. */
+static void
+fill_frames(ysox_t* obj, long lo, long hi)
+{
+  converter_t* conv = obj->conv;
+  long nin = conv->nin, nout = conv->nout;
+  for (;;) {
+    long n, got;
+    if (lo > conv->base) {
+      /* Discard frames no longer needed. */
+      n = lo - conv->base;
+      if (n > conv->len) n = conv->len;
+      if (n > 0 && n < conv->len) {
+        memmove(conv->hist, conv->hist + n*nout,
+                (conv->len - n)*nout*sizeof(double));
+      }
+      conv->base += n;
+      conv->len -= n;
+      if (conv->len == 0 && conv->src_end < 0 && stream_seekable(obj)
+          && lo - conv->base > CONVERT_BLOCK
+          && seek_source(obj, lo*nin) == SOX_SUCCESS) {
+        /* Jumped over the gap. */
+        conv->base = lo;
+      }
+    }
+    if (conv->base + conv->len >= hi || conv->src_end >= 0) {
+      return;
+    }
+    n = conv->cap - conv->len;
+    if (n > CONVERT_BLOCK) n = CONVERT_BLOCK;
+    got = decode_source(obj, conv->raw, n*nin)/nin;
+    if (got < 0) got = 0;
+    if (conv->base + conv->len + got > lo) {
+      append_frames(conv, conv->raw, got);
+    } else {
+      conv->base += got;
+    }
+    if (got < n) {
+      conv->src_end = conv->base + conv->len;
+    }
+  }
+}
+
+static long
+convert_raw(ysox_t* obj, sox_sample_t* buf, long samples)
+{
+  converter_t* conv = obj->conv;
+  const double* tab = resample_table;
+  const double fc = conv->cutoff;
+  const double phases = RESAMPLE_PHASES;
+  const long tmax = RESAMPLE_ZEROS*RESAMPLE_PHASES;
+  long nout = conv->nout, total = -1, clips = 0, i, j, k;
+  double* acc = conv->acc;
+
+  if (conv->signal.length != 0 && conv->signal.length != SOX_UNKNOWN_LEN) {
+    total = conv->signal.length/nout;
+  }
+  for (j = 0; j < samples; ++j, buf += nout) {
+    long t = obj->offset + j, c, lo, hi;
+    double frac;
+    if (total >= 0 && t >= total) break;
+    if (! conv->resample) {
+      c = t;
+      frac = 0.0;
+      lo = t;
+      hi = t + 1;
+    } else {
+      if (conv->num > 0) {
+        c = (t*conv->num)/conv->den;
+        frac = (double)((t*conv->num)%conv->den)/(double)conv->den;
+      } else {
+        double x = t*conv->ratio;
+        c = (long)floor(x);
+        frac = x - (double)c;
+      }
+      lo = c - conv->half + 1;
+      hi = c + conv->half + 1;
+    }
+    fill_frames(obj, (lo > 0 ? lo : 0), hi);
+    if (conv->src_end >= 0 && c >= conv->src_end) break;
+    if (! conv->resample) {
+      const double* x = conv->hist + (c - conv->base)*nout;
+      for (k = 0; k < nout; ++k) {
+        acc[k] = x[k];
+      }
+    } else {
+      /* Convolve the buffered frames with the interpolation kernel centered
+         at source time C + FRAC (frames outside the buffer are zero). */
+      long i0 = (lo > conv->base ? lo : conv->base);
+      long i1 = (hi < conv->base + conv->len ? hi : conv->base + conv->len);
+      for (k = 0; k < nout; ++k) {
+        acc[k] = 0.0;
+      }
+      for (i = i0; i < i1; ++i) {
+        const double* x = conv->hist + (i - conv->base)*nout;
+        double u = fabs((double)(c - i) + frac)*fc*phases;
+        long m = (long)u;
+        double w;
+        if (m >= tmax) continue;
+        w = tab[m] + (u - (double)m)*(tab[m + 1] - tab[m]);
+        for (k = 0; k < nout; ++k) {
+          acc[k] += w*x[k];
+        }
+      }
+      for (k = 0; k < nout; ++k) {
+        acc[k] *= fc;
+      }
+    }
+
+    /* Round to target precision with saturation. */
+    for (k = 0; k < nout; ++k) {
+      double q = floor(acc[k]/conv->step + 0.5);
+      if (q < conv->qmin) {
+        q = conv->qmin;
+        ++clips;
+      } else if (q > conv->qmax) {
+        q = conv->qmax;
+        ++clips;
+      }
+      buf[k] = (sox_sample_t)(q*conv->step);
+    }
+  }
+  obj->format->clips += clips;
+  obj->offset += j;
+  return j;
+}
+
+static int
+convert_seek(ysox_t* obj, long offset)
+{
+  converter_t* conv = obj->conv;
+  long lo;
+  if (conv->resample) {
+    lo = (conv->num > 0 ? (offset*conv->num)/conv->den :
+          (long)floor(offset*conv->ratio)) - conv->half + 1;
+  } else {
+    lo = offset;
+  }
+  if (lo < 0) lo = 0;
+  if (lo < conv->base) {
+    /* Restart decoding before the first needed source frame. */
+    if (seek_source(obj, lo*conv->nin) != SOX_SUCCESS) {
+      return SOX_EOF;
+    }
+    conv->base = lo;
+    conv->len = 0;
+    conv->src_end = -1;
+  }
+  obj->offset = offset;
+  return SOX_SUCCESS;
+}
+
+/*---------------------------------------------------------------------------*/
+/* BACKGROUND DECODING */
+
+/* With prefetching, a worker thread decodes the stream ahead of the reader
+   into a single-producer single-consumer ring buffer.  The positions of the
+   producer (HEAD) and of the consumer (TAIL) are only ever incremented (the
+   index in the ring is taken modulo its size which is a power of 2) and
+   are published with atomic stores so that samples are transferred without
+   locking.  The mutex and the condition variable are only used to sleep
+   when the ring is full (for the worker) or empty (for the reader).  The
+   worker is the only user of the libSoX stream while it is running, it is
+   stopped to seek and restarted at the new position. */
+
+#define ATOMIC_LOAD(p)    __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p,v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+struct _prefetch {
+  sox_format_t* format;
+  sox_sample_t* ring;
+  size_t size;           /* number of samples in the ring */
+  size_t head;           /* number of samples produced */
+  size_t tail;           /* number of samples consumed */
+  int eof;               /* the worker has reached the end of the stream */
+  int stop;              /* the worker must stop */
+  int running;           /* the worker thread has been started */
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static void
+wake_up(prefetch_t* pf)
+{
+  pthread_mutex_lock(&pf->mutex);
+  pthread_cond_broadcast(&pf->cond);
+  pthread_mutex_unlock(&pf->mutex);
+}
+
+static void*
+prefetch_worker(void* arg)
+{
+  prefetch_t* pf = (prefetch_t*)arg;
+  const size_t mask = pf->size - 1;
+  size_t head = pf->head;
+  for (;;) {
+    size_t n, got, pos;
+    if (ATOMIC_LOAD(&pf->stop)) break;
+    if (pf->size - (head - ATOMIC_LOAD(&pf->tail)) < PREFETCH_CHUNK) {
+      /* Wait for the reader to make some room. */
+      pthread_mutex_lock(&pf->mutex);
+      while (! ATOMIC_LOAD(&pf->stop) &&
+             pf->size - (head - ATOMIC_LOAD(&pf->tail)) < PREFETCH_CHUNK) {
+        pthread_cond_wait(&pf->cond, &pf->mutex);
+      }
+      pthread_mutex_unlock(&pf->mutex);
+      continue;
+    }
+    pos = head & mask;
+    n = pf->size - pos;
+    if (n > PREFETCH_CHUNK) n = PREFETCH_CHUNK;
+    got = sox_read(pf->format, pf->ring + pos, n);
+    head += got;
+    ATOMIC_STORE(&pf->head, head);
+    if (got < n) {
+      ATOMIC_STORE(&pf->eof, TRUE);
+    }
+    wake_up(pf);
+    if (got < n) break;
+  }
+  return NULL;
+}
+
+static int
+launch_worker(prefetch_t* pf)
+{
+  pf->head = 0;
+  pf->tail = 0;
+  pf->eof = FALSE;
+  pf->stop = FALSE;
+  pf->running = (pthread_create(&pf->thread, NULL, prefetch_worker,
+                                pf) == 0);
+  return pf->running;
+}
+
+static void
+halt_worker(prefetch_t* pf)
+{
+  if (pf->running) {
+    pthread_mutex_lock(&pf->mutex);
+    ATOMIC_STORE(&pf->stop, TRUE);
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+    pthread_join(pf->thread, NULL);
+    pf->running = FALSE;
+  }
+}
+
+static void
+start_prefetch(ysox_t* obj, long frames)
+{
+  prefetch_t* pf;
+  size_t size, len;
+  if (obj->pf != NULL) return;
+  len = frames*(size_t)obj->format->signal.channels;
+  for (size = 2*PREFETCH_CHUNK; size < len; size *= 2)
+    ;
+  pf = malloc(sizeof(prefetch_t) + size*sizeof(sox_sample_t));
+  if (pf == NULL) y_error("insufficient memory");
+  memset(pf, 0, sizeof(prefetch_t));
+  pf->format = active_decoder(obj);
+  pf->ring = (sox_sample_t*)(pf + 1);
+  pf->size = size;
+  pthread_mutex_init(&pf->mutex, NULL);
+  pthread_cond_init(&pf->cond, NULL);
+  if (! launch_worker(pf)) {
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->mutex);
+    free(pf);
+    y_error("failed to start decoding thread");
+  }
+  obj->pf = pf;
+}
+
+static void
+stop_prefetch(ysox_t* obj)
+{
+  prefetch_t* pf = obj->pf;
+  if (pf != NULL) {
+    obj->pf = NULL;
+    halt_worker(pf);
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->mutex);
+    free(pf);
+  }
+}
+
+static size_t
+decode_source(ysox_t* obj, sox_sample_t* buf, size_t len)
+{
+  /* The position in the encoded data is only known when decoding in the
+     caller thread (the prefetching worker owns the decoder otherwise).
+     Mapped data are not decoded by libSoX and are not timed. */
+  sox_format_t* ft;
+  sox_uint64_t pos;
+  int64_t t0;
+  size_t n;
+  if (obj->map != NULL) {
+    n = map_read(obj->map, buf, len);
+    count_io(obj, IO_FRAMES_IN, n/obj->format->signal.channels);
+    count_io(obj, IO_BYTES_IN, n*(obj->format->encoding.bits_per_sample/8));
+    return n;
+  }
+  ft = (obj->pf == NULL ? active_decoder(obj) : NULL);
+  pos = (ft != NULL ? ft->tell_off : 0);
+  t0 = clock_ns();
+  n = fetch_source(obj, buf, len);
+  count_io(obj, IO_CODEC_TIME, clock_ns() - t0);
+  count_io(obj, IO_FRAMES_IN, n/obj->format->signal.channels);
+  if (ft != NULL) {
+    count_io(obj, IO_BYTES_IN, ft->tell_off - pos);
+  }
+  return n;
+}
+
+static size_t
+fetch_source(ysox_t* obj, sox_sample_t* buf, size_t len)
+{
+  prefetch_t* pf = obj->pf;
+  size_t done = 0;
+  if (pf == NULL) {
+    return sox_read(active_decoder(obj), buf, len);
+  }
+  if (! pf->running) {
+    return 0;
+  }
+  while (done < len) {
+    size_t tail = pf->tail;
+    size_t avail = ATOMIC_LOAD(&pf->head) - tail;
+    size_t pos, n;
+    if (avail == 0) {
+      if (ATOMIC_LOAD(&pf->eof)) {
+        /* The worker may have published its last samples before
+           raising the end of stream flag. */
+        if (ATOMIC_LOAD(&pf->head) == tail) break;
+        continue;
+      }
+      pthread_mutex_lock(&pf->mutex);
+      while (ATOMIC_LOAD(&pf->head) == tail && ! ATOMIC_LOAD(&pf->eof)) {
+        pthread_cond_wait(&pf->cond, &pf->mutex);
+      }
+      pthread_mutex_unlock(&pf->mutex);
+      continue;
+    }
+    pos = tail & (pf->size - 1);
+    n = pf->size - pos;
+    if (n > avail) n = avail;
+    if (n > len - done) n = len - done;
+    memcpy(buf + done, pf->ring + pos, n*sizeof(sox_sample_t));
+    done += n;
+    ATOMIC_STORE(&pf->tail, tail + n);
+    wake_up(pf);
+  }
+  return done;
+}
+
+static int
+seek_source(ysox_t* obj, sox_uint64_t offset)
+{
+  prefetch_t* pf = obj->pf;
+  int64_t t0;
+  int status;
+  count_io(obj, IO_SEEKS, 1);
+  if (obj->map != NULL) {
+    return map_seek(obj->map, offset);
+  }
+  t0 = clock_ns();
+  if (pf != NULL) {
+    halt_worker(pf);
+  }
+  if (obj->idx != NULL) {
+    status = index_seek(obj, offset);
+  } else {
+    status = sox_seek(obj->format, offset, SOX_SEEK_SET);
+  }
+  count_io(obj, IO_CODEC_TIME, clock_ns() - t0);
+  if (pf == NULL) {
+    return status;
+  }
+  pf->format = active_decoder(obj);
+  if (! launch_worker(pf) && status == SOX_SUCCESS) {
+    status = SOX_EOF;
+  }
+  return status;
+}
+
+/*---------------------------------------------------------------------------*/
+/* BATCH LOADING */
+
+/* Files are decoded by a pool of threads, each thread repeatedly claims the
+   next file not yet processed until there are none left.  The workers do
+   not use the Yorick API, errors are recorded per file. */
+
+/* Initial number of frames allocated when the length of a file is
+   unknown. */
+#define LOAD_BLOCK 65536
+
+typedef struct _load_job load_job_t;
+struct _load_job {
+  const char* path;
+  sox_sample_t* data;   /* decoded samples */
+  long frames;          /* number of decoded frames */
+  long channels;        /* number of channels */
+  char errmsg[80];      /* error message, empty if none */
+};
+
+typedef struct _load_batch load_batch_t;
+struct _load_batch {
+  load_job_t* jobs;
+  long njobs;
+  long next;            /* index of next job to process */
+  double rate;          /* options for conversion */
+  long channels;
+  long precision;
+};
+
+static void
+free_load_batch(void* addr)
+{
+  load_batch_t* b = (load_batch_t*)addr;
+  long i;
+  for (i = 0; i < b->njobs; ++i) {
+    if (b->jobs[i].data != NULL) {
+      free(b->jobs[i].data);
+      b->jobs[i].data = NULL;
+    }
+  }
+}
+
+static void
+load_one(const load_batch_t* b, load_job_t* job)
+{
+  ysox_t obj;
+  const sox_signalinfo_t* sig;
+  long channels, size, n, got;
+
+  memset(&obj, 0, sizeof(obj));
+  if (job->path == NULL) {
+    strcpy(job->errmsg, "invalid path");
+    return;
+  }
+  obj.format = sox_open_read(job->path, NULL, NULL, NULL);
+  if (obj.format == NULL) {
+    strcpy(job->errmsg, "failed to open audio file");
+    return;
+  }
+  attach_pcm_map(&obj);
+  if (attach_converter(&obj, b->rate, b->channels, b->precision) != 0) {
+    strcpy(job->errmsg, "insufficient memory");
+    goto done;
+  }
+  sig = stream_signal(&obj);
+  channels = sig->channels;
+  if (channels < 1) {
+    strcpy(job->errmsg, "unknown number of channels");
+    goto done;
+  }
+  size = (sig->length != 0 && sig->length != SOX_UNKNOWN_LEN ?
+          sig->length/channels + 1 : LOAD_BLOCK);
+  for (;;) {
+    if (job->frames >= size || job->data == NULL) {
+      sox_sample_t* data;
+      if (job->data != NULL) size *= 2;
+      data = realloc(job->data, size*channels*sizeof(sox_sample_t));
+      if (data == NULL) {
+        strcpy(job->errmsg, "insufficient memory");
+        goto done;
+      }
+      job->data = data;
+    }
+    if (p_signalling) {
+      strcpy(job->errmsg, "interrupted");
+      goto done;
+    }
+    n = size - job->frames;
+    if (obj.conv != NULL) {
+      got = convert_raw(&obj, job->data + job->frames*channels, n);
+    } else {
+      got = decode_source(&obj, job->data + job->frames*channels,
+                          n*channels)/channels;
+    }
+    job->frames += got;
+    if (got < n) break;
+  }
+  if (obj.map == NULL && obj.format->sox_errno != 0) {
+    /* A decoding error is not the end of the input. */
+    snprintf(job->errmsg, sizeof(job->errmsg), "read error (%.64s)",
+             obj.format->sox_errstr);
+    goto done;
+  }
+  job->channels = channels;
+ done:
+  if (job->errmsg[0] != '\0' && job->data != NULL) {
+    free(job->data);
+    job->data = NULL;
+    job->frames = 0;
+  }
+  if (obj.conv != NULL) free(obj.conv);
+  if (obj.map != NULL) free_pcm_map(obj.map);
+  account_clips(&obj);
+  sox_close(obj.format);
+}
+
+static void*
+load_worker(void* arg)
+{
+  load_batch_t* b = (load_batch_t*)arg;
+  for (;;) {
+    long i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+    if (i >= b->njobs || p_signalling) break;
+    load_one(b, &b->jobs[i]);
+  }
+  return NULL;
+}
+
+void
+Y_sox_load_many(int argc)
+{
+  load_batch_t* b;
+  pthread_t* threads;
+  char** paths = NULL;
+  char** errs;
+  long* offs;
+  void* arr;
+  read_opts_t rd = {Y_INT, 1.0};
+  double rate = 0.0;
+  long dims[Y_DIMSIZE], npaths = 0, nthreads = 0, started, channels = 0;
+  long precision = 0, total, i, offs_ref = -1L, errs_ref = -1L;
+  int iarg, nargs = 0;
+  static long channels_index = -1L;
+  static long gain_index = -1L;
+  static long precision_index = -1L;
+  static long rate_index = -1L;
+  static long threads_index = -1L;
+  static long type_index = -1L;
+
+  /* Initialize all keyword indexes. */
+#define INIT(s) if (s##_index == -1L) s##_index = yget_global(#s, 0)
+  INIT(channels);
+  INIT(gain);
+  INIT(precision);
+  INIT(rate);
+  INIT(threads);
+  INIT(type);
+#undef INIT
+
+  /* Parse arguments. */
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    long index = yarg_key(iarg);
+    if (index < 0) {
+      /* Positional argument. */
+      switch (++nargs) {
+      case 1:
+        paths = ygeta_q(iarg, &npaths, dims);
+        break;
+      case 2:
+        offs_ref = yget_ref(iarg);
+        if (offs_ref < 0 && ! yarg_nil(iarg)) {
+          y_error("expecting a simple variable for the offsets");
+        }
+        break;
+      case 3:
+        errs_ref = yget_ref(iarg);
+        if (errs_ref < 0 && ! yarg_nil(iarg)) {
+          y_error("expecting a simple variable for the errors");
+        }
+        break;
+      default:
+        y_error("too many arguments");
+      }
+    } else {
+      /* Keyword argument. */
+      --iarg;
+      if (index == channels_index) {
+        if (! yarg_nil(iarg)) {
+          channels = ygets_l(iarg);
+          if (channels <= 0) y_error("illegal number of channels");
+        }
+      } else if (index == gain_index) {
+        if (! yarg_nil(iarg)) rd.gain = ygets_d(iarg);
+      } else if (index == precision_index) {
+        if (! yarg_nil(iarg)) {
+          precision = ygets_l(iarg);
+          if (precision <= 0 || precision > SOX_SAMPLE_PRECISION) {
+            y_error("illegal precision");
+          }
+        }
+      } else if (index == rate_index) {
+        if (! yarg_nil(iarg)) {
+          rate = ygets_d(iarg);
+          if (! (rate > 0.0) || rate == HUGE_VAL) y_error("illegal rate");
+        }
+      } else if (index == threads_index) {
+        if (! yarg_nil(iarg)) nthreads = ygets_l(iarg);
+      } else if (index == type_index) {
+        if (! yarg_nil(iarg)) rd.type = get_type(iarg);
+      } else {
+        y_error("unsupported keyword");
+      }
+    }
+  }
+  if (paths == NULL) y_error("missing list of paths");
+  check_read_opts(&rd);
+  if (rate > 0.0 && init_resample_table() != 0) {
+    y_error("insufficient memory");
+  }
+
+  /* Convert paths on the interpreter thread. */
+  errs = ypush_q(dims);
+  for (i = 0; i < npaths; ++i) {
+    errs[i] = (paths[i] != NULL ? p_native(paths[i]) : NULL);
+  }
+  paths = errs;
+
+  /* Decode all files. */
+  b = ypush_scratch(sizeof(load_batch_t) + npaths*sizeof(load_job_t),
+                    free_load_batch);
+  memset(b, 0, sizeof(load_batch_t) + npaths*sizeof(load_job_t));
+  b->jobs = (load_job_t*)(b + 1);
+  b->njobs = npaths;
+  b->rate = rate;
+  b->channels = channels;
+  b->precision = precision;
+  for (i = 0; i < npaths; ++i) {
+    b->jobs[i].path = paths[i];
+  }
+  if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > npaths) nthreads = npaths;
+  if (nthreads < 1) nthreads = 1;
+  threads = ypush_scratch(nthreads*sizeof(pthread_t), NULL);
+  for (started = 0; started < nthreads; ++started) {
+    if (pthread_create(&threads[started], NULL, load_worker, b) != 0) break;
+  }
+  if (started == 0) load_worker(b);
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  yarg_drop(1); /* drop thread identifiers */
+  critical();
+
+  /* All files must have the same number of channels. */
+  for (i = 0; i < npaths && channels == 0; ++i) {
+    if (b->jobs[i].errmsg[0] == '\0') channels = b->jobs[i].channels;
+  }
+  total = 0;
+  for (i = 0; i < npaths; ++i) {
+    load_job_t* job = &b->jobs[i];
+    if (job->errmsg[0] == '\0' && job->channels != channels) {
+      strcpy(job->errmsg, "number of channels differs");
+      free(job->data);
+      job->data = NULL;
+      job->frames = 0;
+    }
+    total += job->frames;
+  }
+
+  /* Concatenate the samples. */
+  if (total > 0) {
+    arr = push_samples(rd.type, channels, total);
+    total = 0;
+    for (i = 0; i < npaths; ++i) {
+      load_job_t* job = &b->jobs[i];
+      long n = job->frames*channels;
+      if (n <= 0) continue;
+      count_clips(samples_to_values((char*)arr + total*type_size(rd.type),
+                                    job->data, n, rd.type, rd.gain));
+      total += n;
+    }
+  } else {
+    ypush_nil();
+  }
+
+  /* Store the optional outputs. */
+  if (offs_ref >= 0) {
+    long odims[2];
+    odims[0] = 1;
+    odims[1] = npaths + 1;
+    offs = ypush_l(odims);
+    offs[0] = 0;
+    for (i = 0; i < npaths; ++i) {
+      offs[i + 1] = offs[i] + b->jobs[i].frames;
+    }
+    yput_global(offs_ref, 0);
+    yarg_drop(1);
+  }
+  if (errs_ref >= 0) {
+    errs = ypush_q(dims);
+    for (i = 0; i < npaths; ++i) {
+      errs[i] = (b->jobs[i].errmsg[0] != '\0' ?
+                 p_strcpy(b->jobs[i].errmsg) : NULL);
+    }
+    yput_global(errs_ref, 0);
+    yarg_drop(1);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* SIDECAR FILES */
+
+/* Sidecar files store data computed from an audio file (overviews, seek
+   indexes).  They start with a magic string followed by a key and by the
+   path of the audio file, the data are only valid if the key and the path
+   match. */
+
+typedef struct _sidecar_key sidecar_key_t;
+struct _sidecar_key {
+  int64_t size;         /* size of audio file */
+  int64_t mtime;        /* modification time of audio file */
+  int64_t length;       /* length of stream as given by the header */
+  int64_t channels;     /* number of channels seen by the reader */
+  int64_t block;        /* number of frames per block */
+  double  rate;         /* sampling rate seen by the reader */
+  int64_t pathlen;      /* length of path */
+};
+
+/* Fill the key of the sidecar file of an audio file, returns -1 if the
+   audio file cannot be identified. */
+static int
+sidecar_key(sidecar_key_t* key, const char* path,
+            const sox_signalinfo_t* sig, long block)
+{
+  struct stat st;
+  if (path == NULL || stat(path, &st) != 0) return -1;
+  memset(key, 0, sizeof(*key));
+  key->size = st.st_size;
+  key->mtime = st.st_mtime;
+  key->length = sig->length;
+  key->channels = sig->channels;
+  key->block = block;
+  key->rate = sig->rate;
+  key->pathlen = strlen(path);
+  return 0;
+}
+
+/* Open a sidecar file for reading and check its header, returns NULL if the
+   file does not exist or does not match. */
+static FILE*
+open_sidecar(const char* cache, const char* magic, const sidecar_key_t* key,
+             const char* path)
+{
+  sidecar_key_t tmp;
+  char buf[8];
+  char* name;
+  FILE* file;
+  int ok;
+  file = fopen(cache, "rb");
+  if (file == NULL) return NULL;
+  ok = (fread(buf, 1, 8, file) == 8 && memcmp(buf, magic, 8) == 0
+        && fread(&tmp, sizeof(tmp), 1, file) == 1
+        && memcmp(&tmp, key, sizeof(tmp)) == 0);
+  if (ok) {
+    name = malloc(key->pathlen + 1);
+    ok = (name != NULL && fread(name, 1, key->pathlen, file) == key->pathlen
+          && memcmp(name, path, key->pathlen) == 0);
+    if (name != NULL) free(name);
+  }
+  if (! ok) {
+    fclose(file);
+    return NULL;
+  }
+  return file;
+}
+
+/* Create a sidecar file and write its header, returns NULL on failure. */
+static FILE*
+create_sidecar(const char* cache, const char* magic, const sidecar_key_t* key,
+               const char* path)
+{
+  FILE* file = fopen(cache, "wb");
+  if (file == NULL) return NULL;
+  if (fwrite(magic, 1, 8, file) != 8
+      || fwrite(key, sizeof(*key), 1, file) != 1
+      || fwrite(path, 1, key->pathlen, file) != key->pathlen) {
+    fclose(file);
+    remove(cache);
+    return NULL;
+  }
+  return file;
+}
+
+/*---------------------------------------------------------------------------*/
+/* OVERVIEWS */
+
+/* An overview is a multi-resolution pyramid of the minimum, maximum and mean
+   square values of the samples of each channel over blocks of frames.  The
+   first level has blocks of BLOCK frames, each level groups OVERVIEW_FACTOR
+   blocks of the previous level, the last level has a single block.  For a
+   query with N frames per pixel, the level with the largest blocks not
+   exceeding N frames is used so that each pixel combines less than
+   OVERVIEW_FACTOR + 2 blocks.
+
+   Overviews are saved in a sidecar file together with the path, size and
+   modification time of the audio file (and the signal seen by the reader)
+   so that they can be reloaded without decoding the audio file. */
+
+#define OVERVIEW_BLOCK  256
+#define OVERVIEW_FACTOR 4
+#define OVERVIEW_SUFFIX ".ysoxov"
+#define OVERVIEW_MAGIC  "YSOXOV01"
+
+static void yoverview_free(void*);
+static void yoverview_print(void*);
+static void yoverview_extract(void*, char*);
+
+/* Values stored for each block and channel. */
+#define OV_MIN 0
+#define OV_MAX 1
+#define OV_MS  2
+#define OV_VALUES 3
+
+typedef struct _yoverview yoverview_t;
+struct _yoverview {
+  long channels;        /* number of channels */
+  long frames;          /* number of frames */
+  long block;           /* number of frames per block of first level */
+  long levels;          /* number of levels */
+  double rate;          /* sampling rate */
+  long nblocks[64];     /* number of blocks per level */
+  float* level[64];     /* OV_VALUES-by-CHANNELS-by-NBLOCKS values per level */
+  float* data;          /* storage for all levels */
+  long size;            /* number of values in DATA */
+};
+
+static y_userobj_t yoverview_type = {
+  "SoX overview", yoverview_free, yoverview_print, NULL, yoverview_extract
+};
+
+static void
+yoverview_free(void* addr)
+{
+  yoverview_t* ov = (yoverview_t*)addr;
+  if (ov->data != NULL) free(ov->data);
+}
+
+static void
+yoverview_print(void* addr)
+{
+  yoverview_t* ov = (yoverview_t*)addr;
+  char buf[128];
+  sprintf(buf, "SoX overview: %ld channel(s), %ld samples @ %gHz, "
+          "%ld level(s)", ov->channels, ov->frames, ov->rate, ov->levels);
+  y_print(buf, TRUE);
+}
+
+static void
+yoverview_extract(void* addr, char* member)
+{
+  yoverview_t* ov = (yoverview_t*)addr;
+  if (strcmp(member, "block") == 0) {
+    ypush_long(ov->block);
+  } else if (strcmp(member, "channels") == 0) {
+    ypush_long(ov->channels);
+  } else if (strcmp(member, "levels") == 0) {
+    ypush_long(ov->levels);
+  } else if (strcmp(member, "rate") == 0) {
+    ypush_double(ov->rate);
+  } else if (strcmp(member, "samples") == 0) {
+    ypush_long(ov->frames);
+  } else {
+    y_error("bad member name");
+  }
+}
+
+/* Compute the number of blocks per level and allocate the storage, returns
+   -1 on failure. */
+static int
+setup_overview(yoverview_t* ov)
+{
+  long l, n, size = 0;
+  n = (ov->frames + ov->block - 1)/ov->block;
+  if (n < 1) n = 1;
+  for (l = 0; l < 64; ++l) {
+    ov->nblocks[l] = n;
+    size += OV_VALUES*ov->channels*n;
+    if (n == 1) break;
+    n = (n + OVERVIEW_FACTOR - 1)/OVERVIEW_FACTOR;
+  }
+  if (l >= 64) return -1;
+  ov->levels = l + 1;
+  ov->data = malloc(size*sizeof(float));
+  if (ov->data == NULL) return -1;
+  ov->size = size;
+  size = 0;
+  for (l = 0; l < ov->levels; ++l) {
+    ov->level[l] = ov->data + size;
+    size += OV_VALUES*ov->channels*ov->nblocks[l];
+  }
+  return 0;
+}
+
+/* Number of frames in J-th block of level L. */
+static long
+overview_count(const yoverview_t* ov, long l, long j)
+{
+  long bs = ov->block, k, n;
+  for (k = 0; k < l; ++k) bs *= OVERVIEW_FACTOR;
+  n = ov->frames - j*bs;
+  return (n < bs ? (n > 0 ? n : 0) : bs);
+}
+
+/* Build the upper levels of the pyramid from the first one. */
+static void
+reduce_overview(yoverview_t* ov)
+{
+  long nc = ov->channels, l, j, k, c;
+  for (l = 1; l < ov->levels; ++l) {
+    const float* src = ov->level[l - 1];
+    float* dst = ov->level[l];
+    for (j = 0; j < ov->nblocks[l]; ++j) {
+      for (c = 0; c < nc; ++c) {
+        double vmin = HUGE_VAL, vmax = -HUGE_VAL, sum = 0.0, cnt = 0.0;
+        for (k = j*OVERVIEW_FACTOR; k < (j + 1)*OVERVIEW_FACTOR
+               && k < ov->nblocks[l - 1]; ++k) {
+          const float* v = src + OV_VALUES*(c + nc*k);
+          double n = (double)overview_count(ov, l - 1, k);
+          if (n <= 0.0) continue;
+          if (v[OV_MIN] < vmin) vmin = v[OV_MIN];
+          if (v[OV_MAX] > vmax) vmax = v[OV_MAX];
+          sum += n*v[OV_MS];
+          cnt += n;
+        }
+        dst[OV_VALUES*(c + nc*j) + OV_MIN] = (cnt > 0.0 ? vmin : 0.0);
+        dst[OV_VALUES*(c + nc*j) + OV_MAX] = (cnt > 0.0 ? vmax : 0.0);
+        dst[OV_VALUES*(c + nc*j) + OV_MS] = (cnt > 0.0 ? sum/cnt : 0.0);
+      }
+    }
+  }
+}
+
+/* Load a sidecar file, returns 0 on success. */
+static int
+load_overview(yoverview_t* ov, const char* cache, const char* path,
+              const sox_signalinfo_t* sig)
+{
+  sidecar_key_t key;
+  int64_t frames;
+  FILE* file;
+  int status = -1;
+  if (sidecar_key(&key, path, sig, ov->block) != 0) return -1;
+  file = open_sidecar(cache, OVERVIEW_MAGIC, &key, path);
+  if (file == NULL) return -1;
+  if (fread(&frames, sizeof(frames), 1, file) == 1 && frames >= 0) {
+    ov->frames = frames;
+    if (setup_overview(ov) == 0) {
+      if (fread(ov->data, sizeof(float), ov->size, file) == ov->size) {
+        status = 0;
+      } else {
+        free(ov->data);
+        ov->data = NULL;
+      }
+    }
+  }
+  fclose(file);
+  return status;
+}
+
+/* Save a sidecar file, failures are ignored. */
+static void
+save_overview(const yoverview_t* ov, const char* cache, const char* path,
+              const sox_signalinfo_t* sig)
+{
+  sidecar_key_t key;
+  int64_t frames = ov->frames;
+  FILE* file;
+  int ok;
+  if (sidecar_key(&key, path, sig, ov->block) != 0) return;
+  file = create_sidecar(cache, OVERVIEW_MAGIC, &key, path);
+  if (file == NULL) return;
+  ok = (fwrite(&frames, sizeof(frames), 1, file) == 1
+        && fwrite(ov->data, sizeof(float), ov->size, file) == ov->size);
+  if (fclose(file) != 0 || ! ok) remove(cache);
+}
+
+/* Growable buffer for the first level of an overview while scanning. */
+typedef struct _ov_blocks {
+  float* data;
+  long size;            /* number of blocks allocated */
+} ov_blocks_t;
+
+static void
+free_ov_blocks(void* addr)
+{
+  ov_blocks_t* b = (ov_blocks_t*)addr;
+  if (b->data != NULL) free(b->data);
+}
+
+/* Build the overview of a stream in one pass. */
+static void
+scan_overview(yoverview_t* ov, ysox_t* obj)
+{
+  sox_sample_t* buf;
+  ov_blocks_t* blk;
+  long nc = ov->channels, nbuf, got, i, c, j = 0, cnt = 0;
+  double* acc;
+  const double scale = 1.0/SAMPLE_SCALE;
+
+  nbuf = SCRATCH_SIZE/nc;
+  if (nbuf < ov->block) nbuf = ov->block;
+  nbuf -= nbuf%ov->block;
+  blk = ypush_scratch(sizeof(ov_blocks_t), free_ov_blocks);
+  buf = ypush_scratch(nbuf*nc*sizeof(sox_sample_t) +
+                      OV_VALUES*nc*sizeof(double), NULL);
+  acc = (double*)(buf + nbuf*nc);
+  seek_to(obj, 0);
+  ov->frames = 0;
+  do {
+    got = read_raw(obj, buf, nbuf);
+    for (i = 0; i < got; ++i) {
+      const sox_sample_t* x = buf + i*nc;
+      if (cnt == 0) {
+        for (c = 0; c < nc; ++c) {
+          acc[OV_VALUES*c + OV_MIN] = HUGE_VAL;
+          acc[OV_VALUES*c + OV_MAX] = -HUGE_VAL;
+          acc[OV_VALUES*c + OV_MS] = 0.0;
+        }
+      }
+      for (c = 0; c < nc; ++c) {
+        double v = scale*(double)x[c];
+        double* a = acc + OV_VALUES*c;
+        if (v < a[OV_MIN]) a[OV_MIN] = v;
+        if (v > a[OV_MAX]) a[OV_MAX] = v;
+        a[OV_MS] += v*v;
+      }
+      if (++cnt == ov->block || (i == got - 1 && got < nbuf)) {
+        if (j >= blk->size) {
+          long size = 2*blk->size + 1024;
+          float* data = realloc(blk->data, OV_VALUES*nc*size*sizeof(float));
+          if (data == NULL) y_error("insufficient memory");
+          blk->data = data;
+          blk->size = size;
+        }
+        for (c = 0; c < nc; ++c) {
+          float* v = blk->data + OV_VALUES*(c + nc*j);
+          v[OV_MIN] = acc[OV_VALUES*c + OV_MIN];
+          v[OV_MAX] = acc[OV_VALUES*c + OV_MAX];
+          v[OV_MS] = acc[OV_VALUES*c + OV_MS]/cnt;
+        }
+        ++j;
+        cnt = 0;
+      }
+    }
+    ov->frames += got;
+  } while (got == nbuf);
+  if (setup_overview(ov) != 0) y_error("insufficient memory");
+  if (j > 0) {
+    memcpy(ov->level[0], blk->data, OV_VALUES*nc*j*sizeof(float));
+  } else {
+    memset(ov->level[0], 0, OV_VALUES*nc*sizeof(float));
+  }
+  yarg_drop(2); /* drop scratch buffers */
+  reduce_overview(ov);
+}
+
+void
+Y_sox_overview(int argc)
+{
+  ysox_t* obj = NULL;
+  yoverview_t* ov;
+  const sox_signalinfo_t* sig;
+  char* cache = NULL;
+  char* path;
+  long block = OVERVIEW_BLOCK;
+  int iarg, nargs = 0, use_cache = TRUE;
+  static long block_index = -1L;
+  static long cache_index = -1L;
+
+  /* Initialize all keyword indexes. */
+#define INIT(s) if (s##_index == -1L) s##_index = yget_global(#s, 0)
+  INIT(block);
+  INIT(cache);
+#undef INIT
+
+  /* Parse arguments. */
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    long index = yarg_key(iarg);
+    if (index < 0) {
+      if (++nargs > 1) y_error("too many arguments");
+      obj = ysox_fetch(iarg);
+    } else {
+      --iarg;
+      if (index == block_index) {
+        if (! yarg_nil(iarg)) {
+          block = ygets_l(iarg);
+          if (block < 1) y_error("invalid block size");
+        }
+      } else if (index == cache_index) {
+        if (yarg_typeid(iarg) == Y_STRING) {
+          cache = fetch_path(iarg);
+        } else {
+          use_cache = yarg_true(iarg);
+        }
+      } else {
+        y_error("unsupported keyword");
+      }
+    }
+  }
+  if (obj == NULL) y_error("missing sound stream");
+  if (obj->format == NULL || obj->format->mode != 'r') {
+    y_error("sound stream not open for reading");
+  }
+  sig = stream_signal(obj);
+  path = (obj->mem == NULL ? obj->format->filename : NULL);
+  if (use_cache && cache == NULL && path != NULL) {
+    char** arr = ypush_q(NULL);
+    size_t len = strlen(path);
+    arr[0] = p_malloc(len + sizeof(OVERVIEW_SUFFIX));
+    memcpy(arr[0], path, len);
+    memcpy(arr[0] + len, OVERVIEW_SUFFIX, sizeof(OVERVIEW_SUFFIX));
+    cache = arr[0];
+  }
+
+  ov = (yoverview_t*)ypush_obj(&yoverview_type, sizeof(yoverview_t));
+  ov->channels = sig->channels;
+  ov->rate = sig->rate;
+  ov->block = block;
+  if (ov->channels < 1) y_error("unknown number of channels");
+  if (use_cache && cache != NULL
+      && load_overview(ov, cache, path, sig) == 0) {
+    return;
+  }
+  scan_overview(ov, obj);
+  if (use_cache && cache != NULL) {
+    save_overview(ov, cache, path, sig);
+  }
+}
+
+void
+Y_sox_envelope(int argc)
+{
+  yoverview_t* ov;
+  double* env;
+  long first, last, npix, span, fpp, bs, l, p, c, nc;
+  long dims[4];
+
+  if (argc != 4) y_error("expecting exactly four arguments");
+  ov = (yoverview_t*)yget_obj(argc - 1, &yoverview_type);
+  first = (yarg_nil(argc - 2) ? 1 : ygets_l(argc - 2));
+  last = (yarg_nil(argc - 3) ? ov->frames : ygets_l(argc - 3));
+  npix = ygets_l(argc - 4);
+  if (first <= 0) first += ov->frames;
+  if (last <= 0) last += ov->frames;
+  if (first < 1 || last > ov->frames || first > last) {
+    y_error("invalid range of samples");
+  }
+  if (npix < 1) y_error("invalid number of pixels");
+  nc = ov->channels;
+  span = last - first + 1;
+
+  /* Select the level with the largest blocks not larger than a pixel. */
+  fpp = span/npix;
+  bs = ov->block;
+  for (l = 0; l + 1 < ov->levels && bs*OVERVIEW_FACTOR <= fpp; ++l) {
+    bs *= OVERVIEW_FACTOR;
+  }
+
+  dims[0] = 3;
+  dims[1] = OV_VALUES;
+  dims[2] = nc;
+  dims[3] = npix;
+  env = ypush_d(dims);
+  for (p = 0; p < npix; ++p) {
+    long a = first - 1 + (p*span)/npix;
+    long b = first - 1 + ((p + 1)*span)/npix;
+    long j0, j1, j;
+    if (b <= a) b = a + 1;
+    j0 = a/bs;
+    j1 = (b - 1)/bs;
+    for (c = 0; c < nc; ++c) {
+      double vmin = HUGE_VAL, vmax = -HUGE_VAL, sum = 0.0, cnt = 0.0;
+      double* dst = env + OV_VALUES*(c + nc*p);
+      for (j = j0; j <= j1; ++j) {
+        const float* v = ov->level[l] + OV_VALUES*(c + nc*j);
+        double n = (double)overview_count(ov, l, j);
+        if (v[OV_MIN] < vmin) vmin = v[OV_MIN];
+        if (v[OV_MAX] > vmax) vmax = v[OV_MAX];
+        sum += n*v[OV_MS];
+        cnt += n;
+      }
+      dst[OV_MIN] = vmin;
+      dst[OV_MAX] = vmax;
+      dst[OV_MS] = (cnt > 0.0 ? sqrt(sum/cnt) : 0.0);
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* SEEK INDEX */
+
+/* Seeking in MPEG audio files is either not supported or approximate with
+   libSoX.  The seek index of an MPEG audio file stores the byte offsets of
+   its frames (found by scanning the frame headers) and a hash of every block
+   of decoded samples corresponding to an MPEG frame (computed by decoding
+   the file once).  To seek, a new decoder is started on the mapped file a
+   few frames before the target frame (the bit reservoir of layer III makes
+   the first decoded frames unreliable), the decoded blocks are hashed until
+   one uniquely matches a block of the index which gives the exact position
+   of the decoder, then samples are decoded and discarded up to the target
+   position.  If this fails, or for other formats which are not seekable,
+   the file is reopened and decoded from the beginning.
+
+   The decoder used after seeking is owned by the index, the stream
+   structure is kept unchanged for its other properties (signal, metadata,
+   etc.). */
+
+#define INDEX_MAGIC   "YSOXIX01"
+#define INDEX_PRIMING 8    /* number of frames decoded before the target */
+#define INDEX_WINDOW  32   /* half-width of window for matching hashes */
+#define INDEX_TRIES   64   /* maximum number of blocks to match */
+
+struct _seek_index {
+  sox_format_t* dec;       /* decoder used after seeking, NULL to use the
+                              stream itself */
+  unsigned char* map;      /* mapped audio file, NULL if none */
+  size_t mapsize;          /* size of mapping */
+  int borrowed;            /* map is the buffer of an in-memory stream */
+  long spf;                /* samples per MPEG frame and per channel */
+  long nframes;            /* number of MPEG frames, 0 if no index */
+  long nblocks;            /* number of blocks of decoded samples */
+  int64_t* offsets;        /* byte offsets of MPEG frames */
+  uint64_t* hashes;        /* hashes of blocks of decoded samples */
+};
+
+static sox_format_t*
+active_decoder(ysox_t* obj)
+{
+  return (obj->idx != NULL && obj->idx->dec != NULL ? obj->idx->dec :
+          obj->format);
+}
+
+static int
+stream_seekable(ysox_t* obj)
+{
+  return (obj->format->seekable || obj->idx != NULL || obj->map != NULL);
+}
+
+static void
+free_index(seek_index_t* idx)
+{
+  if (idx->dec != NULL) sox_close(idx->dec);
+  if (idx->map != NULL && ! idx->borrowed) munmap(idx->map, idx->mapsize);
+  if (idx->offsets != NULL) free(idx->offsets);
+  if (idx->hashes != NULL) free(idx->hashes);
+  free(idx);
+}
+
+static uint64_t
+hash_samples(const sox_sample_t* buf, size_t n)
+{
+  /* 64-bit FNV-1a. */
+  const unsigned char* p = (const unsigned char*)buf;
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < n*sizeof(sox_sample_t); ++i) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/* Parse an MPEG audio frame header, returns the size of the frame in bytes
+   (0 if not a valid header) and stores the number of samples per channel in
+   the frame and the sampling rate. */
+static long
+mpeg_frame(const unsigned char* p, size_t avail, long* spf, long* rate)
+{
+  static const short kbps[2][3][15] = {
+    {{0,32,64,96,128,160,192,224,256,288,320,352,384,416,448},
+     {0,32,48,56,64,80,96,112,128,160,192,224,256,320,384},
+     {0,32,40,48,56,64,80,96,112,128,160,192,224,256,320}},
+    {{0,32,48,56,64,80,96,112,128,144,160,176,192,224,256},
+     {0,8,16,24,32,40,48,56,64,80,96,112,128,144,160},
+     {0,8,16,24,32,40,48,56,64,80,96,112,128,144,160}}
+  };
+  static const long rates[3] = {44100, 48000, 32000};
+  int version, layer, index, pad, lsf;
+  long br, sr;
+  if (avail < 4 || p[0] != 0xFF || (p[1] & 0xE0) != 0xE0) return 0;
+  version = (p[1] >> 3) & 3; /* 0: MPEG 2.5, 2: MPEG 2, 3: MPEG 1 */
+  layer = 4 - ((p[1] >> 1) & 3);
+  index = (p[2] >> 4) & 15;
+  if (version == 1 || layer == 4 || index == 0 || index == 15
+      || ((p[2] >> 2) & 3) == 3) return 0;
+  lsf = (version != 3);
+  br = 1000L*kbps[lsf][layer - 1][index];
+  sr = rates[(p[2] >> 2) & 3] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+  pad = (p[2] >> 1) & 1;
+  *rate = sr;
+  if (layer == 1) {
+    *spf = 384;
+    return (12*br/sr + pad)*4;
+  }
+  *spf = (layer == 3 && lsf ? 576 : 1152);
+  return (layer == 3 && lsf ? 72 : 144)*br/sr + pad;
+}
+
+/* Scan the frames of a mapped MPEG audio file, returns the number of
+   frames. */
+static long
+scan_mpeg_frames(seek_index_t* idx)
+{
+  const unsigned char* p = idx->map;
+  size_t size = idx->mapsize, pos = 0;
+  long n = 0, cap = 0, spf0 = 0, rate0 = 0;
+  if (size >= 10 && memcmp(p, "ID3", 3) == 0) {
+    /* Skip ID3v2 tag. */
+    pos = 10 + (((size_t)(p[6] & 0x7F) << 21) | ((p[7] & 0x7F) << 14) |
+                ((p[8] & 0x7F) << 7) | (p[9] & 0x7F));
+    if ((p[5] & 0x10) != 0) pos += 10;
+  }
+  while (pos < size) {
+    long spf, rate, spf1, rate1;
+    long len = mpeg_frame(p + pos, size - pos, &spf, &rate);
+    /* Require the next frame to be consistent to avoid false syncs. */
+    if (len <= 0 || pos + len > size || (spf0 != 0 && (spf != spf0 ||
+                                                       rate != rate0))
+        || (pos + len < size
+            && (mpeg_frame(p + pos + len, size - pos - len, &spf1,
+                           &rate1) <= 0 || spf1 != spf || rate1 != rate))) {
+      if (n > 0 && pos + len >= size) break;
+      ++pos;
+      continue;
+    }
+    if (n >= cap) {
+      int64_t* offsets;
+      cap = 2*cap + 4096;
+      offsets = realloc(idx->offsets, cap*sizeof(int64_t));
+      if (offsets == NULL) return -1;
+      idx->offsets = offsets;
+    }
+    idx->offsets[n++] = pos;
+    spf0 = spf;
+    rate0 = rate;
+    pos += len;
+  }
+  idx->spf = spf0;
+  idx->nframes = n;
+  return n;
+}
+
+/* Decode the whole file and hash the blocks of decoded samples. */
+static int
+hash_mpeg_blocks(seek_index_t* idx, ysox_t* obj)
+{
+  sox_format_t* ft;
+  sox_sample_t* buf;
+  long nc = obj->format->signal.channels, cap = 0;
+  size_t len = idx->spf*nc, got;
+  int status = -1;
+  ft = reopen_input(obj);
+  if (ft == NULL) return -1;
+  buf = malloc(len*sizeof(sox_sample_t));
+  if (buf == NULL) {
+    sox_close(ft);
+    return -1;
+  }
+  idx->nblocks = 0;
+  while (! p_signalling) {
+    got = sox_read(ft, buf, len);
+    if (got == 0) {
+      status = 0;
+      break;
+    }
+    if (idx->nblocks >= cap) {
+      uint64_t* hashes;
+      cap = 2*cap + 4096;
+      hashes = realloc(idx->hashes, cap*sizeof(uint64_t));
+      if (hashes == NULL) break;
+      idx->hashes = hashes;
+    }
+    idx->hashes[idx->nblocks++] = hash_samples(buf, got);
+    if (got < len) {
+      status = 0;
+      break;
+    }
+  }
+  free(buf);
+  sox_close(ft);
+  return status;
+}
+
+static int
+load_index(seek_index_t* idx, const char* cache, ysox_t* obj)
+{
+  sidecar_key_t key;
+  int64_t hdr[3];
+  FILE* file;
+  int status = -1;
+  if (sidecar_key(&key, obj->format->filename, &obj->format->signal,
+                  0) != 0) return -1;
+  file = open_sidecar(cache, INDEX_MAGIC, &key, obj->format->filename);
+  if (file == NULL) return -1;
+  if (fread(hdr, sizeof(int64_t), 3, file) == 3
+      && hdr[0] > 0 && hdr[1] > 0 && hdr[2] > 0
+      && (uint64_t)hdr[1] <= idx->mapsize) {
+    idx->spf = hdr[0];
+    idx->nframes = hdr[1];
+    idx->nblocks = hdr[2];
+    idx->offsets = malloc(idx->nframes*sizeof(int64_t));
+    idx->hashes = malloc(idx->nblocks*sizeof(uint64_t));
+    if (idx->offsets != NULL && idx->hashes != NULL
+        && fread(idx->offsets, sizeof(int64_t), idx->nframes,
+                 file) == idx->nframes
+        && fread(idx->hashes, sizeof(uint64_t), idx->nblocks,
+                 file) == idx->nblocks) {
+      /* A stale or corrupted sidecar may have offsets beyond the mapped
+         file, the index is rebuilt if they are not all increasing and
+         within the file. */
+      long i;
+      status = 0;
+      for (i = 0; i < idx->nframes; ++i) {
+        if (idx->offsets[i] < (i > 0 ? idx->offsets[i-1] + 1 : 0)
+            || (uint64_t)idx->offsets[i] >= idx->mapsize) {
+          status = -1;
+          break;
+        }
+      }
+    }
+  }
+  fclose(file);
+  return status;
+}
+
+static void
+save_index(const seek_index_t* idx, const char* cache, ysox_t* obj)
+{
+  sidecar_key_t key;
+  int64_t hdr[3];
+  FILE* file;
+  int ok;
+  if (sidecar_key(&key, obj->format->filename, &obj->format->signal,
+                  0) != 0) return;
+  file = create_sidecar(cache, INDEX_MAGIC, &key, obj->format->filename);
+  if (file == NULL) return;
+  hdr[0] = idx->spf;
+  hdr[1] = idx->nframes;
+  hdr[2] = idx->nblocks;
+  ok = (fwrite(hdr, sizeof(int64_t), 3, file) == 3
+        && fwrite(idx->offsets, sizeof(int64_t), idx->nframes,
+                  file) == idx->nframes
+        && fwrite(idx->hashes, sizeof(uint64_t), idx->nblocks,
+                  file) == idx->nblocks);
+  if (fclose(file) != 0 || ! ok) remove(cache);
+}
+
+static void
+free_index_scratch(void* addr)
+{
+  seek_index_t** ptr = (seek_index_t**)addr;
+  if (*ptr != NULL) free_index(*ptr);
+}
+
+static int
+is_mpeg_audio(const char* filetype)
+{
+  return (filetype != NULL && (strcmp(filetype, "mp3") == 0 ||
+                               strcmp(filetype, "mp2") == 0));
+}
+
+static void
+attach_index(ysox_t* obj, const char* cache)
+{
+  seek_index_t** ptr;
+  seek_index_t* idx;
+  const char* path = obj->format->filename;
+  if (obj->idx != NULL) return;
+  if (path == NULL && obj->mem == NULL) y_error("no file to index");
+  if (! is_mpeg_audio(obj->format->filetype) && stream_seekable(obj)) {
+    /* No index needed. */
+    return;
+  }
+
+  /* The index is owned by a scratch object until it is complete. */
+  ptr = ypush_scratch(sizeof(seek_index_t*), free_index_scratch);
+  idx = malloc(sizeof(seek_index_t));
+  if (idx == NULL) y_error("insufficient memory");
+  memset(idx, 0, sizeof(seek_index_t));
+  *ptr = idx;
+  if (is_mpeg_audio(obj->format->filetype)) {
+    if (obj->mem != NULL) {
+      /* Frames are scanned in the array of an in-memory stream. */
+      idx->map = (unsigned char*)obj->membuf;
+      idx->mapsize = obj->memsize;
+      idx->borrowed = TRUE;
+    } else {
+      int fd = open(path, O_RDONLY);
+      struct stat st;
+      if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+          idx->map = addr;
+          idx->mapsize = st.st_size;
+        }
+      }
+      if (fd >= 0) close(fd);
+    }
+    if (idx->map != NULL
+        && (cache == NULL || load_index(idx, cache, obj) != 0)) {
+      /* Build the index. */
+      if (idx->offsets != NULL) free(idx->offsets);
+      if (idx->hashes != NULL) free(idx->hashes);
+      idx->offsets = NULL;
+      idx->hashes = NULL;
+      idx->nblocks = 0;
+      if (scan_mpeg_frames(idx) <= 0 || hash_mpeg_blocks(idx, obj) != 0) {
+        idx->nframes = 0;
+      } else if (cache != NULL) {
+        save_index(idx, cache, obj);
+      }
+      critical();
+    }
+  }
+  obj->idx = idx;
+  *ptr = NULL;
+  yarg_drop(1);
+}
+
+/* Decode and discard a number of samples, returns 0 on success. */
+static int
+discard_samples(sox_format_t* ft, sox_uint64_t count)
+{
+  sox_sample_t buf[4096];
+  while (count > 0) {
+    size_t n = (count > 4096 ? 4096 : count);
+    if (sox_read(ft, buf, n) != n) return -1;
+    count -= n;
+  }
+  return 0;
+}
+
+static sox_format_t*
+reopen_input(ysox_t* obj)
+{
+  if (obj->mem != NULL) {
+    return sox_open_mem_read(obj->membuf, obj->memsize, NULL, NULL,
+                             obj->format->filetype);
+  }
+  if (obj->format->filename == NULL) return NULL;
+  return sox_open_read(obj->format->filename, NULL, NULL,
+                       obj->format->filetype);
+}
+
+static void
+replace_decoder(seek_index_t* idx, sox_format_t* dec)
+{
+  if (idx->dec != NULL) sox_close(idx->dec);
+  idx->dec = dec;
+}
+
+/* Try to seek the decoder of an MPEG audio file to frame T (in samples per
+   channel) by starting decoding at MPEG frame S.  Returns 0 on success, 1
+   if decoding should start earlier and -1 on failure. */
+static int
+restart_mpeg(ysox_t* obj, long s, long t)
+{
+  seek_index_t* idx = obj->idx;
+  sox_format_t* dec;
+  sox_sample_t* buf;
+  long nc = obj->format->signal.channels, b = t/idx->spf, lo, hi, k, j;
+  size_t len = idx->spf*nc;
+  int status = -1;
+  lo = s - INDEX_WINDOW;
+  hi = b + INDEX_WINDOW;
+  if (lo < 0) lo = 0;
+  if (hi > idx->nblocks) hi = idx->nblocks;
+  dec = sox_open_mem_read(idx->map + idx->offsets[s],
+                          idx->mapsize - idx->offsets[s], NULL, NULL,
+                          obj->format->filetype);
+  if (dec == NULL) return -1;
+  buf = malloc(len*sizeof(sox_sample_t));
+  if (buf == NULL) {
+    sox_close(dec);
+    return -1;
+  }
+  for (k = 0; k < INDEX_TRIES; ++k) {
+    long match = -1, count = 0;
+    uint64_t h;
+    if (sox_read(dec, buf, len) != len) break;
+    h = hash_samples(buf, len);
+    for (j = lo; j < hi; ++j) {
+      if (idx->hashes[j] == h) {
+        match = j;
+        ++count;
+      }
+    }
+    if (count == 1) {
+      /* The decoder is now at the beginning of block MATCH + 1. */
+      long pos = (match + 1)*idx->spf;
+      if (pos > t) {
+        status = 1;
+      } else if (discard_samples(dec, (sox_uint64_t)(t - pos)*nc) == 0) {
+        count_io(obj, IO_SKIPPED, t - pos);
+        status = 0;
+      }
+      break;
+    }
+  }
+  free(buf);
+  if (status == 0) {
+    replace_decoder(idx, dec);
+  } else {
+    sox_close(dec);
+  }
+  return status;
+}
+
+static int
+index_seek(ysox_t* obj, sox_uint64_t offset)
+{
+  seek_index_t* idx = obj->idx;
+  sox_format_t* dec;
+  long nc = obj->format->signal.channels;
+  long t = offset/nc, s;
+
+  if (idx->nframes > 0 && idx->spf > 0) {
+    s = t/idx->spf - INDEX_PRIMING;
+    if (s >= idx->nframes) s = idx->nframes - 1;
+    for (;;) {
+      int status;
+      if (s < 0) s = 0;
+      status = restart_mpeg(obj, s, t);
+      if (status == 0) return SOX_SUCCESS;
+      if (status < 0 || s == 0) break;
+      s -= 4*INDEX_PRIMING;
+    }
+  }
+
+  /* Fallback: reopen the file and decode from the beginning. */
+  dec = reopen_input(obj);
+  if (dec == NULL) return SOX_EOF;
+  if (discard_samples(dec, offset) != 0) {
+    sox_close(dec);
+    return SOX_EOF;
+  }
+  count_io(obj, IO_SKIPPED, t);
+  replace_decoder(idx, dec);
+  return SOX_SUCCESS;
+}
+
+/*---------------------------------------------------------------------------*/
+/* MAPPED PCM DATA */
+
+/* The data of uncompressed integer PCM files (WAV, RF64, Wave64, AIFF,
+   AIFF-C and headerless raw files) are mapped in memory and converted
+   directly from the mapped pages, bypassing the buffered input and the
+   per-sample conversion of libSoX.  Seeking in mapped data is just setting
+   the position, reading a slice is thus a page cache hit with no system
+   call.  The libSoX stream is kept open for the other properties.  The data
+   region is located by parsing the file header and is checked against the
+   length reported by libSoX. */
+
+struct _pcm_map {
+  unsigned char* addr;       /* address of mapped file, NULL for the
+                                array of an in-memory stream */
+  size_t size;               /* size of mapped file */
+  const unsigned char* data; /* address of first sample */
+  sox_uint64_t length;       /* number of samples */
+  sox_uint64_t pos;          /* current sample position */
+  int bytes;                 /* bytes per sample */
+  int big;                   /* data is big endian? */
+  int flip;                  /* value to xor the sign bit of unsigned data */
+};
+
+#define GET_LE16(p) ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8))
+#define GET_LE32(p) (GET_LE16(p) | ((uint32_t)(p)[2] << 16) | \
+                     ((uint32_t)(p)[3] << 24))
+#define GET_LE64(p) ((uint64_t)GET_LE32(p) | ((uint64_t)GET_LE32(p + 4) << 32))
+#define GET_BE16(p) (((uint32_t)(p)[0] << 8) | (uint32_t)(p)[1])
+#define GET_BE32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+                     ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+#define PUT_LE32(p, x) ((p)[0] = (x) & 0xFF, (p)[1] = ((x) >> 8) & 0xFF, \
+                        (p)[2] = ((x) >> 16) & 0xFF, (p)[3] = ((x) >> 24) & 0xFF)
+#define PUT_BE32(p, x) ((p)[0] = ((x) >> 24) & 0xFF, \
+                        (p)[1] = ((x) >> 16) & 0xFF, \
+                        (p)[2] = ((x) >> 8) & 0xFF, (p)[3] = (x) & 0xFF)
+
+static void
+free_pcm_map(pcm_map_t* map)
+{
+  if (map->addr != NULL) munmap(map->addr, map->size);
+  free(map);
+}
+
+/* Locate the data region of a RIFF/RIFX/RF64 file, returns its offset or
+   -1. */
+static long
+riff_data(const unsigned char* p, size_t size)
+{
+  size_t pos = 12;
+  int big = (memcmp(p, "RIFX", 4) == 0);
+  while (pos + 8 <= size) {
+    uint32_t len = (big ? GET_BE32(p + pos + 4) : GET_LE32(p + pos + 4));
+    if (memcmp(p + pos, "data", 4) == 0) return pos + 8;
+    pos += 8 + (size_t)len + (len & 1);
+  }
+  return -1;
+}
+
+/* The size of the data of a WAV file is computed from the number of frames
+   and the block alignment (blocks of several frames for ADPCM and GSM
+   encodings) to exclude the pad byte which may follow the data.  The number
+   of frames is also stored in the "fact" chunk written for non-PCM
+   encodings. */
+static void
+fix_wav_sizes(unsigned char* p, size_t size, sox_uint64_t frames)
+{
+  size_t pos = 12, fmt = 0, fact = 0, off = 0;
+  sox_uint64_t bytes;
+  while (pos + 8 <= size) {
+    uint32_t len = GET_LE32(p + pos + 4);
+    if (memcmp(p + pos, "data", 4) == 0) {
+      off = pos + 8;
+      break;
+    }
+    if (memcmp(p + pos, "fmt ", 4) == 0 && len >= 16 &&
+        pos + 8 + len <= size) {
+      fmt = pos + 8;
+    } else if (memcmp(p + pos, "fact", 4) == 0 && len >= 4 &&
+               pos + 12 <= size) {
+      fact = pos + 8;
+    }
+    pos += 8 + (size_t)len + (len & 1);
+  }
+  if (off == 0) return;
+  bytes = size - off;
+  if (fmt != 0) {
+    unsigned int tag = GET_LE16(p + fmt);
+    sox_uint64_t align = GET_LE16(p + fmt + 12), spb = 1, n;
+    if ((tag == 0x0002 || tag == 0x0011 || tag == 0x0031) &&
+        GET_LE32(p + fmt - 4) >= 20) {
+      /* MS ADPCM, IMA ADPCM and GSM store the number of frames per block
+         after the size of the extension. */
+      spb = GET_LE16(p + fmt + 18);
+    }
+    if (align > 0 && spb > 0) {
+      n = (frames + spb - 1)/spb*align;
+      if (n <= bytes) bytes = n;
+    }
+  }
+  PUT_LE32(p + 4, size - 8);
+  PUT_LE32(p + off - 4, bytes);
+  if (fact != 0) PUT_LE32(p + fact, frames);
+}
+
+/* The number of frames is stored in the "COMM" chunk and the size of the
+   "SSND" chunk (8 bytes for the offset and the block size followed by the
+   data) excludes the pad byte which may follow the data. */
+static void
+fix_aiff_sizes(unsigned char* p, size_t size, sox_uint64_t frames)
+{
+  size_t pos = 12, comm = 0;
+  while (pos + 8 <= size) {
+    uint32_t len = GET_BE32(p + pos + 4);
+    if (memcmp(p + pos, "SSND", 4) == 0) {
+      sox_uint64_t bytes = size - pos - 8, n;
+      if (comm != 0) {
+        n = frames*GET_BE16(p + comm)*((GET_BE16(p + comm + 6) + 7)/8) + 8;
+        if (n <= bytes) bytes = n;
+        PUT_BE32(p + comm + 2, frames);
+      }
+      PUT_BE32(p + 4, size - 8);
+      PUT_BE32(p + pos + 4, bytes);
+      return;
+    }
+    if (memcmp(p + pos, "COMM", 4) == 0 && len >= 18 && pos + 26 <= size) {
+      comm = pos + 8;
+    }
+    pos += 8 + (size_t)len + (len & 1);
+  }
+}
+
+static void
+fix_header_sizes(unsigned char* p, size_t size, sox_uint64_t frames)
+{
+  if (size < 12 || size > 0xFFFFFFFF || frames > 0xFFFFFFFF) return;
+  if (memcmp(p, "RIFF", 4) == 0 && memcmp(p + 8, "WAVE", 4) == 0) {
+    fix_wav_sizes(p, size, frames);
+  } else if (memcmp(p, "FORM", 4) == 0 && (memcmp(p + 8, "AIFF", 4) == 0 ||
+                                           memcmp(p + 8, "AIFC", 4) == 0)) {
+    fix_aiff_sizes(p, size, frames);
+  }
+}
+
+/* Locate the data region of a Wave64 file, returns its offset or -1. */
+static long
+w64_data(const unsigned char* p, size_t size)
+{
+  size_t pos = 40;
+  while (pos + 24 <= size) {
+    uint64_t len = GET_LE64(p + pos + 16);
+    if (memcmp(p + pos, "data", 4) == 0) return pos + 24;
+    if (len < 24) break;
+    pos += (len + 7) & ~(uint64_t)7;
+  }
+  return -1;
+}
+
+/* Locate the data region of an AIFF or AIFF-C file, returns its offset or
+   -1.  BIG is set according to the byte order of AIFF-C data. */
+static long
+aiff_data(const unsigned char* p, size_t size, int* big)
+{
+  size_t pos = 12;
+  int aifc = (memcmp(p + 8, "AIFC", 4) == 0);
+  long off = -1;
+  *big = TRUE;
+  while (pos + 8 <= size) {
+    uint32_t len = GET_BE32(p + pos + 4);
+    if (memcmp(p + pos, "COMM", 4) == 0 && aifc) {
+      if (len < 22 || pos + 8 + 22 > size) return -1;
+      if (memcmp(p + pos + 26, "sowt", 4) == 0) {
+        *big = FALSE;
+      } else if (memcmp(p + pos + 26, "NONE", 4) != 0 &&
+                 memcmp(p + pos + 26, "twos", 4) != 0) {
+        return -1;
+      }
+    } else if (memcmp(p + pos, "SSND", 4) == 0 && pos + 16 <= size) {
+      off = pos + 16 + GET_BE32(p + pos + 8);
+    }
+    pos += 8 + (size_t)len + (len & 1);
+  }
+  return off;
+}
+
+static int
+is_raw_type(const char* filetype)
+{
+  static const char* names[] = {
+    "raw", "s8", "s16", "s24", "s32", "u8", "u16", "u24", "u32",
+    "sb", "sw", "sl", "ub", "uw", "s1", "s2", "s3", "s4",
+    "u1", "u2", "u3", "u4", NULL
+  };
+  int i;
+  if (filetype == NULL) return FALSE;
+  for (i = 0; names[i] != NULL; ++i) {
+    if (strcmp(filetype, names[i]) == 0) return TRUE;
+  }
+  return FALSE;
+}
+
+static int
+attach_pcm_map(ysox_t* obj)
+{
+  sox_format_t* ft = obj->format;
+  const sox_encodinginfo_t* enc = &ft->encoding;
+  const unsigned char* p;
+  pcm_map_t* map;
+  struct stat st;
+  void* addr;
+  size_t size;
+  long off;
+  int fd, bytes, big;
+  static const union { uint16_t u; unsigned char c[2]; } one = { 1 };
+
+  /* Only integer PCM data in regular files or in memory can be mapped. */
+  if (ft->mode != 'r') return -1;
+  if (obj->mem == NULL && (ft->filename == NULL || ! ft->seekable)) {
+    return -1;
+  }
+  if (enc->encoding != SOX_ENCODING_SIGN2 &&
+      enc->encoding != SOX_ENCODING_UNSIGNED) return -1;
+  bytes = enc->bits_per_sample/8;
+  if (bytes < 1 || bytes > 4 || enc->bits_per_sample != 8*bytes ||
+      enc->reverse_nibbles || enc->reverse_bits) return -1;
+  if (ft->signal.channels < 1 || ft->signal.length == 0 ||
+      ft->signal.length == SOX_UNKNOWN_LEN) return -1;
+  if (obj->mem != NULL) {
+    /* The array of an in-memory stream is used as is. */
+    addr = NULL;
+    size = obj->memsize;
+    p = (const unsigned char*)obj->membuf;
+    if (size < 12) return -1;
+  } else {
+    fd = open(ft->filename, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || ! S_ISREG(st.st_mode) || st.st_size < 12) {
+      close(fd);
+      return -1;
+    }
+    size = st.st_size;
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return -1;
+    p = addr;
+  }
+
+  /* Locate the data and figure out their byte order. */
+  if (memcmp(p, "RIFF", 4) == 0 || memcmp(p, "RIFX", 4) == 0 ||
+      memcmp(p, "RF64", 4) == 0) {
+    off = (memcmp(p + 8, "WAVE", 4) == 0 ? riff_data(p, size) : -1);
+    big = (memcmp(p, "RIFX", 4) == 0);
+  } else if (memcmp(p, "riff", 4) == 0 && size >= 40) {
+    off = w64_data(p, size);
+    big = FALSE;
+  } else if (memcmp(p, "FORM", 4) == 0 && (memcmp(p + 8, "AIFF", 4) == 0 ||
+                                           memcmp(p + 8, "AIFC", 4) == 0)) {
+    off = aiff_data(p, size, &big);
+  } else if (is_raw_type(ft->filetype)) {
+    off = 0;
+    big = ((one.c[0] == 0) != (enc->reverse_bytes != 0));
+  } else {
+    off = -1;
+  }
+  if (off < 0 || (sox_uint64_t)off > (sox_uint64_t)size ||
+      ft->signal.length > (size - off)/bytes) {
+    if (addr != NULL) munmap(addr, size);
+    return -1;
+  }
+  map = malloc(sizeof(pcm_map_t));
+  if (map == NULL) {
+    if (addr != NULL) munmap(addr, size);
+    return -1;
+  }
+  map->addr = addr;
+  map->size = size;
+  map->data = p + off;
+  map->length = ft->signal.length;
+  map->pos = 0;
+  map->bytes = bytes;
+  map->big = big;
+  map->flip = (enc->encoding == SOX_ENCODING_UNSIGNED ? 1 << 31 : 0);
+  obj->map = map;
+  return 0;
+}
+
+static size_t
+map_read(pcm_map_t* map, sox_sample_t* buf, size_t len)
+{
+  const unsigned char* src;
+  uint32_t flip = map->flip;
+  size_t i;
+  if (len > map->length - map->pos) len = map->length - map->pos;
+  src = map->data + map->pos*map->bytes;
+  switch (map->bytes) {
+  case 1:
+    for (i = 0; i < len; ++i) {
+      buf[i] = (sox_sample_t)(((uint32_t)src[i] << 24) ^ flip);
+    }
+    break;
+  case 2:
+    if (map->big) {
+      for (i = 0; i < len; ++i, src += 2) {
+        buf[i] = (sox_sample_t)((((uint32_t)src[0] << 24) |
+                                 ((uint32_t)src[1] << 16)) ^ flip);
+      }
+    } else {
+      for (i = 0; i < len; ++i, src += 2) {
+        buf[i] = (sox_sample_t)((((uint32_t)src[1] << 24) |
+                                 ((uint32_t)src[0] << 16)) ^ flip);
+      }
+    }
+    break;
+  case 3:
+    if (map->big) {
+      for (i = 0; i < len; ++i, src += 3) {
+        buf[i] = (sox_sample_t)((((uint32_t)src[0] << 24) |
+                                 ((uint32_t)src[1] << 16) |
+                                 ((uint32_t)src[2] << 8)) ^ flip);
+      }
+    } else {
+      for (i = 0; i < len; ++i, src += 3) {
+        buf[i] = (sox_sample_t)((((uint32_t)src[2] << 24) |
+                                 ((uint32_t)src[1] << 16) |
+                                 ((uint32_t)src[0] << 8)) ^ flip);
+      }
+    }
+    break;
+  case 4:
+    if (map->big) {
+      for (i = 0; i < len; ++i, src += 4) {
+        buf[i] = (sox_sample_t)(GET_BE32(src) ^ flip);
+      }
+    } else {
+      for (i = 0; i < len; ++i, src += 4) {
+        buf[i] = (sox_sample_t)(GET_LE32(src) ^ flip);
+      }
+    }
+    break;
+  }
+  map->pos += len;
+  return len;
+}
+
+static int
+map_seek(pcm_map_t* map, sox_uint64_t offset)
+{
+  if (offset > map->length) return SOX_EOF;
+  map->pos = offset;
+  return SOX_SUCCESS;
+}
+
+/*---------------------------------------------------------------------------*/
+/* BLOCK CACHE */
+
+/* The block cache of an input stream keeps the most recently used blocks of
+   CACHE_BLOCK decoded frames (after conversion if any) so that reading
+   scattered samples close to each other does not seek and restart the
+   decoder for every access.  With a block cache, seeking only sets the
+   offset of the stream, the decoder is moved when a missing block has to be
+   loaded; the position of the decoder is thus tracked separately.  The
+   least recently used block is evicted on a miss.
+
+   Slots are found by a hash table indexed by the block number and are
+   linked in order of use (from HEAD, the most recently used, to TAIL, the
+   least recently used), so hits and evictions take constant time.  The
+   hash of a block is its number modulo the (power of 2) number of buckets:
+   neighbouring blocks, the usual working set, never collide. */
+
+struct _block_cache {
+  long block;        /* number of frames per block */
+  long channels;     /* number of samples per frame */
+  long nslots;       /* number of cached blocks */
+  long pos;          /* offset of the decoder */
+  long hits, misses; /* counters */
+  long head, tail;   /* most and least recently used slots */
+  unsigned long mask; /* number of hash buckets minus one */
+  long* tags;        /* block index of each slot, -1 if unused */
+  long* counts;      /* number of frames in each slot */
+  long* prev;        /* more recently used slot, -1 if none */
+  long* next;        /* less recently used slot, -1 if none */
+  long* chain;       /* next slot in the same hash bucket, -1 if none */
+  long* buckets;     /* first slot of each hash bucket, -1 if none */
+  sox_sample_t* data; /* cached samples */
+};
+
+static void
+free_cache(block_cache_t* bc)
+{
+  free(bc->data);
+  free(bc);
+}
+
+static long
+cache_counter(ysox_t* obj, int which)
+{
+  block_cache_t* bc = obj->cache;
+  if (bc == NULL) return 0;
+  return (which == 0 ? bc->hits : bc->misses);
+}
+
+static void
+attach_cache(ysox_t* obj, long size)
+{
+  block_cache_t* bc;
+  long channels = stream_signal(obj)->channels, nslots, nbuckets, k;
+  size_t bytes;
+  if (obj->cache != NULL) return;
+  if (channels < 1) y_error("unknown number of channels");
+  nslots = size/(CACHE_BLOCK*channels*(long)sizeof(sox_sample_t));
+  if (nslots < 1) nslots = 1;
+  nbuckets = 1;
+  while (nbuckets < nslots) nbuckets *= 2;
+  bytes = (nslots*(5*sizeof(long) +
+                   CACHE_BLOCK*channels*sizeof(sox_sample_t)) +
+           nbuckets*sizeof(long));
+  bc = malloc(sizeof(block_cache_t));
+  if (bc == NULL) y_error("insufficient memory");
+  memset(bc, 0, sizeof(block_cache_t));
+  bc->data = malloc(bytes);
+  if (bc->data == NULL) {
+    free(bc);
+    y_error("insufficient memory");
+  }
+  /* The sample buffer is first to be correctly aligned. */
+  bc->tags = (long*)(bc->data + nslots*CACHE_BLOCK*channels);
+  bc->counts = bc->tags + nslots;
+  bc->prev = bc->counts + nslots;
+  bc->next = bc->prev + nslots;
+  bc->chain = bc->next + nslots;
+  bc->buckets = bc->chain + nslots;
+  bc->block = CACHE_BLOCK;
+  bc->channels = channels;
+  bc->nslots = nslots;
+  bc->pos = obj->offset;
+  bc->mask = nbuckets - 1;
+  bc->head = 0;
+  bc->tail = nslots - 1;
+  for (k = 0; k < nslots; ++k) {
+    bc->tags[k] = -1;
+    bc->counts[k] = 0;
+    bc->prev[k] = k - 1;
+    bc->next[k] = (k + 1 < nslots ? k + 1 : -1);
+    bc->chain[k] = -1;
+  }
+  for (k = 0; k < nbuckets; ++k) {
+    bc->buckets[k] = -1;
+  }
+  obj->cache = bc;
+}
+
+static void
+sync_cache(ysox_t* obj)
+{
+  block_cache_t* bc = obj->cache;
+  long pos;
+  if (bc == NULL) return;
+  critical();
+  pos = bc->pos;
+  bc->pos = -1; /* unknown until the caller is done with the decoder */
+  if (seek_decoder(obj, pos, obj->offset) != SOX_SUCCESS) {
+    y_errorq("sox_seek failed (%s)", obj->format->sox_errstr);
+  }
+}
+
+/* Make slot K the most recently used. */
+static void
+touch_slot(block_cache_t* bc, long k)
+{
+  long p = bc->prev[k], n = bc->next[k];
+  if (p < 0) return; /* already the head */
+  bc->next[p] = n;
+  if (n >= 0) {
+    bc->prev[n] = p;
+  } else {
+    bc->tail = p;
+  }
+  bc->prev[k] = -1;
+  bc->next[k] = bc->head;
+  bc->prev[bc->head] = k;
+  bc->head = k;
+}
+
+/* Insert or remove slot K in the hash table according to its tag. */
+static void
+hash_slot(block_cache_t* bc, long k)
+{
+  long* p = &bc->buckets[(unsigned long)bc->tags[k] & bc->mask];
+  bc->chain[k] = *p;
+  *p = k;
+}
+
+static void
+unhash_slot(block_cache_t* bc, long k)
+{
+  long* p = &bc->buckets[(unsigned long)bc->tags[k] & bc->mask];
+  while (*p != k) p = &bc->chain[*p];
+  *p = bc->chain[k];
+}
+
+/* Get the slot of a given block, loading it if missing. */
+static long
+find_block(ysox_t* obj, long b)
+{
+  block_cache_t* bc = obj->cache;
+  sox_sample_t* dst;
+  long k, start, offset, pos, got;
+  int status = SOX_SUCCESS;
+
+  if (bc->tags[bc->head] == b) {
+    ++bc->hits;
+    return bc->head;
+  }
+  for (k = bc->buckets[(unsigned long)b & bc->mask]; k >= 0;
+       k = bc->chain[k]) {
+    if (bc->tags[k] == b) {
+      ++bc->hits;
+      touch_slot(bc, k);
+      return k;
+    }
+  }
+
+  /* Evict the least recently used slot (which stays the next one to be
+     evicted until the block has been loaded). */
+  ++bc->misses;
+  k = bc->tail;
+  if (bc->tags[k] >= 0) {
+    unhash_slot(bc, k);
+    bc->tags[k] = -1;
+  }
+  dst = bc->data + k*bc->block*bc->channels;
+
+  /* Move the decoder to the start of the block (skipping short gaps by
+     decoding) and decode the block.  Nothing below throws errors until the
+     offset of the caller has been restored, the decoder position remains
+     unknown if seeking fails. */
+  critical();
+  offset = obj->offset;
+  start = b*bc->block;
+  pos = bc->pos;
+  bc->pos = -1;
+  if (pos < 0 || start < pos ||
+      (stream_seekable(obj) && start - pos >= bc->block)) {
+    status = seek_decoder(obj, pos, start);
+  } else {
+    obj->offset = pos;
+  }
+  if (status != SOX_SUCCESS) {
+    y_errorq("sox_seek failed (%s)", obj->format->sox_errstr);
+  }
+  got = 0;
+  while (obj->offset < start) {
+    long n = start - obj->offset;
+    if (n > bc->block) n = bc->block;
+    if (fetch_raw(obj, dst, n) < n) break;
+  }
+  if (obj->offset == start) {
+    got = fetch_raw(obj, dst, bc->block);
+  }
+  bc->pos = obj->offset;
+  obj->offset = offset;
+  bc->tags[k] = b;
+  bc->counts[k] = got;
+  hash_slot(bc, k);
+  touch_slot(bc, k);
+  return k;
+}
+
+static long
+cached_read(ysox_t* obj, sox_sample_t* buf, long samples)
+{
+  block_cache_t* bc = obj->cache;
+  long nc = bc->channels, done = 0;
+  while (done < samples) {
+    long b = obj->offset/bc->block;
+    long i = obj->offset - b*bc->block;
+    long k = find_block(obj, b);
+    long n = bc->counts[k] - i;
+    if (n <= 0) break;
+    if (n > samples - done) n = samples - done;
+    memcpy(buf + done*nc, bc->data + (k*bc->block + i)*nc,
+           n*nc*sizeof(sox_sample_t));
+    done += n;
+    obj->offset += n;
+  }
+  return done;
+}
+
+/*---------------------------------------------------------------------------*/
+/* STATISTICS */
+
+/* Rows of the result of sox_stats. */
+#define STATS_MIN       0
+#define STATS_MAX       1
+#define STATS_MEAN      2
+#define STATS_RMS       3
+#define STATS_PEAK      4
+#define STATS_CROSSINGS 5
+#define STATS_CLIPS     6
+#define STATS_COUNT     7
+#define STATS_ROWS      8
+
+/* Get the range of samples specified by the argument at stack position
+   IARG (all samples if IARG < 0 or if the argument is nil).  On return,
+   OFFSET is the offset of the first sample and COUNT the number of samples
+   (-1 up to the end of the stream). */
+static void
+get_sample_range(int iarg, long ntot, long* offset, long* count)
+{
+  *offset = 0;
+  *count = -1;
+  if (iarg >= 0 && ! yarg_nil(iarg)) {
+    long mms[3], i1, i2;
+    int flags;
+    if (yarg_typeid(iarg) != Y_RANGE) y_error("expecting a range of samples");
+    flags = yget_range(iarg, mms);
+    if (flags == Y_NULLER) {
+      *count = 0;
+    } else if (flags != Y_RUBBER1) {
+      if (flags == Y_MMMARK || flags == Y_PSEUDO || flags == Y_RUBBER
+          || mms[2] != 1) {
+        y_error("expecting a contiguous range of samples");
+      }
+      i1 = ((flags & Y_MIN_DFLT) != 0 ? 1 : mms[0]);
+      if (i1 <= 0) i1 += ntot;
+      if (i1 <= 0 || (ntot > 0 && i1 > ntot)) y_error("invalid range");
+      *offset = i1 - 1;
+      if ((flags & Y_MAX_DFLT) == 0) {
+        i2 = mms[1];
+        if (i2 <= 0) i2 += ntot;
+        if (i2 < i1 || (ntot > 0 && i2 > ntot)) y_error("invalid range");
+        *count = i2 - i1 + 1;
+      }
+    }
+  }
+}
+
+void
+Y_sox_stats(int argc)
+{
+  ysox_t* obj;
+  channel_stats_t* st;
+  sox_sample_t* buf;
+  double* out;
+  long dims[3], channels, ntot, offset, count, nbuf, c;
+
+  if (argc < 1 || argc > 2) y_error("expecting one or two arguments");
+  obj = ysox_fetch(argc - 1);
+  if (obj->format == NULL || obj->format->mode != 'r') {
+    y_error("sound stream not open for reading");
+  }
+  channels = stream_signal(obj)->channels;
+  if (channels < 1) y_error("unknown number of channels");
+  ntot = stream_signal(obj)->length/channels;
+
+  /* Get the range of samples, all samples by default. */
+  get_sample_range((argc == 2 ? 0 : -1), ntot, &offset, &count);
+
+  /* Scan the samples by blocks. */
+  st = ypush_scratch(channels*sizeof(channel_stats_t), NULL);
+  for (c = 0; c < channels; ++c) {
+    st[c].min = SOX_SAMPLE_MAX;
+    st[c].max = SOX_SAMPLE_MIN;
+  }
+  nbuf = SCRATCH_SIZE/channels;
+  if (nbuf < 1) nbuf = 1;
+  buf = ypush_scratch(nbuf*channels*sizeof(sox_sample_t), NULL);
+  if (count != 0) {
+    seek_to(obj, offset);
+  }
+  while (count != 0) {
+    long n = nbuf, got;
+    if (count > 0 && n > count) n = count;
+    got = read_raw(obj, buf, n);
+    channel_stats(st, buf, got*channels, channels);
+    if (count > 0) count -= got;
+    if (got < n) break;
+  }
+
+  /* Push the result. */
+  dims[0] = 2;
+  dims[1] = STATS_ROWS;
+  dims[2] = channels;
+  out = ypush_d(dims);
+  for (c = 0; c < channels; ++c, out += STATS_ROWS) {
+    const channel_stats_t* s = st + c;
+    double peak;
+    if (s->count > 0) {
+      double rms = sqrt(s->sumsq/s->count)/SAMPLE_SCALE;
+      out[STATS_MIN] = s->min/SAMPLE_SCALE;
+      out[STATS_MAX] = s->max/SAMPLE_SCALE;
+      out[STATS_MEAN] = s->sum/s->count/SAMPLE_SCALE;
+      out[STATS_RMS] = rms;
+      peak = (-(double)s->min > (double)s->max ? -(double)s->min :
+              (double)s->max)/SAMPLE_SCALE;
+      out[STATS_PEAK] = (peak > 0.0 ? 20.0*log10(peak) : -HUGE_VAL);
+    }
+    out[STATS_CROSSINGS] = s->crossings;
+    out[STATS_CLIPS] = s->clips;
+    out[STATS_COUNT] = s->count;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* FRAME ITERATOR */
+
+/* A frame iterator yields successive (possibly overlapping) frames of LEN
+   samples per channel of an input stream, the start of each frame being
+   HOP samples after the previous one.  The samples of the current frame
+   are kept in a ring buffer, only the new samples are decoded (directly
+   into the ring) for the next frame, and the window is applied while
+   converting the samples of the ring to floating-point values. */
+
+static void yframes_free(void*);
+static void yframes_print(void*);
+static void yframes_eval(void*, int);
+static void yframes_extract(void*, char*);
+
+typedef struct _yframes yframes_t;
+struct _yframes {
+  ysox_t* input;        /* input stream */
+  void* input_use;      /* used to keep the stream alive */
+  long length, hop;     /* frame length and hop size (in samples) */
+  long channels;        /* number of channels */
+  int type;             /* element type of frames */
+  int pad;              /* zero-pad the last frame(s)? */
+  int eof;              /* no more frames */
+  long count;           /* number of frames yielded so far */
+  long start;           /* offset of first sample of next frame */
+  long head;            /* index of first sample in ring */
+  long filled;          /* number of samples of next frame in ring */
+  double* window;       /* window with gain and scale factor */
+  sox_sample_t* ring;   /* ring buffer of LENGTH samples */
+};
+
+static y_userobj_t yframes_type = {
+  "SoX frame iterator", yframes_free, yframes_print, yframes_eval,
+  yframes_extract
+};
+
+static void
+yframes_free(void* addr)
+{
+  yframes_t* it = (yframes_t*)addr;
+  if (it->window != NULL) free(it->window);
+  if (it->input_use != NULL) ydrop_use(it->input_use);
+}
+
+static void
+yframes_print(void* addr)
+{
+  yframes_t* it = (yframes_t*)addr;
+  char buf[100];
+  sprintf(buf, "SoX frame iterator (length=%ld, hop=%ld, %ld channel(s), "
+          "%ld frame(s) so far)", it->length, it->hop, it->channels,
+          it->count);
+  y_print(buf, TRUE);
+}
+
+static void
+yframes_extract(void* addr, char* member)
+{
+  yframes_t* it = (yframes_t*)addr;
+  if (strcmp(member, "channels") == 0) {
+    ypush_long(it->channels);
+  } else if (strcmp(member, "count") == 0) {
+    ypush_long(it->count);
+  } else if (strcmp(member, "hop") == 0) {
+    ypush_long(it->hop);
+  } else if (strcmp(member, "length") == 0) {
+    ypush_long(it->length);
+  } else if (strcmp(member, "offset") == 0) {
+    ypush_long(it->start);
+  } else {
+    y_error("bad member name");
+  }
+}
+
+/* Decode N samples into the ring at index I (modulo the ring size),
+   returns the number of samples actually decoded. */
+static long
+fill_ring(yframes_t* it, long i, long n)
+{
+  long len = it->length, nc = it->channels, done = 0;
+  while (done < n) {
+    long j = (i + done)%len, m = n - done, got;
+    if (m > len - j) m = len - j;
+    got = read_raw(it->input, it->ring + j*nc, m);
+    done += got;
+    if (got < m) break;
+  }
+  return done;
+}
+
+static void
+yframes_eval(void* addr, int argc)
+{
+  yframes_t* it = (yframes_t*)addr;
+  ysox_t* obj = it->input;
+  long len = it->length, nc = it->channels, k, c, pos;
+  const sox_sample_t* src;
+  const double* w = it->window;
+
+  if (argc != 1 || ! yarg_nil(0)) y_error("expecting no arguments");
+  if (obj->format == NULL) y_error("input stream has been closed");
+  if (it->eof) {
+    ypush_nil();
+    return;
+  }
+
+  /* Decode the missing samples of the frame, the stream may have been
+     moved by someone else. */
+  pos = it->start + it->filled;
+  if (obj->offset != pos) {
+    if (it->filled == 0) {
+      skip_to(obj, pos, it->ring, len);
+    } else {
+      seek_to(obj, pos);
+    }
+  }
+  it->filled += fill_ring(it, it->head + it->filled, len - it->filled);
+  if (it->filled < len && (! it->pad || it->filled == 0)) {
+    it->eof = TRUE;
+    ypush_nil();
+    return;
+  }
+
+  /* Convert and apply the window. */
+  src = it->ring;
+  if (it->type == Y_FLOAT) {
+    float* dst = push_samples(Y_FLOAT, nc, len);
+    for (k = 0; k < len; ++k, dst += nc) {
+      const sox_sample_t* x = src + ((it->head + k)%len)*nc;
+      float wk = (float)w[k];
+      if (k < it->filled) {
+        for (c = 0; c < nc; ++c) dst[c] = wk*(float)x[c];
+      } else {
+        for (c = 0; c < nc; ++c) dst[c] = 0.0f;
+      }
+    }
+  } else {
+    double* dst = push_samples(Y_DOUBLE, nc, len);
+    for (k = 0; k < len; ++k, dst += nc) {
+      const sox_sample_t* x = src + ((it->head + k)%len)*nc;
+      if (k < it->filled) {
+        for (c = 0; c < nc; ++c) dst[c] = w[k]*(double)x[c];
+      } else {
+        for (c = 0; c < nc; ++c) dst[c] = 0.0;
+      }
+    }
+  }
+  ++it->count;
+
+  /* Advance to the next frame, keeping the overlapping samples. */
+  if (it->hop < it->filled) {
+    it->head = (it->head + it->hop)%len;
+    it->filled -= it->hop;
+  } else {
+    it->head = 0;
+    it->filled = 0;
+  }
+  it->start += it->hop;
+}
+
+/* Compute the window specified by keyword value at stack position IARG
+   (-1 for the default rectangular window). */
+static void
+make_window(double* w, long n, int iarg)
+{
+  long k;
+  if (iarg < 0) {
+    for (k = 0; k < n; ++k) w[k] = 1.0;
+  } else if (yarg_typeid(iarg) == Y_STRING) {
+    /* Periodic windows (as suited for spectral analysis). */
+    const char* name = ygets_q(iarg);
+    double a0, a1, a2, q = 2.0*M_PI/n;
+    if (name == NULL || strcmp(name, "rect") == 0) {
+      a0 = 1.0; a1 = 0.0; a2 = 0.0;
+    } else if (strcmp(name, "hann") == 0) {
+      a0 = 0.5; a1 = 0.5; a2 = 0.0;
+    } else if (strcmp(name, "hamming") == 0) {
+      a0 = 0.54; a1 = 0.46; a2 = 0.0;
+    } else if (strcmp(name, "blackman") == 0) {
+      a0 = 0.42; a1 = 0.5; a2 = 0.08;
+    } else {
+      y_error("unknown window");
+      return;
+    }
+    for (k = 0; k < n; ++k) {
+      w[k] = a0 - a1*cos(q*k) + a2*cos(2.0*q*k);
+    }
+  } else {
+    long len;
+    const double* src = ygeta_d(iarg, &len, NULL);
+    if (len != n) y_error("window must have as many values as a frame");
+    memcpy(w, src, n*sizeof(double));
+  }
+}
+
+void
+Y_sox_frames(int argc)
+{
+  ysox_t* obj = NULL;
+  yframes_t* it;
+  long length = -1, hop = -1, k;
+  double gain = 1.0;
+  int iarg, nargs = 0, type = Y_FLOAT, pad = FALSE, iobj = -1, iwin = -1;
+  int has_gain = FALSE;
+  static long gain_index = -1L;
+  static long pad_index = -1L;
+  static long type_index = -1L;
+  static long window_index = -1L;
+
+  /* Initialize all keyword indexes. */
+#define INIT(s) if (s##_index == -1L) s##_index = yget_global(#s, 0)
+  INIT(gain);
+  INIT(pad);
+  INIT(type);
+  INIT(window);
+#undef INIT
+
+  /* Parse arguments. */
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    long index = yarg_key(iarg);
+    if (index < 0) {
+      /* Positional argument. */
+      switch (++nargs) {
+      case 1:
+        obj = ysox_fetch(iarg);
+        iobj = iarg;
+        break;
+      case 2:
+        length = ygets_l(iarg);
+        break;
+      case 3:
+        if (! yarg_nil(iarg)) hop = ygets_l(iarg);
+        break;
+      default:
+        y_error("too many arguments");
+      }
+    } else {
+      /* Keyword argument. */
+      --iarg;
+      if (index == gain_index) {
+        if (! yarg_nil(iarg)) {
+          gain = ygets_d(iarg);
+          has_gain = TRUE;
+        }
+      } else if (index == pad_index) {
+        pad = yarg_true(iarg);
+      } else if (index == type_index) {
+        if (! yarg_nil(iarg)) type = get_type(iarg);
+      } else if (index == window_index) {
+        if (! yarg_nil(iarg)) iwin = iarg;
+      } else {
+        y_error("unsupported keyword");
+      }
+    }
+  }
+  if (nargs < 2) y_error("too few arguments");
+  if (obj->format == NULL || obj->format->mode != 'r') {
+    y_error("sound stream not open for reading");
+  }
+  if (length < 1) y_error("invalid frame length");
+  if (hop < 0) hop = length;
+  if (hop < 1) y_error("invalid hop size");
+  if (type != Y_FLOAT && type != Y_DOUBLE) {
+    y_error("type of frames must be float or double");
+  }
+  if (! has_gain) gain = obj->rd.gain;
+
+  /* Create the iterator (arguments are shifted on the stack), the window
+     and the ring are allocated in a single block. */
+  it = (yframes_t*)ypush_obj(&yframes_type, sizeof(yframes_t));
+  it->input = obj;
+  it->input_use = yget_use(iobj + 1);
+  it->length = length;
+  it->hop = hop;
+  it->channels = stream_signal(obj)->channels;
+  it->type = type;
+  it->pad = pad;
+  it->start = obj->offset;
+  if (it->channels < 1) y_error("unknown number of channels");
+  it->window = malloc(length*sizeof(double) +
+                      length*it->channels*sizeof(sox_sample_t));
+  if (it->window == NULL) y_error("insufficient memory");
+  it->ring = (sox_sample_t*)(it->window + length);
+  make_window(it->window, length, iwin + 1);
+  for (k = 0; k < length; ++k) {
+    it->window[k] *= gain/SAMPLE_SCALE;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* FAST FOURIER TRANSFORM */
+
+/* Mixed-radix decimation-in-time FFT of complex data (with specialized
+   butterflies for radix 2 and 4 and a generic butterfly for other factors)
+   and real FFT of even length N by means of a complex FFT of length N/2.
+   A plan is read-only once created and can be shared by several threads,
+   each thread providing its own workspace. */
+
+#define FFT_MAX_FACTORS 32
+
+typedef struct _fft_cplx {
+  double re, im;
+} fft_cplx_t;
+
+typedef struct _fft_plan {
+  long n;                 /* length of real transform */
+  long m;                 /* length of complex transform */
+  long factors[2*FFT_MAX_FACTORS]; /* radix and remaining length pairs */
+  long maxp;              /* largest radix */
+  fft_cplx_t* tw;         /* twiddle factors of complex transform */
+  fft_cplx_t* super;      /* twiddle factors of real transform */
+} fft_plan_t;
+
+static void
+free_fft_plan(fft_plan_t* plan)
+{
+  if (plan->tw != NULL) free(plan->tw);
+  plan->tw = NULL;
+  plan->super = NULL;
+}
+
+/* Create a plan for a real FFT of length N, returns 0 on success and -1 on
+   failure. */
+static int
+init_fft_plan(fft_plan_t* plan, long n)
+{
+  long m, p, k, nf = 0;
+  memset(plan, 0, sizeof(fft_plan_t));
+  if (n < 1) return -1;
+  m = (n%2 == 0 ? n/2 : n);
+  plan->n = n;
+  plan->m = m;
+  plan->tw = malloc((m + n/2 + 1)*sizeof(fft_cplx_t));
+  if (plan->tw == NULL) return -1;
+  plan->super = plan->tw + m;
+  for (k = 0; k < m; ++k) {
+    double phi = -2.0*M_PI*k/m;
+    plan->tw[k].re = cos(phi);
+    plan->tw[k].im = sin(phi);
+  }
+  for (k = 0; k <= n/2; ++k) {
+    double phi = -2.0*M_PI*k/n;
+    plan->super[k].re = cos(phi);
+    plan->super[k].im = sin(phi);
+  }
+  p = 4;
+  plan->maxp = 1;
+  do {
+    while (m%p != 0) {
+      switch (p) {
+      case 4: p = 2; break;
+      case 2: p = 3; break;
+      default: p += 2; break;
+      }
+      if (p*p > m) p = m;
+    }
+    m /= p;
+    if (nf >= FFT_MAX_FACTORS) {
+      free_fft_plan(plan);
+      return -1;
+    }
+    plan->factors[2*nf] = p;
+    plan->factors[2*nf + 1] = m;
+    if (p > plan->maxp) plan->maxp = p;
+    ++nf;
+  } while (m > 1);
+  return 0;
+}
+
+static void
+fft_bfly2(fft_cplx_t* f, long fstride, const fft_cplx_t* tw, long m)
+{
+  long k;
+  for (k = 0; k < m; ++k) {
+    const fft_cplx_t* w = tw + k*fstride;
+    fft_cplx_t* a = f + k;
+    fft_cplx_t* b = f + k + m;
+    double tr = b->re*w->re - b->im*w->im;
+    double ti = b->re*w->im + b->im*w->re;
+    b->re = a->re - tr;
+    b->im = a->im - ti;
+    a->re += tr;
+    a->im += ti;
+  }
+}
+
+static void
+fft_bfly4(fft_cplx_t* f, long fstride, const fft_cplx_t* tw, long m)
+{
+  long k;
+  for (k = 0; k < m; ++k) {
+    const fft_cplx_t* w1 = tw + k*fstride;
+    const fft_cplx_t* w2 = tw + 2*k*fstride;
+    const fft_cplx_t* w3 = tw + 3*k*fstride;
+    fft_cplx_t* f0 = f + k;
+    fft_cplx_t* f1 = f + k + m;
+    fft_cplx_t* f2 = f + k + 2*m;
+    fft_cplx_t* f3 = f + k + 3*m;
+    double s0r = f1->re*w1->re - f1->im*w1->im;
+    double s0i = f1->re*w1->im + f1->im*w1->re;
+    double s1r = f2->re*w2->re - f2->im*w2->im;
+    double s1i = f2->re*w2->im + f2->im*w2->re;
+    double s2r = f3->re*w3->re - f3->im*w3->im;
+    double s2i = f3->re*w3->im + f3->im*w3->re;
+    double s5r = f0->re - s1r, s5i = f0->im - s1i;
+    double s3r = s0r + s2r, s3i = s0i + s2i;
+    double s4r = s0r - s2r, s4i = s0i - s2i;
+    double ar = f0->re + s1r, ai = f0->im + s1i;
+    f2->re = ar - s3r;
+    f2->im = ai - s3i;
+    f0->re = ar + s3r;
+    f0->im = ai + s3i;
+    f1->re = s5r + s4i;
+    f1->im = s5i - s4r;
+    f3->re = s5r - s4i;
+    f3->im = s5i + s4r;
+  }
+}
+
+static void
+fft_bfly_generic(fft_cplx_t* f, long fstride, const fft_cplx_t* tw,
+                 long m, long p, long n, fft_cplx_t* scratch)
+{
+  long u, q, q1, k;
+  for (u = 0; u < m; ++u) {
+    for (q1 = 0, k = u; q1 < p; ++q1, k += m) {
+      scratch[q1] = f[k];
+    }
+    for (q1 = 0, k = u; q1 < p; ++q1, k += m) {
+      long t = 0;
+      double re = scratch[0].re, im = scratch[0].im;
+      for (q = 1; q < p; ++q) {
+        t += fstride*k;
+        if (t >= n) t -= n;
+        re += scratch[q].re*tw[t].re - scratch[q].im*tw[t].im;
+        im += scratch[q].re*tw[t].im + scratch[q].im*tw[t].re;
+      }
+      f[k].re = re;
+      f[k].im = im;
+    }
+  }
+}
+
+static void
+fft_work(const fft_plan_t* plan, fft_cplx_t* out, const fft_cplx_t* in,
+         long fstride, const long* factors, fft_cplx_t* scratch)
+{
+  long p = factors[0], m = factors[1], q;
+  if (m == 1) {
+    for (q = 0; q < p; ++q) {
+      out[q] = in[q*fstride];
+    }
+  } else {
+    for (q = 0; q < p; ++q) {
+      fft_work(plan, out + q*m, in + q*fstride, fstride*p, factors + 2,
+               scratch);
+    }
+  }
+  switch (p) {
+  case 2:  fft_bfly2(out, fstride, plan->tw, m); break;
+  case 4:  fft_bfly4(out, fstride, plan->tw, m); break;
+  default: fft_bfly_generic(out, fstride, plan->tw, m, p, plan->m, scratch);
+  }
+}
+
+/* Real FFT of X (N values) into Y (N/2 + 1 complex values).  WRK is a
+   workspace of 2*M + MAXP complex values. */
+static void
+fft_real(const fft_plan_t* plan, const double* x, fft_cplx_t* y,
+         fft_cplx_t* wrk)
+{
+  long n = plan->n, m = plan->m, k;
+  fft_cplx_t* z = wrk;
+  fft_cplx_t* zf = wrk + m;
+  fft_cplx_t* scratch = wrk + 2*m;
+  if (n%2 != 0) {
+    for (k = 0; k < n; ++k) {
+      z[k].re = x[k];
+      z[k].im = 0.0;
+    }
+    fft_work(plan, zf, z, 1, plan->factors, scratch);
+    for (k = 0; k <= n/2; ++k) {
+      y[k] = zf[k];
+    }
+    return;
+  }
+  for (k = 0; k < m; ++k) {
+    z[k].re = x[2*k];
+    z[k].im = x[2*k + 1];
+  }
+  fft_work(plan, zf, z, 1, plan->factors, scratch);
+  y[0].re = zf[0].re + zf[0].im;
+  y[0].im = 0.0;
+  y[m].re = zf[0].re - zf[0].im;
+  y[m].im = 0.0;
+  for (k = 1; k < m; ++k) {
+    /* X[k] = (Z[k] + conj(Z[m-k]))/2 - i w^k (Z[k] - conj(Z[m-k]))/2 */
+    const fft_cplx_t* w = plan->super + k;
+    double ar = zf[k].re, ai = zf[k].im;
+    double br = zf[m - k].re, bi = -zf[m - k].im;
+    double er = 0.5*(ar + br), ei = 0.5*(ai + bi);
+    double dr = 0.5*(ar - br), di = 0.5*(ai - bi);
+    double tr = w->re*dr - w->im*di, ti = w->re*di + w->im*dr;
+    y[k].re = er + ti;
+    y[k].im = ei - tr;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* SPECTROGRAM */
+
+/* The samples are decoded (and down-mixed to a single channel) by batches
+   of frames.  The frames of a batch are transformed by a pool of threads
+   which claim frames one at a time and write the spectra directly into the
+   result, while the calling thread decodes the next batch.  Decoding uses
+   the non-throwing layers (convert_raw and decode_source) because the
+   workers must have been joined before any Yorick error can be raised. */
+
+/* Approximate number of samples per batch. */
+#define SPECTRO_BATCH 262144
+
+#define SPECTRO_POWER     0
+#define SPECTRO_MAGNITUDE 1
+#define SPECTRO_DB        2
+
+/* Floor of power values for the conversion to decibels. */
+#define SPECTRO_FLOOR 1e-20
+
+typedef struct _spectro spectro_t;
+
+/* A thread and its workspace. */
+typedef struct _spectro_task {
+  spectro_t* sp;
+  char* work;
+  pthread_t thread;
+  int started;
+} spectro_task_t;
+
+struct _spectro {
+  fft_plan_t plan;
+  long nfft, hop, nbins;   /* frame length, hop size, number of bins */
+  long nout;               /* number of values per frame */
+  int scale;               /* SPECTRO_POWER, SPECTRO_MAGNITUDE or
+                              SPECTRO_DB */
+  double* window;          /* window (NFFT values) */
+  long nmel;               /* number of mel bands, 0 for none */
+  long* mel_first;         /* first bin of each mel band */
+  long* mel_count;         /* number of bins of each mel band */
+  double* mel_weight;      /* weights of all mel bands */
+  double* batch[2];        /* batches of down-mixed samples */
+  sox_sample_t* raw;       /* decoded samples */
+  long raw_frames;         /* number of frames in RAW */
+  float* grow;             /* growable result if number of frames unknown */
+  long grow_frames;        /* number of frames allocated in GROW */
+  spectro_task_t* tasks;   /* threads and their workspaces */
+  long ntasks;
+  /* Current job. */
+  const double* x;         /* first sample of first frame */
+  float* out;              /* spectrum of first frame */
+  long nframes;            /* number of frames */
+  long next;               /* next frame to process */
+};
+
+static void
+free_spectro(void* addr)
+{
+  spectro_t* sp = (spectro_t*)addr;
+  free_fft_plan(&sp->plan);
+  if (sp->window != NULL) free(sp->window);
+  if (sp->mel_first != NULL) free(sp->mel_first);
+  if (sp->mel_weight != NULL) free(sp->mel_weight);
+  if (sp->batch[0] != NULL) free(sp->batch[0]);
+  if (sp->raw != NULL) free(sp->raw);
+  if (sp->grow != NULL) free(sp->grow);
+  if (sp->tasks != NULL) free(sp->tasks);
+}
+
+/* Setup triangular mel filters (with HTK mel scale) over the bins of the
+   spectrum from 0 to the Nyquist frequency. */
+static void
+setup_mel(spectro_t* sp, double rate)
+{
+  long nmel = sp->nmel, nbins = sp->nbins, j, k, total = 0;
+  double mmax = 2595.0*log10(1.0 + 0.5*rate/700.0);
+  double* edges;
+  sp->mel_first = malloc(2*nmel*sizeof(long));
+  if (sp->mel_first == NULL) y_error("insufficient memory");
+  sp->mel_count = sp->mel_first + nmel;
+  edges = ypush_scratch((nmel + 2)*sizeof(double), NULL);
+  for (j = 0; j < nmel + 2; ++j) {
+    /* Band edges in units of bins. */
+    double mel = mmax*j/(nmel + 1);
+    edges[j] = 700.0*(pow(10.0, mel/2595.0) - 1.0)*sp->nfft/rate;
+  }
+  for (j = 0; j < nmel; ++j) {
+    long lo = (long)ceil(edges[j]), hi = (long)floor(edges[j + 2]);
+    if (lo < 0) lo = 0;
+    if (hi > nbins - 1) hi = nbins - 1;
+    sp->mel_first[j] = lo;
+    sp->mel_count[j] = (hi >= lo ? hi - lo + 1 : 0);
+    total += sp->mel_count[j];
+  }
+  sp->mel_weight = malloc((total > 0 ? total : 1)*sizeof(double));
+  if (sp->mel_weight == NULL) y_error("insufficient memory");
+  total = 0;
+  for (j = 0; j < nmel; ++j) {
+    double lo = edges[j], mid = edges[j + 1], hi = edges[j + 2];
+    for (k = 0; k < sp->mel_count[j]; ++k) {
+      double b = (double)(sp->mel_first[j] + k);
+      sp->mel_weight[total++] = (b <= mid ? (b - lo)/(mid - lo) :
+                                 (hi - b)/(hi - mid));
+    }
+  }
+  yarg_drop(1); /* drop band edges */
+}
+
+/* Size of the workspace of a thread in bytes. */
+static size_t
+spectro_work_size(const spectro_t* sp)
+{
+  return ((sp->nfft + sp->nbins + sp->nmel)*sizeof(double) +
+          (sp->nbins + 2*sp->plan.m + sp->plan.maxp)*sizeof(fft_cplx_t));
+}
+
+static void
+spectro_frame(const spectro_t* sp, const double* x, float* out, char* work)
+{
+  fft_cplx_t* y = (fft_cplx_t*)work;
+  fft_cplx_t* wrk = y + sp->nbins;
+  double* buf = (double*)(wrk + 2*sp->plan.m + sp->plan.maxp);
+  double* pw = buf + sp->nfft;
+  double* val = pw;
+  const double* w = sp->window;
+  long k, j, nbins = sp->nbins;
+  for (k = 0; k < sp->nfft; ++k) {
+    buf[k] = w[k]*x[k];
+  }
+  fft_real(&sp->plan, buf, y, wrk);
+  for (k = 0; k < nbins; ++k) {
+    pw[k] = y[k].re*y[k].re + y[k].im*y[k].im;
+  }
+  if (sp->scale == SPECTRO_MAGNITUDE) {
+    for (k = 0; k < nbins; ++k) {
+      pw[k] = sqrt(pw[k]);
+    }
+  }
+  if (sp->nmel > 0) {
+    const double* wgt = sp->mel_weight;
+    val = pw + nbins;
+    for (j = 0; j < sp->nmel; ++j) {
+      const double* p = pw + sp->mel_first[j];
+      double sum = 0.0;
+      for (k = 0; k < sp->mel_count[j]; ++k) {
+        sum += wgt[k]*p[k];
+      }
+      wgt += sp->mel_count[j];
+      val[j] = sum;
+    }
+  }
+  if (sp->scale == SPECTRO_DB) {
+    for (k = 0; k < sp->nout; ++k) {
+      out[k] = (float)(10.0*log10(val[k] > SPECTRO_FLOOR ? val[k] :
+                                  SPECTRO_FLOOR));
+    }
+  } else {
+    for (k = 0; k < sp->nout; ++k) {
+      out[k] = (float)val[k];
+    }
+  }
+}
+
+static void*
+spectro_worker(void* arg)
+{
+  spectro_task_t* task = (spectro_task_t*)arg;
+  spectro_t* sp = task->sp;
+  for (;;) {
+    long f = __atomic_fetch_add(&sp->next, 1, __ATOMIC_RELAXED);
+    if (f >= sp->nframes) break;
+    spectro_frame(sp, sp->x + f*sp->hop, sp->out + f*sp->nout, task->work);
+  }
+  return NULL;
+}
+
+/* Decode at most N frames and down-mix them into DST, returns the number
+   of frames decoded.  LEFT is the number of frames left in the range (-1
+   if unlimited).  This function does not throw errors. */
+static long
+spectro_fill(spectro_t* sp, ysox_t* obj, double* dst, long n, long* left)
+{
+  long nc = stream_signal(obj)->channels, done = 0, i, c;
+  double scale = 1.0/(nc*SAMPLE_SCALE);
+  if (*left >= 0 && n > *left) n = *left;
+  while (done < n && ! p_signalling) {
+    long m = n - done, got;
+    if (m > sp->raw_frames) m = sp->raw_frames;
+    if (obj->conv != NULL) {
+      got = convert_raw(obj, sp->raw, m);
+    } else {
+      got = decode_source(obj, sp->raw, m*nc)/nc;
+      obj->offset += got;
+    }
+    if (dst != NULL) {
+      for (i = 0; i < got; ++i) {
+        const sox_sample_t* s = sp->raw + i*nc;
+        double sum = 0.0;
+        for (c = 0; c < nc; ++c) sum += (double)s[c];
+        dst[done + i] = scale*sum;
+      }
+    }
+    done += got;
+    if (got < m) break;
+  }
+  if (*left >= 0) *left -= done;
+  return done;
+}
+
+void
+Y_sox_spectrogram(int argc)
+{
+  ysox_t* obj = NULL;
+  spectro_t* sp;
+  double* cur;
+  double* nxt;
+  float* out = NULL;
+  long nfft = 1024, hop = 0, nmel = 0, nthreads = 0, offset, count;
+  long nc, ntot, total, batch, size, have, done, i;
+  int iarg, nargs = 0, scale = SPECTRO_POWER, iwin = -1, irange = -1;
+  int nomem = FALSE;
+  static long hop_index = -1L;
+  static long mel_index = -1L;
+  static long nfft_index = -1L;
+  static long range_index = -1L;
+  static long scale_index = -1L;
+  static long threads_index = -1L;
+  static long window_index = -1L;
+
+  /* Initialize all keyword indexes. */
+#define INIT(s) if (s##_index == -1L) s##_index = yget_global(#s, 0)
+  INIT(hop);
+  INIT(mel);
+  INIT(nfft);
+  INIT(range);
+  INIT(scale);
+  INIT(threads);
+  INIT(window);
+#undef INIT
+
+  /* Parse arguments. */
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    long index = yarg_key(iarg);
+    if (index < 0) {
+      /* Positional argument. */
+      if (++nargs > 1) y_error("too many arguments");
+      obj = ysox_fetch(iarg);
+    } else {
+      /* Keyword argument. */
+      --iarg;
+      if (index == hop_index) {
+        if (! yarg_nil(iarg)) hop = ygets_l(iarg);
+      } else if (index == mel_index) {
+        if (! yarg_nil(iarg)) nmel = ygets_l(iarg);
+      } else if (index == nfft_index) {
+        if (! yarg_nil(iarg)) nfft = ygets_l(iarg);
+      } else if (index == range_index) {
+        if (! yarg_nil(iarg)) irange = iarg;
+      } else if (index == scale_index) {
+        if (! yarg_nil(iarg)) {
+          const char* name = ygets_q(iarg);
+          if (name != NULL && strcmp(name, "power") == 0) {
+            scale = SPECTRO_POWER;
+          } else if (name != NULL && strcmp(name, "magnitude") == 0) {
+            scale = SPECTRO_MAGNITUDE;
+          } else if (name != NULL && strcmp(name, "db") == 0) {
+            scale = SPECTRO_DB;
+          } else {
+            y_error("scale must be \"power\", \"magnitude\" or \"db\"");
+          }
+        }
+      } else if (index == threads_index) {
+        if (! yarg_nil(iarg)) nthreads = ygets_l(iarg);
+      } else if (index == window_index) {
+        if (! yarg_nil(iarg)) iwin = iarg;
+      } else {
+        y_error("unsupported keyword");
+      }
+    }
+  }
+  if (obj == NULL) y_error("missing sound stream");
+  if (obj->format == NULL || obj->format->mode != 'r') {
+    y_error("sound stream not open for reading");
+  }
+  if (nfft < 2) y_error("invalid number of samples per frame");
+  if (hop == 0) hop = nfft/4;
+  if (hop < 1) y_error("invalid hop size");
+  if (nmel < 0) y_error("invalid number of mel bands");
+  nc = stream_signal(obj)->channels;
+  if (nc < 1) y_error("unknown number of channels");
+  ntot = stream_signal(obj)->length/nc;
+  get_sample_range(irange, ntot, &offset, &count);
+  if (count < 0 && ntot > 0) count = ntot - offset;
+  total = (count < 0 ? -1 : count >= nfft ? 1 + (count - nfft)/hop : 0);
+  if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1) nthreads = 1;
+
+  /* Setup the engine, all resources are owned by a scratch object.  Stack
+     positions of arguments are shifted by one. */
+  sp = ypush_scratch(sizeof(spectro_t), free_spectro);
+  memset(sp, 0, sizeof(spectro_t));
+  if (init_fft_plan(&sp->plan, nfft) != 0) y_error("insufficient memory");
+  sp->nfft = nfft;
+  sp->hop = hop;
+  sp->nbins = nfft/2 + 1;
+  sp->nmel = nmel;
+  sp->nout = (nmel > 0 ? nmel : sp->nbins);
+  sp->scale = scale;
+  sp->window = malloc(nfft*sizeof(double));
+  if (sp->window == NULL) y_error("insufficient memory");
+  if (iwin >= 0) {
+    make_window(sp->window, nfft, iwin + 1);
+  } else {
+    /* Periodic Hann window by default. */
+    for (i = 0; i < nfft; ++i) {
+      sp->window[i] = 0.5 - 0.5*cos(2.0*M_PI*i/nfft);
+    }
+  }
+  if (nmel > 0) setup_mel(sp, stream_signal(obj)->rate);
+  batch = SPECTRO_BATCH/hop;
+  if (batch < 1) batch = 1;
+  if (total >= 0 && batch > total) batch = (total > 0 ? total : 1);
+  size = (batch - 1)*hop + nfft;
+  sp->batch[0] = malloc(2*size*sizeof(double));
+  sp->raw_frames = SCRATCH_SIZE/nc;
+  if (sp->raw_frames < 1) sp->raw_frames = 1;
+  sp->raw = malloc(sp->raw_frames*nc*sizeof(sox_sample_t));
+  sp->ntasks = nthreads;
+  sp->tasks = malloc(nthreads*(sizeof(spectro_task_t) +
+                               spectro_work_size(sp) + sizeof(double)));
+  if (sp->batch[0] == NULL || sp->raw == NULL || sp->tasks == NULL) {
+    y_error("insufficient memory");
+  }
+  sp->batch[1] = sp->batch[0] + size;
+  for (i = 0; i < nthreads; ++i) {
+    char* base = (char*)(sp->tasks + nthreads);
+    sp->tasks[i].sp = sp;
+    sp->tasks[i].work = base + i*(spectro_work_size(sp) + sizeof(double));
+    sp->tasks[i].started = FALSE;
+  }
+  if (total == 0) {
+    ypush_nil();
+    return;
+  }
+  if (total > 0) {
+    long dims[3];
+    dims[0] = 2;
+    dims[1] = sp->nout;
+    dims[2] = total;
+    out = ypush_f(dims);
+  }
+
+  /* Process the frames by batches.  With a block cache, the target offset
+     is set first and the decoder is then moved to it. */
+  seek_to(obj, offset);
+  sync_cache(obj);
+  cur = sp->batch[0];
+  nxt = sp->batch[1];
+  have = spectro_fill(sp, obj, cur, size, &count);
+  done = 0;
+  for (;;) {
+    long nfr = (have >= nfft ? 1 + (have - nfft)/hop : 0), next = 0;
+    if (nfr > batch) nfr = batch;
+    if (total >= 0 && nfr > total - done) nfr = total - done;
+    if (nfr <= 0 || p_signalling) break;
+    if (total < 0 && done + nfr > sp->grow_frames) {
+      long n = 2*sp->grow_frames + nfr;
+      float* grow = realloc(sp->grow, n*sp->nout*sizeof(float));
+      if (grow == NULL) {
+        nomem = TRUE;
+        break;
+      }
+      sp->grow = grow;
+      sp->grow_frames = n;
+    }
+    sp->x = cur;
+    sp->out = (total >= 0 ? out : sp->grow) + done*sp->nout;
+    sp->nframes = nfr;
+    sp->next = 0;
+    for (i = 1; i < sp->ntasks; ++i) {
+      sp->tasks[i].started = (pthread_create(&sp->tasks[i].thread, NULL,
+                                             spectro_worker,
+                                             &sp->tasks[i]) == 0);
+    }
+
+    /* Decode the next batch while the workers are running. */
+    if (nfr == batch) {
+      long shift = batch*hop, keep = have - shift;
+      if (keep > 0) {
+        memcpy(nxt, cur + shift, keep*sizeof(double));
+      } else {
+        spectro_fill(sp, obj, NULL, -keep, &count);
+        keep = 0;
+      }
+      next = keep + spectro_fill(sp, obj, nxt + keep, size - keep, &count);
+    }
+
+    /* Help the workers and wait for them. */
+    spectro_worker(&sp->tasks[0]);
+    for (i = 1; i < sp->ntasks; ++i) {
+      if (sp->tasks[i].started) pthread_join(sp->tasks[i].thread, NULL);
+      sp->tasks[i].started = FALSE;
+    }
+    done += nfr;
+    if (nfr < batch) break;
+    have = next;
+    cur = nxt;
+    nxt = (cur == sp->batch[0] ? sp->batch[1] : sp->batch[0]);
+  }
+  if (obj->cache != NULL) obj->cache->pos = obj->offset;
+  critical();
+  if (nomem) y_error("insufficient memory");
+  if (total >= 0 && done < total) {
+    y_error("premature end of stream");
+  }
+  if (total < 0) {
+    long dims[3];
+    if (done == 0) {
+      ypush_nil();
+      return;
+    }
+    dims[0] = 2;
+    dims[1] = sp->nout;
+    dims[2] = done;
+    out = ypush_f(dims);
+    memcpy(out, sp->grow, done*sp->nout*sizeof(float));
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* WRITING AUDIO */
+
+static sox_bool
+overwrite_permitted(char const * filename)
+{
+  return sox_true;
+}
+
+static sox_bool
+overwrite_forbidden(char const * filename)
+{
+  return sox_false;
+}
+
+/* Options for opening an output stream. */
+typedef struct _write_opts {
+  sox_signalinfo_t signal;
+  sox_encodinginfo_t encoding;
+  const char* filetype;
+  int overwrite;
+  int planar;        /* default layout of the samples to write */
+  long async;        /* number of queued blocks, 0 for synchronous */
+} write_opts_t;
+
+static long async_index = -1L;
+static long bits_per_sample_index = -1L;
+static long channels_index = -1L;
+static long compression_index = -1L;
+static long encoding_index = -1L;
+static long filetype_index = -1L;
+static long layout_index = -1L;
+static long overwrite_index = -1L;
+static long precision_index = -1L;
+static long rate_index = -1L;
+static long template_index = -1L;
+
+/* Initialize options for writing with the settings of the signal REF (if
+   not NULL) or with the default settings, then with the settings of the
+   template stream if the template keyword is among the ARGC arguments. */
+static void
+init_write_opts(write_opts_t* opts, int argc, const sox_signalinfo_t* ref)
+{
+  int iarg;
+
+  /* Initialize all keyword indexes. */
+#define INIT(s) if (s##_index == -1L) s##_index = yget_global(#s, 0)
+  INIT(async);
+  INIT(bits_per_sample);
+  INIT(channels);
+  INIT(compression);
+  INIT(encoding);
+  INIT(filetype);
+  INIT(layout);
+  INIT(overwrite);
+  INIT(precision);
+  INIT(rate);
+  INIT(template);
+#undef INIT
+
+  memset(opts, 0, sizeof(write_opts_t));
+  sox_init_encodinginfo(&opts->encoding);
+  if (ref != NULL) {
+    opts->signal = *ref;
+  } else {
+    opts->signal.rate = SOX_DEFAULT_RATE;
+    opts->signal.channels = SOX_DEFAULT_CHANNELS;
+    opts->signal.precision = SOX_DEFAULT_PRECISION;
+    opts->encoding.encoding = SOX_DEFAULT_ENCODING;
+    opts->encoding.bits_per_sample = SOX_UNSPEC;
+    opts->encoding.compression = 1.0;
+  }
+  opts->signal.length = SOX_UNKNOWN_LEN;
+  opts->signal.mult = NULL;
+
+  /* Parse the template keyword first. */
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    long index = yarg_key(iarg);
+    if (index >= 0) {
+      --iarg;
+      if (index == template_index) {
+        sox_format_t* ft = ysox_fetch(iarg)->format;
+        if (ft == NULL) {
+          y_error("input/output of template stream has been closed");
+        }
+        opts->signal = ft->signal;
+        opts->signal.length = SOX_UNKNOWN_LEN;
+        opts->signal.mult = NULL;
+        opts->encoding = ft->encoding;
+        opts->filetype = ft->filetype;
+      }
+    }
+  }
+}
+
+/* Parse keyword with given INDEX and value at stack position IARG, returns
+   FALSE if this is not an option for writing. */
+static int
+parse_write_opt(write_opts_t* opts, long index, int iarg)
+{
+  if (index == async_index) {
+    if (! yarg_nil(iarg)) {
+      opts->async = ygets_l(iarg);
+      if (opts->async < 0) y_error("invalid queue size");
+      if (opts->async == 1) opts->async = WRITER_QUEUE;
+    }
+  } else if (index == bits_per_sample_index) {
+    long value = ygets_l(iarg);
+    opts->encoding.bits_per_sample = (unsigned int)value;
+    if (value <= 0 || opts->encoding.bits_per_sample != value) {
+      y_error("illegal bits per sample");
+    }
+  } else if (index == channels_index) {
+    long value = ygets_l(iarg);
+    opts->signal.channels = (unsigned int)value;
+    if (value <= 0 || opts->signal.channels != value) {
+      y_error("illegal number of channels");
+    }
+  } else if (index == compression_index) {
+    opts->encoding.compression = ygets_d(iarg);
+    if (opts->encoding.compression <= 0.0) {
+      y_error("illegal compression");
+    }
+  } else if (index == encoding_index) {
+    long value = ygets_l(iarg);
+    opts->encoding.encoding = (unsigned int)value;
+    if (value <= 0 || opts->encoding.encoding != value) {
+      y_error("illegal encoding");
+    }
+  } else if (index == filetype_index) {
+    opts->filetype = ygets_q(iarg);
+  } else if (index == layout_index) {
+    if (! yarg_nil(iarg)) opts->planar = get_layout(iarg);
+  } else if (index == overwrite_index) {
+    opts->overwrite = yarg_true(iarg);
+  } else if (index == precision_index) {
+    long value = ygets_l(iarg);
+    opts->signal.precision = (unsigned int)value;
+    if (value <= 0 || opts->signal.precision != value) {
+      y_error("illegal precision");
+    }
+  } else if (index == rate_index) {
+    opts->signal.rate = ygets_d(iarg);
+    if (opts->signal.rate <= 0.0) {
+      y_error("illegal rate");
+    }
+  } else if (index != template_index) {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Open an output stream, the libSoX stream is stored into OBJ.  If PATH is
+   NULL, the data are encoded in memory.  OOB may be NULL. */
+static void
+open_write(ysox_t* obj, const char* path, const write_opts_t* opts,
+           sox_oob_t* oob)
+{
+  critical();
+  if (path == NULL && opts->filetype == NULL) {
+    y_error("file type must be specified for an in-memory stream");
+  }
+  if (path == NULL && strcmp(opts->filetype, "w64") == 0) {
+    /* Only the headers of WAV and AIFF files are fixed when closing. */
+    y_error("the header of an in-memory Wave64 stream cannot be finalized");
+  }
+  switch_fpemask(OFF);
+  if (path == NULL) {
+    obj->format = sox_open_memstream_write(&obj->membuf, &obj->memsize,
+                                           &opts->signal, &opts->encoding,
+                                           opts->filetype, oob);
+  } else {
+    obj->format = sox_open_write(path, &opts->signal, &opts->encoding,
+                                 opts->filetype, oob,
+                                 (opts->overwrite ? overwrite_permitted :
+                                  overwrite_forbidden));
+  }
+  switch_fpemask(ON);
+  if (obj->format == NULL) y_error("failed to open audio file");
+  obj->offset = 0;
+  obj->rd.planar = opts->planar;
+}
+
+void
+Y_sox_open_write(int argc)
+{
+  write_opts_t opts;
+  ysox_t* obj;
+  char* path = NULL;
+  int iarg, nargs = 0;
+
+  /* Parse arguments. */
+  init_write_opts(&opts, argc, NULL);
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    long index = yarg_key(iarg);
+    if (index < 0) {
+      /* Positional argument. */
+      if (++nargs > 1) y_error("too many arguments");
+      path = fetch_path(iarg);
+    } else {
+      /* Keyword argument. */
+      --iarg;
+      if (! parse_write_opt(&opts, index, iarg)) {
+        y_error("unsupported keyword");
+      }
+    }
+  }
+
+  obj = ysox_push();
+  open_write(obj, path, &opts, NULL);
+  if (opts.async > 0) start_writer(obj, opts.async);
+}
+
+void
+Y_sox_write(int argc)
+{
+  ysox_t* obj = NULL;
+  int iarg, nargs = 0, idata = -1, planar = -1;
+  static long layout_index = -1L;
+
+  if (layout_index == -1L) layout_index = yget_global("layout", 0);
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    long index = yarg_key(iarg);
+    if (index < 0) {
+      /* Positional argument. */
+      switch (++nargs) {
+      case 1:
+        obj = ysox_fetch(iarg);
+        break;
+      case 2:
+        idata = iarg;
+        break;
+      default:
+        y_error("too many arguments");
+      }
+    } else {
+      /* Keyword argument. */
+      --iarg;
+      if (index == layout_index) {
+        if (! yarg_nil(iarg)) planar = get_layout(iarg);
+      } else {
+        y_error("unsupported keyword");
+      }
+    }
+  }
+  if (nargs != 2) y_error("expecting exactly two arguments");
+  if (planar < 0) planar = obj->rd.planar;
+  if (idata != 0) {
+    /* Make the data the top of the stack. */
+    yarg_swap(idata, 0);
+  }
+  write_samples(obj, 0, planar);
+}
+
+/* Convert N values of given Yorick type (and number of bits) to SoX audio
+   samples, returns the number of clipped samples. */
+static long
+values_to_samples(sox_sample_t* dst, const void* src, long n, int type,
+                  size_t nbits)
+{
+  /* Convert to SoX audio samples (signed 32-bit integers).  According to
+   * libSoX documentation:
+   *
+   *  - Conversions should be as accurate as possible (with rounding).
+   *
+   *  - Unsigned integers are converted to and from signed integers by
+   *    flipping the upper-most bit then treating them as signed integers.
+   */
+  if (type == Y_FLOAT) {
+    return float_to_samples(dst, src, n);
+  }
+  if (type == Y_DOUBLE) {
+    return double_to_samples(dst, src, n);
+  }
+  /* FIXME: not really rounding to nearest value? */
+  if (nbits == 8) {
+    /* We assume unsigned bytes (and signed shorts), as returned by
+       sox_read with type=char (type=short). */
+    uchar_to_samples(dst, src, n);
+  } else if (nbits == 16) {
+    short_to_samples(dst, src, n);
+  } else if (nbits == 32) {
+    memcpy(dst, src, n*sizeof(sox_sample_t));
+  } else if (nbits == 64) {
+    int64_to_samples(dst, src, n);
+  } else {
+    y_error("unsupported integer type for conversion to SoX audio samples");
+  }
+  return 0;
+}
+
+static void
+write_samples(ysox_t* obj, int iarg, int planar)
+{
+  void* buf;
+  long samples, channels, ntot, n, clips = 0;
+  long dims[Y_DIMSIZE];
+  int type, integer;
+  size_t nbits;
+  sox_uint64_t pos;
+  int64_t mark, t0;
+
+  if (obj->format == NULL || obj->format->mode != 'w') {
+    y_error("sound stream not open for writing");
+  }
+  channels = obj->format->signal.channels;
+  buf = ygeta_any(iarg, &ntot, dims, &type);
+  switch (type) {
+  case Y_CHAR:
+    nbits = 8*sizeof(char);
+    integer = TRUE;
+    break;
+  case Y_SHORT:
+    nbits = 8*sizeof(short);
+    integer = TRUE;
+    break;
+  case Y_INT:
+    nbits = 8*sizeof(int);
+    integer = TRUE;
+    break;
+  case Y_LONG:
+    nbits = 8*sizeof(long);
+    integer = TRUE;
+    break;
+  case Y_FLOAT:
+    nbits = 8*sizeof(float);
+    integer = FALSE;
+    break;
+  case Y_DOUBLE:
+    nbits = 8*sizeof(double);
+    integer = FALSE;
+    break;
+  default:
+    y_error("invalid audio data type");
+    return;
+  }
+  if (channels == 1) planar = FALSE;
+  if (planar) {
+    if (dims[0] != 2 || dims[2] != channels) {
+      y_error("expecting SAMPLES-by-CHANNELS audio data");
+    }
+    samples = dims[1];
+  } else if ((dims[0] == 1 || dims[0] == 2) && dims[1] == channels) {
+    samples = ntot/channels;
+  } else if (channels == 1 && dims[0] <= 1) {
+    samples = ntot;
+  } else {
+    y_error("expecting CHANNELS-by-SAMPLES audio data");
+  }
+  if (SOX_SAMPLE_PRECISION != 32 || sizeof(sox_sample_t) != 4) {
+    y_error("expecting 32-bit integers for SoX audio samples");
+  }
+  mark = start_io_call(obj, IO_WRITES);
+  if (planar) {
+    /* Interleave blocks of frames into a small buffer and convert them (or
+       directly interleave 32-bit integers). */
+    sox_sample_t* tmp = push_samples(Y_INT, channels, samples);
+    size_t elsize = nbits/8;
+    double blk[LAYOUT_BLOCK/sizeof(double)];
+    void* wrk = blk;
+    long nb = sizeof(blk)/(channels*elsize), f, m;
+    if (nb < 1) {
+      nb = 1;
+      wrk = ypush_scratch(channels*elsize, NULL);
+    }
+    for (f = 0; f < samples; f += m) {
+      m = (samples - f < nb ? samples - f : nb);
+      if (integer && nbits == SOX_SAMPLE_PRECISION) {
+        planar_to_interleaved(tmp + f*channels, buf, samples, f, m,
+                              channels, elsize);
+      } else {
+        planar_to_interleaved(wrk, buf, samples, f, m, channels, elsize);
+        clips += values_to_samples(tmp + f*channels, wrk, m*channels,
+                                   type, nbits);
+      }
+    }
+    if (wrk != blk) yarg_drop(1);
+
+    /* Replace stack items. */
+    yarg_swap(iarg + 1, 0);
+    yarg_drop(1);
+    buf = tmp;
+  } else if (! integer || nbits != SOX_SAMPLE_PRECISION) {
+    sox_sample_t* tmp = push_samples(Y_INT, channels, samples);
+    clips = values_to_samples(tmp, buf, ntot, type, nbits);
+
+    /* Replace stack items. */
+    yarg_swap(iarg + 1, 0);
+    yarg_drop(1);
+    buf = tmp;
+  }
+  end_io_call(obj, mark);
+
+  critical();
+  if (obj->wr != NULL) {
+    /* Encoding time and bytes are not accounted for a background
+       encoder. */
+    queue_block(obj, buf, ntot, clips);
+    obj->offset += samples;
+    count_io(obj, IO_FRAMES_OUT, samples);
+    return;
+  }
+  obj->format->clips += clips;
+  pos = obj->format->tell_off;
+  t0 = clock_ns();
+  n = sox_write(obj->format, buf, ntot);
+  count_io(obj, IO_CODEC_TIME, clock_ns() - t0);
+  count_io(obj, IO_BYTES_OUT, obj->format->tell_off - pos);
+  count_io(obj, IO_FRAMES_OUT, (n > 0 ? n/channels : 0));
+  obj->offset += (n > 0 ? n/channels : 0);
+  if (n != ntot) y_errorn("write error (%ld samples written)", n);
+}
+
+/*---------------------------------------------------------------------------*/
+/* ASYNCHRONOUS WRITING */
+
+/* Converted samples are copied into blocks which are queued for a writer
+   thread, the only user of the libSoX stream while it is running.  The
+   queue is a ring of NSLOTS blocks protected by a mutex, the producer waits
+   when the queue is full.  A write error stops the encoding: the following
+   blocks are discarded and the number of lost samples is reported by the
+   next call to write_samples or by sox_close. */
+
+typedef struct _write_block {
+  sox_sample_t* data;
+  size_t len;
+  long clips;            /* number of clipped samples during conversion */
+} write_block_t;
+
+struct _writer {
+  sox_format_t* format;
+  write_block_t* slots;
+  long nslots;           /* number of slots in the queue */
+  long head;             /* index of the next block to write */
+  long count;            /* number of queued blocks */
+  long busy;             /* a block is being written */
+  long lost;             /* number of samples not written */
+  int stop;              /* the worker must stop */
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static void*
+writer_worker(void* arg)
+{
+  writer_t* wr = (writer_t*)arg;
+  pthread_mutex_lock(&wr->mutex);
+  for (;;) {
+    write_block_t blk;
+    size_t n;
+    while (wr->count == 0 && ! wr->stop) {
+      pthread_cond_wait(&wr->cond, &wr->mutex);
+    }
+    if (wr->count == 0) break;
+    blk = wr->slots[wr->head];
+    wr->head = (wr->head + 1)%wr->nslots;
+    --wr->count;
+    wr->busy = TRUE;
+    pthread_cond_broadcast(&wr->cond);
+    if (wr->lost > 0) {
+      /* Discard the block after an error. */
+      wr->lost += blk.len;
+      n = blk.len;
+    } else {
+      pthread_mutex_unlock(&wr->mutex);
+      wr->format->clips += blk.clips;
+      n = sox_write(wr->format, blk.data, blk.len);
+      pthread_mutex_lock(&wr->mutex);
+      if (n != blk.len) wr->lost += blk.len - n;
+    }
+    free(blk.data);
+    wr->busy = FALSE;
+    pthread_cond_broadcast(&wr->cond);
+  }
+  pthread_mutex_unlock(&wr->mutex);
+  return NULL;
+}
+
+static void
+start_writer(ysox_t* obj, long nslots)
+{
+  writer_t* wr;
+  if (obj->wr != NULL) return;
+  wr = malloc(sizeof(writer_t) + nslots*sizeof(write_block_t));
+  if (wr == NULL) y_error("insufficient memory");
+  memset(wr, 0, sizeof(writer_t));
+  wr->format = obj->format;
+  wr->slots = (write_block_t*)(wr + 1);
+  wr->nslots = nslots;
+  pthread_mutex_init(&wr->mutex, NULL);
+  pthread_cond_init(&wr->cond, NULL);
+  if (pthread_create(&wr->thread, NULL, writer_worker, wr) != 0) {
+    pthread_cond_destroy(&wr->cond);
+    pthread_mutex_destroy(&wr->mutex);
+    free(wr);
+    y_error("failed to start encoding thread");
+  }
+  obj->wr = wr;
+}
+
+static long
+drain_writer(ysox_t* obj, int finish)
+{
+  writer_t* wr = obj->wr;
+  long lost;
+  if (wr == NULL) return 0;
+  pthread_mutex_lock(&wr->mutex);
+  if (finish) {
+    wr->stop = TRUE;
+    pthread_cond_broadcast(&wr->cond);
+  } else {
+    while (wr->count > 0 || wr->busy) {
+      pthread_cond_wait(&wr->cond, &wr->mutex);
+    }
+  }
+  lost = wr->lost;
+  pthread_mutex_unlock(&wr->mutex);
+  if (finish) {
+    pthread_join(wr->thread, NULL);
+    lost = wr->lost;
+    pthread_cond_destroy(&wr->cond);
+    pthread_mutex_destroy(&wr->mutex);
+    free(wr);
+    obj->wr = NULL;
+  }
+  return lost;
+}
+
+static long
+writer_counter(ysox_t* obj, int which)
+{
+  writer_t* wr = obj->wr;
+  long count;
+  if (wr == NULL) return 0;
+  if (which != 0) return wr->nslots;
+  pthread_mutex_lock(&wr->mutex);
+  count = wr->count + (wr->busy ? 1 : 0);
+  pthread_mutex_unlock(&wr->mutex);
+  return count;
+}
+
+/* The producer waits for a free slot if the queue is full. */
+static void
+queue_block(ysox_t* obj, const sox_sample_t* buf, size_t n, long clips)
+{
+  writer_t* wr = obj->wr;
+  write_block_t blk;
+  long lost;
+  pthread_mutex_lock(&wr->mutex);
+  lost = wr->lost;
+  pthread_mutex_unlock(&wr->mutex);
+  if (lost > 0) y_errorn("deferred write error (%ld samples lost)", lost);
+  if (n == 0) return;
+  blk.data = malloc(n*sizeof(sox_sample_t));
+  if (blk.data == NULL) y_error("insufficient memory");
+  memcpy(blk.data, buf, n*sizeof(sox_sample_t));
+  blk.len = n;
+  blk.clips = clips;
+  pthread_mutex_lock(&wr->mutex);
+  while (wr->count >= wr->nslots) {
+    pthread_cond_wait(&wr->cond, &wr->mutex);
+  }
+  wr->slots[(wr->head + wr->count)%wr->nslots] = blk;
+  ++wr->count;
+  pthread_cond_broadcast(&wr->cond);
+  pthread_mutex_unlock(&wr->mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+/* TRANSCODING */
+
+/* Files are converted by the same function on the interpreter thread
+   (sox_convert) or by a pool of threads (sox_convert_many) where each
+   thread repeatedly claims the next file not yet processed.  The
+   conversion does not use the Yorick API, errors are recorded per file. */
+
+typedef struct _convert_job {
+  const char* inpath;
+  const char* outpath;
+  long frames;          /* number of frames written */
+  long clips;           /* number of clipped samples */
+  double seconds;       /* elapsed time */
+  int status;           /* 0 if done, 1 if failed, 2 if not started */
+  char errmsg[80];      /* error message, empty if none */
+} convert_job_t;
+
+typedef struct _convert_batch {
+  convert_job_t* jobs;
+  long njobs;
+  long next;            /* index of next job to process */
+  const write_opts_t* opts; /* settings of the output files (zero rate,
+                               channels or precision means same as the
+                               input file) */
+  int comments;         /* copy the comments */
+} convert_batch_t;
+
+/* Convert a file, BUF is a workspace for SCRATCH_SIZE samples. */
+static void
+convert_one(const convert_batch_t* b, convert_job_t* job, sox_sample_t* buf)
+{
+  const write_opts_t* opts = b->opts;
+  ysox_t obj;
+  sox_format_t* out = NULL;
+  sox_signalinfo_t signal;
+  sox_oob_t oob;
+  sox_uint64_t pos;
+  long nc, len, n, m;
+  int64_t t0 = clock_ns(), t1;
+
+  memset(&obj, 0, sizeof(obj));
+  job->status = 1;
+  if (job->inpath == NULL || job->outpath == NULL) {
+    strcpy(job->errmsg, "invalid path");
+    return;
+  }
+  obj.format = sox_open_read(job->inpath, NULL, NULL, NULL);
+  if (obj.format == NULL) {
+    strcpy(job->errmsg, "failed to open input audio file");
+    return;
+  }
+  attach_pcm_map(&obj);
+
+  /* Convert the rate, number of channels and precision of the samples as
+     they are read. */
+  signal = obj.format->signal;
+  if (opts->signal.rate > 0.0) signal.rate = opts->signal.rate;
+  if (opts->signal.channels > 0) signal.channels = opts->signal.channels;
+  if (opts->signal.precision > 0) signal.precision = opts->signal.precision;
+  signal.length = SOX_UNKNOWN_LEN;
+  signal.mult = NULL;
+  if (attach_converter(&obj, signal.rate, signal.channels,
+                       signal.precision) != 0) {
+    strcpy(job->errmsg, "insufficient memory");
+    goto done;
+  }
+  nc = stream_signal(&obj)->channels;
+  if (nc < 1) {
+    strcpy(job->errmsg, "unknown number of channels");
+    goto done;
+  }
+  memset(&oob, 0, sizeof(oob));
+  if (b->comments) oob.comments = obj.format->oob.comments;
+  out = sox_open_write(job->outpath, &signal, &opts->encoding,
+                       opts->filetype, &oob,
+                       (opts->overwrite ? overwrite_permitted :
+                        overwrite_forbidden));
+  if (out == NULL) {
+    strcpy(job->errmsg, "failed to open output audio file");
+    goto done;
+  }
+
+  /* Transfer the samples with a single buffer. */
+  len = (SCRATCH_SIZE/nc)*nc;
+  for (;;) {
+    if (p_signalling) {
+      strcpy(job->errmsg, "interrupted");
+      break;
+    }
+    if (obj.conv != NULL) {
+      n = convert_raw(&obj, buf, len/nc)*nc;
+    } else {
+      n = decode_source(&obj, buf, len);
+      n = (n/nc)*nc;
+    }
+    if (n <= 0) break;
+    pos = out->tell_off;
+    t1 = clock_ns();
+    m = sox_write(out, buf, n);
+    count_io(&obj, IO_CODEC_TIME, clock_ns() - t1);
+    count_io(&obj, IO_BYTES_OUT, out->tell_off - pos);
+    count_io(&obj, IO_FRAMES_OUT, (m > 0 ? m/nc : 0));
+    count_io(&obj, IO_WRITES, 1);
+    if (m != n) {
+      strcpy(job->errmsg, "write error");
+      break;
+    }
+    job->frames += n/nc;
+    if (n < len) break;
+  }
+  if (job->errmsg[0] == '\0' && obj.map == NULL
+      && obj.format->sox_errno != 0) {
+    /* A decoding error is not the end of the input. */
+    snprintf(job->errmsg, sizeof(job->errmsg), "read error (%.64s)",
+             obj.format->sox_errstr);
+  }
+  job->clips = (long)(obj.format->clips + out->clips);
+  count_clips(out->clips);
+
+ done:
+  if (out != NULL) {
+    if (sox_close(out) != SOX_SUCCESS && job->errmsg[0] == '\0') {
+      strcpy(job->errmsg, "failed to finalize output audio file");
+    }
+    if (job->errmsg[0] != '\0') remove(job->outpath);
+  }
+  if (obj.conv != NULL) free(obj.conv);
+  if (obj.map != NULL) free_pcm_map(obj.map);
+  account_clips(&obj);
+  sox_close(obj.format);
+  if (job->errmsg[0] == '\0') job->status = 0;
+  job->seconds = 1e-9*(clock_ns() - t0);
+}
+
+static void*
+convert_worker(void* arg)
+{
+  convert_batch_t* b = (convert_batch_t*)arg;
+  sox_sample_t* buf = malloc(SCRATCH_SIZE*sizeof(sox_sample_t));
+  if (buf == NULL) return NULL;
+  for (;;) {
+    long i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+    if (i >= b->njobs || p_signalling) break;
+    convert_one(b, &b->jobs[i], buf);
+  }
+  free(buf);
+  return NULL;
+}
+
+/* Parse the arguments of sox_convert and sox_convert_many, the NMIN to NMAX
+   positional arguments are stored into POS (as stack positions, -1 for
+   missing optional arguments). */
+static void
+get_convert_args(int argc, write_opts_t* opts, int* comments,
+                 long* nthreads, int* pos, int nmin, int nmax)
+{
+  static const sox_signalinfo_t unset; /* all zero */
+  static long comments_index = -1L;
+  static long threads_index = -1L;
+  int iarg, nargs = 0;
+
+  /* Initialize all keyword indexes. */
+#define INIT(s) if (s##_index == -1L) s##_index = yget_global(#s, 0)
+  INIT(comments);
+  INIT(threads);
+#undef INIT
+
+  *comments = TRUE;
+  init_write_opts(opts, argc, &unset);
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    long index = yarg_key(iarg);
+    if (index < 0) {
+      /* Positional argument. */
+      if (nargs >= nmax) y_error("too many arguments");
+      pos[nargs++] = iarg;
+    } else {
+      /* Keyword argument. */
+      --iarg;
+      if (index == comments_index) {
+        *comments = yarg_true(iarg);
+      } else if (index == threads_index && nthreads != NULL) {
+        if (! yarg_nil(iarg)) *nthreads = ygets_l(iarg);
+      } else if (! parse_write_opt(opts, index, iarg)) {
+        y_error("unsupported keyword");
+      }
+    }
+  }
+  if (nargs < nmin) y_error("not enough arguments");
+  while (nargs < nmax) pos[nargs++] = -1;
+}
+
+void
+Y_sox_convert(int argc)
+{
+  write_opts_t opts;
+  convert_batch_t b;
+  convert_job_t job;
+  sox_sample_t* buf;
+  long* result;
+  long dims[2];
+  int pos[2];
+
+  get_convert_args(argc, &opts, &b.comments, NULL, pos, 2, 2);
+  memset(&job, 0, sizeof(job));
+  job.inpath = fetch_path(pos[0]);
+  job.outpath = fetch_path(pos[1]);
+  b.jobs = &job;
+  b.njobs = 1;
+  b.next = 0;
+  b.opts = &opts;
+  if (opts.signal.rate > 0.0 && init_resample_table() != 0) {
+    y_error("insufficient memory");
+  }
+  buf = ypush_scratch(SCRATCH_SIZE*sizeof(sox_sample_t), NULL);
+  critical();
+  switch_fpemask(OFF);
+  convert_one(&b, &job, buf);
+  switch_fpemask(ON);
+  critical();
+  if (job.status != 0) {
+    static char errmsg[sizeof(job.errmsg)];
+    memcpy(errmsg, job.errmsg, sizeof(errmsg));
+    y_error(errmsg);
+  }
+  dims[0] = 1;
+  dims[1] = 2;
+  result = ypush_l(dims);
+  result[0] = job.frames;
+  result[1] = job.clips;
+}
+
+void
+Y_sox_convert_many(int argc)
+{
+  write_opts_t opts;
+  convert_batch_t* b;
+  pthread_t* threads;
+  char** inpaths;
+  char** outpaths;
+  char** errs;
+  double* res;
+  long dims[Y_DIMSIZE], odims[Y_DIMSIZE], npaths, nout, nthreads = 0;
+  long started, i, errs_ref = -1L;
+  int pos[3], comments;
+
+  /* Parse arguments. */
+  get_convert_args(argc, &opts, &comments, &nthreads, pos, 2, 3);
+  inpaths = ygeta_q(pos[0], &npaths, dims);
+  outpaths = ygeta_q(pos[1], &nout, NULL);
+  if (nout != npaths) {
+    y_error("there must be as many input paths as output paths");
+  }
+  if (pos[2] >= 0) {
+    errs_ref = yget_ref(pos[2]);
+    if (errs_ref < 0 && ! yarg_nil(pos[2])) {
+      y_error("expecting a simple variable for the errors");
+    }
+  }
+  if (opts.signal.rate > 0.0 && init_resample_table() != 0) {
+    y_error("insufficient memory");
+  }
+
+  /* Setup the jobs, paths are converted on the interpreter thread. */
+  b = ypush_scratch(sizeof(convert_batch_t) + npaths*sizeof(convert_job_t),
+                    NULL);
+  memset(b, 0, sizeof(convert_batch_t) + npaths*sizeof(convert_job_t));
+  b->jobs = (convert_job_t*)(b + 1);
+  b->njobs = npaths;
+  b->opts = &opts;
+  b->comments = comments;
+  errs = ypush_q(dims);
+  for (i = 0; i < npaths; ++i) {
+    errs[i] = (inpaths[i] != NULL ? p_native(inpaths[i]) : NULL);
+    b->jobs[i].inpath = errs[i];
+    b->jobs[i].status = 2;
+  }
+  errs = ypush_q(dims);
+  for (i = 0; i < npaths; ++i) {
+    errs[i] = (outpaths[i] != NULL ? p_native(outpaths[i]) : NULL);
+    b->jobs[i].outpath = errs[i];
+  }
+
+  /* Convert all files. */
+  if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > npaths) nthreads = npaths;
+  if (nthreads < 1) nthreads = 1;
+  threads = ypush_scratch(nthreads*sizeof(pthread_t), NULL);
+  critical();
+  switch_fpemask(OFF);
+  for (started = 0; started < nthreads; ++started) {
+    if (pthread_create(&threads[started], NULL, convert_worker, b) != 0) {
+      break;
+    }
+  }
+  if (started == 0) convert_worker(b);
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  switch_fpemask(ON);
+  yarg_drop(1); /* drop thread identifiers */
+  critical();
+
+  /* Report status, frames, clips and elapsed time of each file. */
+  odims[0] = dims[0] + 1;
+  odims[1] = 4;
+  memcpy(odims + 2, dims + 1, dims[0]*sizeof(long));
+  res = ypush_d(odims);
+  for (i = 0; i < npaths; ++i) {
+    convert_job_t* job = &b->jobs[i];
+    res[4*i] = job->status;
+    res[4*i + 1] = job->frames;
+    res[4*i + 2] = job->clips;
+    res[4*i + 3] = job->seconds;
+  }
+  if (errs_ref >= 0) {
+    errs = ypush_q(dims);
+    for (i = 0; i < npaths; ++i) {
+      convert_job_t* job = &b->jobs[i];
+      errs[i] = (job->status == 1 ? p_strcpy(job->errmsg) :
+                 job->status == 2 ? p_strcpy("not started") : NULL);
+    }
+    yput_global(errs_ref, 0);
+    yarg_drop(1);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* EFFECTS CHAIN */
+
+static void ychain_free(void*);
+static void ychain_print(void*);
+static void ychain_extract(void*, char*);
+
+typedef struct _ychain ychain_t;
+struct _ychain {
+  sox_effects_chain_t* chain;
+  sox_signalinfo_t signal;  /* signal at the end of the chain */
+  sox_encodinginfo_t encoding;
+  ysox_t* input;            /* input stream */
+  ysox_t* output;           /* output stream, NULL for an array sink */
+  void* input_use;          /* used to keep the streams alive */
+  void* output_use;
+  sox_sample_t* data;       /* samples collected by the array sink */
+  size_t size, len;         /* allocated and used number of samples */
+  int flowed;               /* the chain has been run */
+  int failure;              /* failure of the output effect (one of the
+                               CHAIN_* codes) */
+};
+
+/* Failures of the output effect, reported after the chain has run. */
+#define CHAIN_OK         0
+#define CHAIN_WRITE_FAIL 1
+#define CHAIN_NO_MEMORY  2
+
+static y_userobj_t ychain_type = {
+  "SoX effects chain", ychain_free, ychain_print, NULL, ychain_extract
+};
+
+/* Private data for the input/output effects.  These effects run inside
+   sox_flow_effects and must not throw Yorick errors, they directly call
+   libSoX and keep the offsets of the streams up to date. */
+typedef struct _chain_priv {
+  ychain_t* owner;
+} chain_priv_t;
+
+static int
+input_drain(sox_effect_t* effp, sox_sample_t* obuf, size_t* osamp)
+{
+  ysox_t* obj = ((chain_priv_t*)effp->priv)->owner->input;
+  size_t channels = obj->format->signal.channels;
+  size_t n = decode_source(obj, obuf, (*osamp/channels)*channels);
+  obj->offset += n/channels;
+  *osamp = n;
+  return (n > 0 ? SOX_SUCCESS : SOX_EOF);
+}
+
+static int
+output_flow(sox_effect_t* effp, const sox_sample_t* ibuf,
+            sox_sample_t* obuf, size_t* isamp, size_t* osamp)
+{
+  ychain_t* ch = ((chain_priv_t*)effp->priv)->owner;
+  size_t n = *isamp;
+  *osamp = 0;
+  if (ch->output != NULL) {
+    ysox_t* obj = ch->output;
+    size_t channels = obj->format->signal.channels;
+    size_t m = sox_write(obj->format, ibuf, n);
+    obj->offset += m/channels;
+    if (m != n) {
+      ch->failure = CHAIN_WRITE_FAIL;
+      return SOX_EOF;
+    }
+  } else if (n > 0) {
+    if (ch->len + n > ch->size) {
+      size_t size = 2*ch->size + n;
+      sox_sample_t* data = realloc(ch->data, size*sizeof(sox_sample_t));
+      if (data == NULL) {
+        ch->failure = CHAIN_NO_MEMORY;
+        return SOX_EOF;
+      }
+      ch->data = data;
+      ch->size = size;
+    }
+    memcpy(ch->data + ch->len, ibuf, n*sizeof(sox_sample_t));
+    ch->len += n;
+  }
+  return SOX_SUCCESS;
+}
+
+static const sox_effect_handler_t input_handler = {
+  "ysox_input", NULL, SOX_EFF_MCHAN, NULL, NULL, NULL, input_drain,
+  NULL, NULL, sizeof(chain_priv_t)
+};
+
+static const sox_effect_handler_t output_handler = {
+  "ysox_output", NULL, SOX_EFF_MCHAN, NULL, NULL, output_flow, NULL,
+  NULL, NULL, sizeof(chain_priv_t)
+};
+
+static void
+ychain_free(void* addr)
+{
+  ychain_t* ch = (ychain_t*)addr;
+  if (ch->chain != NULL) sox_delete_effects_chain(ch->chain);
+  if (ch->data != NULL) free(ch->data);
+  if (ch->input_use != NULL) ydrop_use(ch->input_use);
+  if (ch->output_use != NULL) ydrop_use(ch->output_use);
+}
+
+static void
+ychain_print(void* addr)
+{
+  ychain_t* ch = (ychain_t*)addr;
+  char buf[64];
+  size_t i;
+  y_print("SoX effects chain:", FALSE);
+  for (i = 0; ch->chain != NULL && i < ch->chain->length; ++i) {
+    y_print(" ", FALSE);
+    y_print(ch->chain->effects[i][0].handler.name, FALSE);
+  }
+  sprintf(buf, " (%u channel(s) @ %gHz)", ch->signal.channels,
+          ch->signal.rate);
+  y_print(buf, TRUE);
+}
+
+static void
+ychain_extract(void* addr, char* member)
+{
+  ychain_t* ch = (ychain_t*)addr;
+  if (strcmp(member, "channels") == 0) {
+    ypush_long(ch->signal.channels);
+  } else if (strcmp(member, "clips") == 0) {
+    ypush_long(ch->chain == NULL ? 0 : (long)sox_effects_clips(ch->chain));
+  } else if (strcmp(member, "length") == 0) {
+    ypush_long(ch->chain == NULL ? 0 : (long)ch->chain->length);
+  } else if (strcmp(member, "rate") == 0) {
+    ypush_double(ch->signal.rate);
+  } else {
+    y_error("bad member name");
+  }
+}
+
+static ychain_t*
+ychain_fetch(int iarg)
+{
+  return (ychain_t*)yget_obj(iarg, &ychain_type);
+}
+
+/* Add an effect to a chain, ARGV is NULL-terminated. */
+static void
+add_effect(ychain_t* ch, const sox_effect_handler_t* handler,
+           int argc, char* argv[], const sox_signalinfo_t* out)
+{
+  sox_effect_t* e;
+  if (handler == NULL) y_error("unknown effect");
+  e = sox_create_effect(handler);
+  if (e == NULL) y_error("failed to create effect");
+  if (handler == &input_handler || handler == &output_handler) {
+    ((chain_priv_t*)e->priv)->owner = ch;
+  }
+  if (sox_effect_options(e, argc, argv) != SOX_SUCCESS) {
+    free(e->priv);
+    free(e);
+    y_errorq("bad options for effect \"%s\"", handler->name);
+  }
+  if (sox_add_effect(ch->chain, e, &ch->signal,
+                     (out != NULL ? out : &ch->signal)) != SOX_SUCCESS) {
+    free(e);
+    y_errorq("failed to add effect \"%s\"", handler->name);
+  }
+  free(e); /* private data now owned by the chain */
+}
+
+void
+Y_sox_effects_chain(int argc)
+{
+  ychain_t* ch;
+  ysox_t* inp;
+  ysox_t* out = NULL;
+  if (argc < 1 || argc > 2) y_error("expecting one or two arguments");
+  inp = ysox_fetch(argc - 1);
+  if (inp->format == NULL || inp->format->mode != 'r') {
+    y_error("input stream not open for reading");
+  }
+  if (inp->conv != NULL) {
+    y_error("input stream must not be converted (use \"rate\" and "
+            "\"channels\" effects instead)");
+  }
+  if (argc == 2 && ! yarg_nil(0)) {
+    out = ysox_fetch(0);
+    if (out->format == NULL || out->format->mode != 'w') {
+      y_error("output stream not open for writing");
+    }
+  }
+  ch = (ychain_t*)ypush_obj(&ychain_type, sizeof(ychain_t));
+  ch->input = inp;
+  ch->input_use = yget_use(argc);
+  if (out != NULL) {
+    ch->output = out;
+    ch->output_use = yget_use(1);
+  }
+  ch->signal = inp->format->signal;
+  ch->encoding = inp->format->encoding;
+  critical();
+  ch->chain = sox_create_effects_chain(&inp->format->encoding,
+                                       (out != NULL ? &out->format->encoding :
+                                        &ch->encoding));
+  if (ch->chain == NULL) y_error("failed to create effects chain");
+  add_effect(ch, &input_handler, 0, NULL, NULL);
+}
+
+void
+Y_sox_add_effect(int argc)
+{
+  ychain_t* ch;
+  char* name;
+  char** argv;
+  char* buf;
+  int iarg, i, n;
+  if (argc < 2) y_error("expecting at least two arguments");
+  ch = ychain_fetch(argc - 1);
+  if (ch->flowed) y_error("effects chain has already been run");
+  name = ygets_q(argc - 2);
+  if (name == NULL) y_error("invalid effect name");
+
+  /* Collect options as strings, numerical values are formatted. */
+  n = argc - 2;
+  argv = ypush_scratch((n + 1)*(sizeof(char*) + 32), NULL);
+  buf = (char*)(argv + n + 1);
+  for (i = 0; i < n; ++i) {
+    iarg = argc - 2 - i; /* the scratch buffer is on top of the stack */
+    if (yarg_rank(iarg) != 0) y_error("effect options must be scalars");
+    switch (yarg_typeid(iarg)) {
+    case Y_STRING:
+      argv[i] = ygets_q(iarg);
+      if (argv[i] == NULL) y_error("invalid effect option");
+      break;
+    case Y_CHAR:
+    case Y_SHORT:
+    case Y_INT:
+    case Y_LONG:
+      argv[i] = buf + 32*i;
+      sprintf(argv[i], "%ld", ygets_l(iarg));
+      break;
+    case Y_FLOAT:
+    case Y_DOUBLE:
+      argv[i] = buf + 32*i;
+      sprintf(argv[i], "%.17g", ygets_d(iarg));
+      break;
+    default:
+      y_error("effect options must be strings or numbers");
+    }
+  }
+  argv[n] = NULL;
+  critical();
+  add_effect(ch, sox_find_effect(name), n, argv, NULL);
+  yarg_drop(1);
+}
+
+static int
+flow_callback(sox_bool all_done, void* data)
+{
+  return (p_signalling ? SOX_EOF : SOX_SUCCESS);
+}
+
+void
+Y_sox_flow_effects(int argc)
+{
+  ychain_t* ch = NULL;
+  read_opts_t rd = {Y_INT, 1.0};
+  int iarg, nargs = 0, status;
+  static long gain_index = -1L;
+  static long type_index = -1L;
+
+  /* Initialize all keyword indexes. */
+#define INIT(s) if (s##_index == -1L) s##_index = yget_global(#s, 0)
+  INIT(gain);
+  INIT(type);
+#undef INIT
+
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    long index = yarg_key(iarg);
+    if (index < 0) {
+      if (++nargs > 1) y_error("too many arguments");
+      ch = ychain_fetch(iarg);
+    } else {
+      --iarg;
+      if (index == gain_index) {
+        rd.gain = (yarg_nil(iarg) ? 1.0 : ygets_d(iarg));
+      } else if (index == type_index) {
+        if (! yarg_nil(iarg)) rd.type = get_type(iarg);
+      } else {
+        y_error("unsupported keyword");
+      }
+    }
+  }
+  if (ch == NULL) y_error("missing effects chain");
+  if (ch->flowed) y_error("effects chain has already been run");
+  check_read_opts(&rd);
+  if (ch->input->format == NULL) y_error("input stream has been closed");
+  if (ch->output != NULL && ch->output->format == NULL) {
+    y_error("output stream has been closed");
+  }
+
+  /* Insert conversion effects if needed and terminate the chain. */
+  if (ch->output != NULL) {
+    const sox_signalinfo_t* out = &ch->output->format->signal;
+    if (ch->signal.rate != out->rate) {
+      add_effect(ch, sox_find_effect("rate"), 0, NULL, out);
+    }
+    if (ch->signal.channels != out->channels) {
+      add_effect(ch, sox_find_effect("channels"), 0, NULL, out);
+    }
+    add_effect(ch, &output_handler, 0, NULL, out);
+  } else {
+    add_effect(ch, &output_handler, 0, NULL, NULL);
+  }
+
+  /* Run the chain (after the queued blocks of an asynchronous output stream
+     have been written). */
+  if (ch->output != NULL && ch->output->wr != NULL
+      && drain_writer(ch->output, FALSE) > 0) {
+    y_error("deferred write error on output stream");
+  }
+  sync_cache(ch->input);
+  ch->flowed = TRUE;
+  status = sox_flow_effects(ch->chain, flow_callback, NULL);
+  if (ch->input->cache != NULL) ch->input->cache->pos = ch->input->offset;
+  critical();
+  if (ch->failure == CHAIN_WRITE_FAIL) {
+    y_errorq("write error on output stream (%s)",
+             ch->output->format->sox_errstr);
+  }
+  if (ch->failure == CHAIN_NO_MEMORY) {
+    free(ch->data);
+    ch->data = NULL;
+    ch->size = ch->len = 0;
+    y_error("insufficient memory");
+  }
+  if (status != SOX_SUCCESS && status != SOX_EOF) {
+    y_error("failed to run effects chain");
+  }
+  if (ch->output != NULL) {
+    ypush_long(ch->output->offset);
+  } else {
+    long channels = ch->signal.channels;
+    long samples = ch->len/channels;
+    if (samples <= 0) {
+      ypush_nil();
+    } else {
+      void* arr = push_samples(rd.type, channels, samples);
+      samples_to_values(arr, ch->data, channels*samples, rd.type, rd.gain);
+    }
+    free(ch->data);
+    ch->data = NULL;
+    ch->size = ch->len = 0;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* I/O COUNTERS */
+
+/* Every sound stream accumulates counters of its transfers, the same
+   counters are summed over all streams (including those of the worker
+   threads of sox_load_many and sox_convert_many) in a global aggregate.
+   Times are measured with the monotonic clock and are stored in
+   nanoseconds.  The number of clipped samples is kept by libSoX in the
+   stream, the counter of a stream holds the number of clips at the last
+   reset. */
+
+static int64_t io_totals[IO_COUNTERS];
+
+static int64_t
+clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void
+count_io(ysox_t* obj, int k, int64_t n)
+{
+  obj->io[k] += n;
+  __atomic_fetch_add(&io_totals[k], n, __ATOMIC_RELAXED);
+}
+
+static int64_t
+start_io_call(ysox_t* obj, int k)
+{
+  count_io(obj, k, 1);
+  return clock_ns() - obj->io[IO_CODEC_TIME];
+}
+
+static void
+end_io_call(ysox_t* obj, int64_t mark)
+{
+  count_io(obj, IO_CONVERT_TIME,
+           clock_ns() - obj->io[IO_CODEC_TIME] - mark);
+}
+
+static void
+count_clips(int64_t n)
+{
+  __atomic_fetch_add(&io_totals[IO_CLIPS], n, __ATOMIC_RELAXED);
+}
+
+static void
+account_clips(ysox_t* obj)
+{
+  count_clips(obj->format->clips - obj->io[IO_CLIPS]);
+  obj->io[IO_CLIPS] = obj->format->clips;
+}
+
+static void
+push_io_stats(const int64_t* io, int64_t clips)
+{
+  long dims[2];
+  double* arr;
+  int k;
+  dims[0] = 1;
+  dims[1] = IO_COUNTERS;
+  arr = ypush_d(dims);
+  for (k = 0; k < IO_COUNTERS; ++k) {
+    arr[k] = (double)__atomic_load_n(&io[k], __ATOMIC_RELAXED);
+  }
+  arr[IO_CONVERT_TIME] *= 1e-9;
+  arr[IO_CODEC_TIME] *= 1e-9;
+  arr[IO_CLIPS] = (double)clips;
+}
+
+void
+Y_sox_io_stats(int argc)
+{
+  if (argc != 1 || ! yarg_nil(0)) {
+    y_error("expecting no arguments");
   }
-  if (SOX_SAMPLE_PRECISION != 32 || sizeof(sox_sample_t) != 4) {
-    y_error("expecting 32-bit integers for SoX audio samples");
+  push_io_stats(io_totals, __atomic_load_n(&io_totals[IO_CLIPS],
+                                           __ATOMIC_RELAXED));
+}
+
+void
+Y_sox_reset_io_stats(int argc)
+{
+  int k;
+  if (argc != 1) {
+    y_error("expecting exactly one argument");
   }
-  if (! integer || nbits != SOX_SAMPLE_PRECISION) {
-    /* Convert to SoX audio samples (signed 32-bit integers).  According to
-     * libSoX documentation:
-     *
-     *  - Conversions should be as accurate as possible (with rounding).
-     *
-     *  - Unsigned integers are converted to and from signed integers by
-     *    flipping the upper-most bit then treating them as signed integers.
-     */
-    sox_sample_t* tmp = push_samples(channels, samples);
-    long i, clips = 0;
-    if (integer) {
-      /* FIXME: not really rounding to nearest value? */
-      if (nbits == 8) {
-        /* We assume unsigned bytes. */
-        const uint8_t* inp = buf;
-        for (i = 0; i < ntot; ++i) {
-          tmp[i] = SOX_UNSIGNED_TO_SAMPLE(8, inp[i]);
-        }
-      } else if (nbits == 16) {
-        const int16_t* inp = buf;
-        for (i = 0; i < ntot; ++i) {
-          tmp[i] = SOX_UNSIGNED_TO_SAMPLE(16, inp[i]);
-        }
-      } else if (nbits == 64) {
-        const int64_t* inp = buf;
-        for (i = 0; i < ntot; ++i) {
-          tmp[i] = (sox_sample_t)(inp[i] >> 32);
-        }
-      } else {
-        y_error("unsupported integer type for conversion to SoX audio samples");
-      }
-    } else {
-      /* For floating-point values, we convert input samples from range [-1,1)
-       * to range [MIN,MAX] using rounding to nearest integer.  Here, for
-       * short, we denote MIN=SOX_SAMPLE_MIN and MAX=SOX_SAMPLE_MAX are
-       * integers.
-       *
-       * Hence:  sample = floor(MULT*value + BIAS)
-       * with:   MULT = 1 + MAX
-       * and:    BIAS = 0.5
-       *
-       * Note that MIN = -1 - MAX = -MULT.
-       *
-       * Clipping at the lower bound occurs when:
-       *       floor(MULT*value + BIAS) < MIN
-       *  <=>  MULT*value + BIAS < MIN = -MULT
-       *  <=>  value < cmin = (MIN - BIAS)/MULT
-       *                    = -1 - BIAS/MULT
-       *
-       * Clipping at the upper bound occurs when:
-       *       floor(MULT*value + BIAS) > MAX
-       *  <=>  MULT*value + BIAS >= MAX + 1 = MULT
-       *  <=>  value >= cmax = (MAX + 1 - BIAS)/MULT
-       *                     = 1 - BIAS/MULT
-       */
-      const double mult =  1.0 + (double)SOX_SAMPLE_MAX;
-      const double bias =  0.5;
-      const double cmin = -1.0 - bias/mult;
-      const double cmax =  1.0 - bias/mult;
-      if (type == Y_FLOAT) {
-        const float* inp = buf;
-        for (i = 0; i < ntot; ++i) {
-          double value = inp[i];
-          if (value < cmin) {
-            ++clips;
-            tmp[i] = SOX_SAMPLE_MIN;
-          } else if (value >= cmax) {
-            ++clips;
-            tmp[i] = SOX_SAMPLE_MAX;
-          } else {
-            tmp[i] = (sox_sample_t)floor(mult*value + bias);
-          }
-        }
-      } else {
-        const double* inp = buf;
-        for (i = 0; i < ntot; ++i) {
-          double value = inp[i];
-          if (value < cmin) {
-            ++clips;
-            tmp[i] = SOX_SAMPLE_MIN;
-          } else if (value >= cmax) {
-            ++clips;
-            tmp[i] = SOX_SAMPLE_MAX;
-          } else {
-            tmp[i] = (sox_sample_t)floor(mult*value + bias);
-          }
-        }
-      }
+  if (yarg_nil(0)) {
+    for (k = 0; k < IO_COUNTERS; ++k) {
+      __atomic_store_n(&io_totals[k], 0, __ATOMIC_RELAXED);
     }
-
-    /* Update the number of clippings and replace stack items. */
-    obj->format->clips += clips;
-    yarg_swap(iarg + 1, 0);
-    yarg_drop(1);
-    buf = tmp;
+  } else {
+    ysox_t* obj = ysox_fetch(0);
+    if (obj->format == NULL) {
+      y_error("sound stream has been closed");
+    }
+    for (k = 0; k < IO_COUNTERS; ++k) {
+      obj->io[k] = 0;
+    }
+    obj->io[IO_CLIPS] = obj->format->clips;
   }
-
-  critical();
-  n = sox_write(obj->format, buf, ntot);
-  obj->offset += (n > 0 ? n/channels : 0);
-  if (n != ntot) y_errorn("write error (%ld samples written)", n);
+  ypush_nil();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -1088,6 +7028,742 @@ Y_sox_copy_comments(int argc)
   }
 }
 
+/*---------------------------------------------------------------------------*/
+/* CONVERSION KERNELS */
+
+/* The (de)interleaving is done by blocks of a few frames (see LAYOUT_BLOCK)
+   so that the interleaved side stays in the cache while each channel is
+   written (or read) contiguously. */
+#define LAYOUT_KERNELS(T)                                               \
+  static void                                                           \
+  interleaved_to_planar_##T(T* dst, long stride, const T* src,         \
+                            long n, long channels)                      \
+  {                                                                     \
+    long c, j;                                                          \
+    for (c = 0; c < channels; ++c, dst += stride) {                     \
+      for (j = 0; j < n; ++j) {                                         \
+        dst[j] = src[j*channels + c];                                   \
+      }                                                                 \
+    }                                                                   \
+  }                                                                     \
+                                                                        \
+  static void                                                           \
+  planar_to_interleaved_##T(T* dst, const T* src, long stride,         \
+                            long n, long channels)                      \
+  {                                                                     \
+    long c, j;                                                          \
+    for (c = 0; c < channels; ++c, src += stride) {                     \
+      for (j = 0; j < n; ++j) {                                         \
+        dst[j*channels + c] = src[j];                                   \
+      }                                                                 \
+    }                                                                   \
+  }
+LAYOUT_KERNELS(uint8_t)
+LAYOUT_KERNELS(uint16_t)
+LAYOUT_KERNELS(uint32_t)
+LAYOUT_KERNELS(uint64_t)
+#undef LAYOUT_KERNELS
+
+static void
+interleaved_to_planar(void* dst, long stride, long index, const void* src,
+                      long n, long channels, size_t elsize)
+{
+  switch (elsize) {
+#define CASE(T)                                                         \
+  case sizeof(T):                                                       \
+    interleaved_to_planar_##T((T*)dst + index, stride, src,           \
+                              n, channels);                             \
+    break
+    CASE(uint8_t);
+    CASE(uint16_t);
+    CASE(uint32_t);
+    CASE(uint64_t);
+#undef CASE
+  }
+}
+
+static void
+planar_to_interleaved(void* dst, const void* src, long stride, long index,
+                      long n, long channels, size_t elsize)
+{
+  switch (elsize) {
+#define CASE(T)                                                         \
+  case sizeof(T):                                                       \
+    planar_to_interleaved_##T(dst, (const T*)src + index, stride,     \
+                              n, channels);                             \
+    break
+    CASE(uint8_t);
+    CASE(uint16_t);
+    CASE(uint32_t);
+    CASE(uint64_t);
+#undef CASE
+  }
+}
+
+static void
+generic_samples_to_float(float* dst, const sox_sample_t* src,
+                         long n, float scale)
+{
+  long i;
+  for (i = 0; i < n; ++i) {
+    dst[i] = scale*(float)src[i];
+  }
+}
+
+static void
+generic_samples_to_double(double* dst, const sox_sample_t* src,
+                          long n, double scale)
+{
+  long i;
+  for (i = 0; i < n; ++i) {
+    dst[i] = scale*(double)src[i];
+  }
+}
+
+static long
+generic_samples_to_short(int16_t* dst, const sox_sample_t* src, long n)
+{
+  long i, clips = 0;
+  SOX_SAMPLE_LOCALS;
+  for (i = 0; i < n; ++i) {
+    dst[i] = SOX_SAMPLE_TO_SIGNED_16BIT(src[i], clips);
+  }
+  return clips;
+}
+
+static long
+generic_samples_to_uchar(uint8_t* dst, const sox_sample_t* src, long n)
+{
+  long i, clips = 0;
+  SOX_SAMPLE_LOCALS;
+  for (i = 0; i < n; ++i) {
+    dst[i] = SOX_SAMPLE_TO_UNSIGNED_8BIT(src[i], clips);
+  }
+  return clips;
+}
+
+static void
+generic_uchar_to_samples(sox_sample_t* dst, const uint8_t* src, long n)
+{
+  long i;
+  for (i = 0; i < n; ++i) {
+    dst[i] = SOX_UNSIGNED_TO_SAMPLE(8, src[i]);
+  }
+}
+
+static void
+generic_short_to_samples(sox_sample_t* dst, const int16_t* src, long n)
+{
+  long i;
+  for (i = 0; i < n; ++i) {
+    dst[i] = SOX_SIGNED_TO_SAMPLE(16, src[i]);
+  }
+}
+
+static void
+generic_int64_to_samples(sox_sample_t* dst, const int64_t* src, long n)
+{
+  long i;
+  for (i = 0; i < n; ++i) {
+    dst[i] = (sox_sample_t)(src[i] >> 32);
+  }
+}
+
+/*
+ * For floating-point values, we convert input samples from range [-1,1) to
+ * range [MIN,MAX] using rounding to nearest integer.  Here, for short, we
+ * denote MIN=SOX_SAMPLE_MIN and MAX=SOX_SAMPLE_MAX are integers.
+ *
+ * Hence:  sample = floor(MULT*value + BIAS)
+ * with:   MULT = 1 + MAX
+ * and:    BIAS = 0.5
+ *
+ * Note that MIN = -1 - MAX = -MULT.
+ *
+ * Clipping at the lower bound occurs when:
+ *       floor(MULT*value + BIAS) < MIN
+ *  <=>  MULT*value + BIAS < MIN = -MULT
+ *  <=>  value < CMIN = (MIN - BIAS)/MULT
+ *                    = -1 - BIAS/MULT
+ *
+ * Clipping at the upper bound occurs when:
+ *       floor(MULT*value + BIAS) > MAX
+ *  <=>  MULT*value + BIAS >= MAX + 1 = MULT
+ *  <=>  value >= CMAX = (MAX + 1 - BIAS)/MULT
+ *                     = 1 - BIAS/MULT
+ *
+ * The SIMD versions compute exactly the same expressions (in double
+ * precision and without fused multiply-add) so that they yield the same
+ * results as the generic versions.
+ */
+#define FLOAT_MULT  SAMPLE_SCALE
+#define FLOAT_BIAS  0.5
+#define FLOAT_CMIN  (-1.0 - FLOAT_BIAS/FLOAT_MULT)
+#define FLOAT_CMAX  ( 1.0 - FLOAT_BIAS/FLOAT_MULT)
+
+#define FLOAT_TO_SAMPLES(T)                                     \
+  static long                                                   \
+  generic_##T##_to_samples(sox_sample_t* dst, const T* src,     \
+                           long n)                              \
+  {                                                             \
+    const double mult = FLOAT_MULT;                             \
+    const double bias = FLOAT_BIAS;                             \
+    const double cmin = FLOAT_CMIN;                             \
+    const double cmax = FLOAT_CMAX;                             \
+    long i, clips = 0;                                          \
+    for (i = 0; i < n; ++i) {                                   \
+      double value = src[i];                                    \
+      if (value < cmin) {                                       \
+        ++clips;                                                \
+        dst[i] = SOX_SAMPLE_MIN;                                \
+      } else if (value >= cmax) {                               \
+        ++clips;                                                \
+        dst[i] = SOX_SAMPLE_MAX;                                \
+      } else {                                                  \
+        dst[i] = (sox_sample_t)floor(mult*value + bias);        \
+      }                                                         \
+    }                                                           \
+    return clips;                                               \
+  }
+FLOAT_TO_SAMPLES(float)
+FLOAT_TO_SAMPLES(double)
+#undef FLOAT_TO_SAMPLES
+
+/* A zero crossing is a change of sign between two consecutive samples of a
+   channel, zero counting as positive.  The SIMD versions process frames
+   such that each lane always holds the same channel which requires that
+   the number of lanes be a multiple of the number of channels. */
+static void
+generic_channel_stats(channel_stats_t* st, const sox_sample_t* src,
+                      long n, long channels)
+{
+  long i, c = 0;
+  for (i = 0; i < n; ++i) {
+    channel_stats_t* s = st + c;
+    sox_sample_t x = src[i];
+    if (x < s->min) s->min = x;
+    if (x > s->max) s->max = x;
+    s->sum += (double)x;
+    s->sumsq += (double)x*(double)x;
+    if (x == SOX_SAMPLE_MIN || x == SOX_SAMPLE_MAX) ++s->clips;
+    if (s->count > 0 && (x < 0) != (s->last < 0)) ++s->crossings;
+    s->last = x;
+    ++s->count;
+    if (++c == channels) c = 0;
+  }
+}
+
+/* Merge the per-lane statistics of the frames [CHANNELS,I) of a SIMD
+   kernel (the first frame having been processed by the generic kernel). */
+static void
+merge_lane_stats(channel_stats_t* st, const sox_sample_t* src, long i,
+                 long channels, long lanes, const sox_sample_t* lmin,
+                 const sox_sample_t* lmax, const int32_t* lzc,
+                 const int32_t* lclips, const double* lsum,
+                 const double* lsumsq)
+{
+  long k, c;
+  for (k = 0; k < lanes; ++k) {
+    channel_stats_t* s = st + k%channels;
+    if (lmin[k] < s->min) s->min = lmin[k];
+    if (lmax[k] > s->max) s->max = lmax[k];
+    s->sum += lsum[k];
+    s->sumsq += lsumsq[k];
+    s->crossings += lzc[k];
+    s->clips += lclips[k];
+  }
+  for (c = 0; c < channels; ++c) {
+    st[c].last = src[i - channels + c];
+    st[c].count += (i - channels)/channels;
+  }
+}
+
+#ifdef YSOX_X86_SIMD
+
+/* In the following SIMD kernels, a block of input values is always loaded
+   before the corresponding output values are stored, this is needed for
+   in-place conversion. */
+
+TARGET("sse2") static void
+sse2_samples_to_float(float* dst, const sox_sample_t* src,
+                      long n, float scale)
+{
+  const __m128 s = _mm_set1_ps(scale);
+  long i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(x), s));
+  }
+  generic_samples_to_float(dst + i, src + i, n - i, scale);
+}
+
+TARGET("sse2") static void
+sse2_samples_to_double(double* dst, const sox_sample_t* src,
+                       long n, double scale)
+{
+  const __m128d s = _mm_set1_pd(scale);
+  long i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128d lo = _mm_cvtepi32_pd(x);
+    __m128d hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(x, 0xEE));
+    _mm_storeu_pd(dst + i,     _mm_mul_pd(lo, s));
+    _mm_storeu_pd(dst + i + 2, _mm_mul_pd(hi, s));
+  }
+  generic_samples_to_double(dst + i, src + i, n - i, scale);
+}
+
+/* Narrow 4 SoX samples to BITS bits (16 or 8) with rounding to nearest,
+   the result is sign extended to 32 bits, the number of clipped samples is
+   added to CLIPS.  Only the positive side may overflow when the rounding
+   bias is added. */
+TARGET("sse2") static __inline__ __m128i
+sse2_narrow_samples(__m128i x, int bits, long* clips)
+{
+  const __m128i h = _mm_set1_epi32(1 << (31 - bits));
+  const __m128i t = _mm_set1_epi32(SOX_SAMPLE_MAX - (1 << (31 - bits)));
+  const __m128i c = _mm_set1_epi32(SOX_INT_MAX(bits));
+  __m128i m = _mm_cmpgt_epi32(x, t);
+  x = _mm_srai_epi32(_mm_add_epi32(x, h), 32 - bits);
+  *clips += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(m)));
+  return _mm_or_si128(_mm_andnot_si128(m, x), _mm_and_si128(m, c));
+}
+
+TARGET("sse2") static long
+sse2_samples_to_short(int16_t* dst, const sox_sample_t* src, long n)
+{
+  long i, clips = 0;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m128i x0 = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(src + i + 4));
+    x0 = sse2_narrow_samples(x0, 16, &clips);
+    x1 = sse2_narrow_samples(x1, 16, &clips);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(x0, x1));
+  }
+  return clips + generic_samples_to_short(dst + i, src + i, n - i);
+}
+
+TARGET("sse2") static long
+sse2_samples_to_uchar(uint8_t* dst, const sox_sample_t* src, long n)
+{
+  const __m128i m = _mm_set1_epi8((char)0x80);
+  long i, clips = 0;
+  for (i = 0; i + 16 <= n; i += 16) {
+    __m128i x0 = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(src + i + 4));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(src + i + 8));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(src + i + 12));
+    x0 = sse2_narrow_samples(x0, 8, &clips);
+    x1 = sse2_narrow_samples(x1, 8, &clips);
+    x2 = sse2_narrow_samples(x2, 8, &clips);
+    x3 = sse2_narrow_samples(x3, 8, &clips);
+    x0 = _mm_packs_epi16(_mm_packs_epi32(x0, x1), _mm_packs_epi32(x2, x3));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(x0, m));
+  }
+  return clips + generic_samples_to_uchar(dst + i, src + i, n - i);
+}
+
+TARGET("sse2") static void
+sse2_uchar_to_samples(sox_sample_t* dst, const uint8_t* src, long n)
+{
+  const __m128i z = _mm_setzero_si128();
+  const __m128i m = _mm_set1_epi32(0x80);
+  long i;
+  for (i = 0; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i lo = _mm_unpacklo_epi8(x, z);
+    __m128i hi = _mm_unpackhi_epi8(x, z);
+    __m128i x0 = _mm_unpacklo_epi16(lo, z);
+    __m128i x1 = _mm_unpackhi_epi16(lo, z);
+    __m128i x2 = _mm_unpacklo_epi16(hi, z);
+    __m128i x3 = _mm_unpackhi_epi16(hi, z);
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     _mm_slli_epi32(_mm_xor_si128(x0, m), 24));
+    _mm_storeu_si128((__m128i*)(dst + i + 4),
+                     _mm_slli_epi32(_mm_xor_si128(x1, m), 24));
+    _mm_storeu_si128((__m128i*)(dst + i + 8),
+                     _mm_slli_epi32(_mm_xor_si128(x2, m), 24));
+    _mm_storeu_si128((__m128i*)(dst + i + 12),
+                     _mm_slli_epi32(_mm_xor_si128(x3, m), 24));
+  }
+  generic_uchar_to_samples(dst + i, src + i, n - i);
+}
+
+TARGET("sse2") static void
+sse2_short_to_samples(sox_sample_t* dst, const int16_t* src, long n)
+{
+  const __m128i z = _mm_setzero_si128();
+  long i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    /* Interleaving with zeros puts each value in the upper half. */
+    __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(z, x));
+    _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(z, x));
+  }
+  generic_short_to_samples(dst + i, src + i, n - i);
+}
+
+TARGET("sse2") static void
+sse2_int64_to_samples(sox_sample_t* dst, const int64_t* src, long n)
+{
+  long i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    /* Keep the most significant halves of the 64-bit integers. */
+    __m128i x0 = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(src + i + 2));
+    x0 = _mm_shuffle_epi32(x0, _MM_SHUFFLE(3,1,3,1));
+    x1 = _mm_shuffle_epi32(x1, _MM_SHUFFLE(3,1,3,1));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi64(x0, x1));
+  }
+  generic_int64_to_samples(dst + i, src + i, n - i);
+}
+
+/* Convert 2 double precision values to SoX samples stored in the lower half
+   of the result, the number of clipped values is added to CLIPS.  The
+   floor() function is emulated by truncation and correction as SSE2 has no
+   rounding instructions. */
+TARGET("sse2") static __inline__ __m128i
+sse2_pd_to_samples(__m128d v, long* clips)
+{
+  const __m128d mult = _mm_set1_pd(FLOAT_MULT);
+  const __m128d bias = _mm_set1_pd(FLOAT_BIAS);
+  const __m128d cmin = _mm_set1_pd(FLOAT_CMIN);
+  const __m128d cmax = _mm_set1_pd(FLOAT_CMAX);
+  const __m128d smin = _mm_set1_pd((double)SOX_SAMPLE_MIN);
+  const __m128d smax = _mm_set1_pd((double)SOX_SAMPLE_MAX);
+  __m128d lt = _mm_cmplt_pd(v, cmin);
+  __m128d ge = _mm_cmpge_pd(v, cmax);
+  __m128d x = _mm_add_pd(_mm_mul_pd(v, mult), bias);
+  __m128d t;
+  __m128i r, c;
+  x = _mm_or_pd(_mm_andnot_pd(_mm_or_pd(lt, ge), x),
+                _mm_or_pd(_mm_and_pd(lt, smin), _mm_and_pd(ge, smax)));
+  r = _mm_cvttpd_epi32(x);
+  t = _mm_cvtepi32_pd(r);
+  c = _mm_shuffle_epi32(_mm_castpd_si128(_mm_cmpgt_pd(t, x)),
+                        _MM_SHUFFLE(3,3,2,0));
+  *clips += __builtin_popcount(_mm_movemask_pd(_mm_or_pd(lt, ge)));
+  return _mm_add_epi32(r, c);
+}
+
+TARGET("sse2") static long
+sse2_float_to_samples(sox_sample_t* dst, const float* src, long n)
+{
+  long i, clips = 0;
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128 v = _mm_loadu_ps(src + i);
+    __m128i r0 = sse2_pd_to_samples(_mm_cvtps_pd(v), &clips);
+    __m128i r1 = sse2_pd_to_samples(_mm_cvtps_pd(_mm_movehl_ps(v, v)),
+                                    &clips);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi64(r0, r1));
+  }
+  return clips + generic_float_to_samples(dst + i, src + i, n - i);
+}
+
+TARGET("sse2") static long
+sse2_double_to_samples(sox_sample_t* dst, const double* src, long n)
+{
+  long i, clips = 0;
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i r0 = sse2_pd_to_samples(_mm_loadu_pd(src + i), &clips);
+    __m128i r1 = sse2_pd_to_samples(_mm_loadu_pd(src + i + 2), &clips);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi64(r0, r1));
+  }
+  return clips + generic_double_to_samples(dst + i, src + i, n - i);
+}
+
+TARGET("sse2") static void
+sse2_channel_stats(channel_stats_t* st, const sox_sample_t* src,
+                   long n, long channels)
+{
+  const __m128i smin = _mm_set1_epi32(SOX_SAMPLE_MIN);
+  const __m128i smax = _mm_set1_epi32(SOX_SAMPLE_MAX);
+  __m128i vmin = smax, vmax = smin;
+  __m128i vzc = _mm_setzero_si128(), vclips = _mm_setzero_si128();
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  __m128d q0 = _mm_setzero_pd(), q1 = _mm_setzero_pd();
+  sox_sample_t lmin[4], lmax[4];
+  int32_t lzc[4], lclips[4];
+  double lsum[4], lsumsq[4];
+  long i;
+  if (4%channels != 0 || n < channels + 4) {
+    generic_channel_stats(st, src, n, channels);
+    return;
+  }
+  generic_channel_stats(st, src, channels, channels);
+  for (i = channels; i + 4 <= n; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i p = _mm_loadu_si128((const __m128i*)(src + i - channels));
+    __m128i gt = _mm_cmpgt_epi32(x, vmax);
+    __m128i lt = _mm_cmplt_epi32(x, vmin);
+    __m128d lo = _mm_cvtepi32_pd(x);
+    __m128d hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(x, 0xEE));
+    vmax = _mm_or_si128(_mm_and_si128(gt, x), _mm_andnot_si128(gt, vmax));
+    vmin = _mm_or_si128(_mm_and_si128(lt, x), _mm_andnot_si128(lt, vmin));
+    vzc = _mm_sub_epi32(vzc, _mm_xor_si128(_mm_srai_epi32(x, 31),
+                                           _mm_srai_epi32(p, 31)));
+    vclips = _mm_sub_epi32(vclips, _mm_or_si128(_mm_cmpeq_epi32(x, smin),
+                                                _mm_cmpeq_epi32(x, smax)));
+    s0 = _mm_add_pd(s0, lo);
+    s1 = _mm_add_pd(s1, hi);
+    q0 = _mm_add_pd(q0, _mm_mul_pd(lo, lo));
+    q1 = _mm_add_pd(q1, _mm_mul_pd(hi, hi));
+  }
+  _mm_storeu_si128((__m128i*)lmin, vmin);
+  _mm_storeu_si128((__m128i*)lmax, vmax);
+  _mm_storeu_si128((__m128i*)lzc, vzc);
+  _mm_storeu_si128((__m128i*)lclips, vclips);
+  _mm_storeu_pd(lsum, s0);
+  _mm_storeu_pd(lsum + 2, s1);
+  _mm_storeu_pd(lsumsq, q0);
+  _mm_storeu_pd(lsumsq + 2, q1);
+  merge_lane_stats(st, src, i, channels, 4, lmin, lmax, lzc, lclips,
+                   lsum, lsumsq);
+  generic_channel_stats(st, src + i, n - i, channels);
+}
+
+TARGET("avx2") static void
+avx2_samples_to_float(float* dst, const sox_sample_t* src,
+                      long n, float scale)
+{
+  const __m256 s = _mm256_set1_ps(scale);
+  long i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), s));
+  }
+  generic_samples_to_float(dst + i, src + i, n - i, scale);
+}
+
+TARGET("avx2") static void
+avx2_samples_to_double(double* dst, const sox_sample_t* src,
+                       long n, double scale)
+{
+  const __m256d s = _mm256_set1_pd(scale);
+  long i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m128i x0 = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(src + i + 4));
+    _mm256_storeu_pd(dst + i,     _mm256_mul_pd(_mm256_cvtepi32_pd(x0), s));
+    _mm256_storeu_pd(dst + i + 4, _mm256_mul_pd(_mm256_cvtepi32_pd(x1), s));
+  }
+  generic_samples_to_double(dst + i, src + i, n - i, scale);
+}
+
+TARGET("avx2") static __inline__ __m256i
+avx2_narrow_samples(__m256i x, int bits, long* clips)
+{
+  const __m256i h = _mm256_set1_epi32(1 << (31 - bits));
+  const __m256i t = _mm256_set1_epi32(SOX_SAMPLE_MAX - (1 << (31 - bits)));
+  const __m256i c = _mm256_set1_epi32(SOX_INT_MAX(bits));
+  __m256i m = _mm256_cmpgt_epi32(x, t);
+  x = _mm256_srai_epi32(_mm256_add_epi32(x, h), 32 - bits);
+  *clips += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(m)));
+  return _mm256_blendv_epi8(x, c, m);
+}
+
+TARGET("avx2") static long
+avx2_samples_to_short(int16_t* dst, const sox_sample_t* src, long n)
+{
+  long i, clips = 0;
+  for (i = 0; i + 16 <= n; i += 16) {
+    /* Packing works within 128-bit lanes, the 64-bit groups are then put
+       back in order. */
+    __m256i x0 = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i x1 = _mm256_loadu_si256((const __m256i*)(src + i + 8));
+    x0 = avx2_narrow_samples(x0, 16, &clips);
+    x1 = avx2_narrow_samples(x1, 16, &clips);
+    x0 = _mm256_permute4x64_epi64(_mm256_packs_epi32(x0, x1), 0xD8);
+    _mm256_storeu_si256((__m256i*)(dst + i), x0);
+  }
+  return clips + generic_samples_to_short(dst + i, src + i, n - i);
+}
+
+TARGET("avx2") static long
+avx2_samples_to_uchar(uint8_t* dst, const sox_sample_t* src, long n)
+{
+  const __m256i m = _mm256_set1_epi8((char)0x80);
+  const __m256i idx = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  long i, clips = 0;
+  for (i = 0; i + 32 <= n; i += 32) {
+    /* Same as above but for 32-bit groups. */
+    __m256i x0 = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i x1 = _mm256_loadu_si256((const __m256i*)(src + i + 8));
+    __m256i x2 = _mm256_loadu_si256((const __m256i*)(src + i + 16));
+    __m256i x3 = _mm256_loadu_si256((const __m256i*)(src + i + 24));
+    x0 = avx2_narrow_samples(x0, 8, &clips);
+    x1 = avx2_narrow_samples(x1, 8, &clips);
+    x2 = avx2_narrow_samples(x2, 8, &clips);
+    x3 = avx2_narrow_samples(x3, 8, &clips);
+    x0 = _mm256_packs_epi16(_mm256_packs_epi32(x0, x1),
+                            _mm256_packs_epi32(x2, x3));
+    x0 = _mm256_permutevar8x32_epi32(x0, idx);
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(x0, m));
+  }
+  return clips + generic_samples_to_uchar(dst + i, src + i, n - i);
+}
+
+TARGET("avx2") static void
+avx2_uchar_to_samples(sox_sample_t* dst, const uint8_t* src, long n)
+{
+  const __m256i m = _mm256_set1_epi32(0x80);
+  long i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i x = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i)));
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        _mm256_slli_epi32(_mm256_xor_si256(x, m), 24));
+  }
+  generic_uchar_to_samples(dst + i, src + i, n - i);
+}
+
+TARGET("avx2") static void
+avx2_short_to_samples(sox_sample_t* dst, const int16_t* src, long n)
+{
+  long i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_slli_epi32(x, 16));
+  }
+  generic_short_to_samples(dst + i, src + i, n - i);
+}
+
+TARGET("avx2") static void
+avx2_int64_to_samples(sox_sample_t* dst, const int64_t* src, long n)
+{
+  const __m256i idx = _mm256_setr_epi32(1, 3, 5, 7, 1, 3, 5, 7);
+  long i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+    x = _mm256_permutevar8x32_epi32(x, idx);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm256_castsi256_si128(x));
+  }
+  generic_int64_to_samples(dst + i, src + i, n - i);
+}
+
+/* Convert 4 double precision values to SoX samples, the number of clipped
+   values is added to CLIPS. */
+TARGET("avx2") static __inline__ __m128i
+avx2_pd_to_samples(__m256d v, long* clips)
+{
+  const __m256d mult = _mm256_set1_pd(FLOAT_MULT);
+  const __m256d bias = _mm256_set1_pd(FLOAT_BIAS);
+  const __m256d cmin = _mm256_set1_pd(FLOAT_CMIN);
+  const __m256d cmax = _mm256_set1_pd(FLOAT_CMAX);
+  const __m256d smin = _mm256_set1_pd((double)SOX_SAMPLE_MIN);
+  const __m256d smax = _mm256_set1_pd((double)SOX_SAMPLE_MAX);
+  __m256d lt = _mm256_cmp_pd(v, cmin, _CMP_LT_OQ);
+  __m256d ge = _mm256_cmp_pd(v, cmax, _CMP_GE_OQ);
+  __m256d x = _mm256_floor_pd(_mm256_add_pd(_mm256_mul_pd(v, mult), bias));
+  x = _mm256_blendv_pd(x, smin, lt);
+  x = _mm256_blendv_pd(x, smax, ge);
+  *clips += __builtin_popcount(_mm256_movemask_pd(_mm256_or_pd(lt, ge)));
+  return _mm256_cvttpd_epi32(x);
+}
+
+TARGET("avx2") static long
+avx2_float_to_samples(sox_sample_t* dst, const float* src, long n)
+{
+  long i, clips = 0;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_loadu_ps(src + i);
+    __m128i r0 = avx2_pd_to_samples(_mm256_cvtps_pd(_mm256_castps256_ps128(v)),
+                                    &clips);
+    __m128i r1 = avx2_pd_to_samples(_mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)),
+                                    &clips);
+    _mm_storeu_si128((__m128i*)(dst + i), r0);
+    _mm_storeu_si128((__m128i*)(dst + i + 4), r1);
+  }
+  return clips + generic_float_to_samples(dst + i, src + i, n - i);
+}
+
+TARGET("avx2") static long
+avx2_double_to_samples(sox_sample_t* dst, const double* src, long n)
+{
+  long i, clips = 0;
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i r = avx2_pd_to_samples(_mm256_loadu_pd(src + i), &clips);
+    _mm_storeu_si128((__m128i*)(dst + i), r);
+  }
+  return clips + generic_double_to_samples(dst + i, src + i, n - i);
+}
+
+TARGET("avx2") static void
+avx2_channel_stats(channel_stats_t* st, const sox_sample_t* src,
+                   long n, long channels)
+{
+  const __m256i smin = _mm256_set1_epi32(SOX_SAMPLE_MIN);
+  const __m256i smax = _mm256_set1_epi32(SOX_SAMPLE_MAX);
+  __m256i vmin = smax, vmax = smin;
+  __m256i vzc = _mm256_setzero_si256(), vclips = _mm256_setzero_si256();
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  __m256d q0 = _mm256_setzero_pd(), q1 = _mm256_setzero_pd();
+  sox_sample_t lmin[8], lmax[8];
+  int32_t lzc[8], lclips[8];
+  double lsum[8], lsumsq[8];
+  long i;
+  if (8%channels != 0 || n < channels + 8) {
+    generic_channel_stats(st, src, n, channels);
+    return;
+  }
+  generic_channel_stats(st, src, channels, channels);
+  for (i = channels; i + 8 <= n; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i p = _mm256_loadu_si256((const __m256i*)(src + i - channels));
+    __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(x));
+    __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(x, 1));
+    vmin = _mm256_min_epi32(vmin, x);
+    vmax = _mm256_max_epi32(vmax, x);
+    vzc = _mm256_sub_epi32(vzc, _mm256_xor_si256(_mm256_srai_epi32(x, 31),
+                                                 _mm256_srai_epi32(p, 31)));
+    vclips = _mm256_sub_epi32(vclips,
+                              _mm256_or_si256(_mm256_cmpeq_epi32(x, smin),
+                                              _mm256_cmpeq_epi32(x, smax)));
+    s0 = _mm256_add_pd(s0, lo);
+    s1 = _mm256_add_pd(s1, hi);
+    q0 = _mm256_add_pd(q0, _mm256_mul_pd(lo, lo));
+    q1 = _mm256_add_pd(q1, _mm256_mul_pd(hi, hi));
+  }
+  _mm256_storeu_si256((__m256i*)lmin, vmin);
+  _mm256_storeu_si256((__m256i*)lmax, vmax);
+  _mm256_storeu_si256((__m256i*)lzc, vzc);
+  _mm256_storeu_si256((__m256i*)lclips, vclips);
+  _mm256_storeu_pd(lsum, s0);
+  _mm256_storeu_pd(lsum + 4, s1);
+  _mm256_storeu_pd(lsumsq, q0);
+  _mm256_storeu_pd(lsumsq + 4, q1);
+  merge_lane_stats(st, src, i, channels, 8, lmin, lmax, lzc, lclips,
+                   lsum, lsumsq);
+  generic_channel_stats(st, src + i, n - i, channels);
+}
+
+#endif /* YSOX_X86_SIMD */
+
+static void
+init_kernels(void)
+{
+#define SET_KERNELS(prefix)                             \
+  samples_to_float = prefix##_samples_to_float;         \
+  samples_to_double = prefix##_samples_to_double;       \
+  samples_to_short = prefix##_samples_to_short;         \
+  samples_to_uchar = prefix##_samples_to_uchar;         \
+  uchar_to_samples = prefix##_uchar_to_samples;         \
+  short_to_samples = prefix##_short_to_samples;         \
+  int64_to_samples = prefix##_int64_to_samples;         \
+  float_to_samples = prefix##_float_to_samples;         \
+  double_to_samples = prefix##_double_to_samples;       \
+  channel_stats = prefix##_channel_stats
+  SET_KERNELS(generic);
+#ifdef YSOX_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    SET_KERNELS(avx2);
+  } else if (__builtin_cpu_supports("sse2")) {
+    SET_KERNELS(sse2);
+  }
+#endif
+#undef SET_KERNELS
+}
+
 /*---------------------------------------------------------------------------*/
 /* UTILITIES */
 
@@ -1100,25 +7776,121 @@ critical(void)
 }
 
 static void*
-push_samples(long channels, long samples)
+push_samples(int type, long channels, long samples)
 {
   long dims[3];
 
   dims[0] = 2;
   dims[1] = channels;
   dims[2] = samples;
-  if (sizeof(sox_sample_t) == sizeof(short)) {
-    return ypush_s(dims);
-  } else if (sizeof(sox_sample_t) == sizeof(int)) {
-    return ypush_i(dims);
-  } else if (sizeof(sox_sample_t) == sizeof(long)) {
-    return ypush_l(dims);
+  return push_array(type, dims);
+}
+
+static void*
+push_frames(const read_opts_t* opts, long channels, long rank,
+            const long fdims[])
+{
+  long dims[Y_DIMSIZE];
+
+  if (rank + 1 >= Y_DIMSIZE) y_error("too many dimensions");
+  dims[0] = rank + 1;
+  if (opts->planar) {
+    memcpy(dims + 1, fdims, rank*sizeof(long));
+    dims[rank + 1] = channels;
+  } else {
+    dims[1] = channels;
+    memcpy(dims + 2, fdims, rank*sizeof(long));
+  }
+  return push_array(opts->type, dims);
+}
+
+static void*
+shrink_frames(const read_opts_t* opts, long channels, long frames,
+              long first, long count)
+{
+  size_t elsize = type_size(opts->type);
+  int type;
+  const char* src = ygeta_any(0, NULL, NULL, &type);
+  char* dst = push_frames(opts, channels, 1, &count);
+  if (opts->planar) {
+    long c;
+    for (c = 0; c < channels; ++c) {
+      memcpy(dst + c*count*elsize, src + (c*frames + first)*elsize,
+             count*elsize);
+    }
   } else {
-    y_error("no corresponding integer type");
+    memcpy(dst, src + first*channels*elsize, count*channels*elsize);
+  }
+  yarg_swap(1, 0);
+  yarg_drop(1);
+  return dst;
+}
+
+static int
+get_layout(int iarg)
+{
+  const char* name = ygets_q(iarg);
+  if (name != NULL && strcmp(name, "planar") == 0) return TRUE;
+  if (name != NULL && strcmp(name, "interleaved") == 0) return FALSE;
+  y_error("layout must be \"interleaved\" or \"planar\"");
+  return FALSE;
+}
+
+static void*
+push_array(int type, long dims[])
+{
+  switch (type) {
+  case Y_CHAR:   return ypush_c(dims);
+  case Y_SHORT:  return ypush_s(dims);
+  case Y_INT:    return ypush_i(dims);
+  case Y_LONG:   return ypush_l(dims);
+  case Y_FLOAT:  return ypush_f(dims);
+  case Y_DOUBLE: return ypush_d(dims);
   }
+  y_error("unsupported array type");
   return NULL;
 }
 
+static size_t
+type_size(int type)
+{
+  switch (type) {
+  case Y_CHAR:   return sizeof(char);
+  case Y_SHORT:  return sizeof(short);
+  case Y_INT:    return sizeof(int);
+  case Y_LONG:   return sizeof(long);
+  case Y_FLOAT:  return sizeof(float);
+  case Y_DOUBLE: return sizeof(double);
+  }
+  y_error("unsupported array type");
+  return 0;
+}
+
+static int
+get_type(int iarg)
+{
+  /* Yorick API does not provide a mean to identify a structure definition,
+     so the given argument is compared to the definitions of the basic
+     numerical types. */
+  static const char* names[] = {"char", "short", "int", "long",
+                                "float", "double"};
+  void* use;
+  int type;
+  if (yarg_typeid(iarg) != Y_STRUCTDEF) y_error("expecting a type");
+  use = yget_use(iarg);
+  for (type = Y_CHAR; type <= Y_DOUBLE; ++type) {
+    void* ref;
+    ypush_global(yget_global(names[type], 0));
+    ref = yget_use(0);
+    ydrop_use(ref);
+    yarg_drop(1);
+    if (ref == use) break;
+  }
+  ydrop_use(use);
+  if (type > Y_DOUBLE) y_error("unsupported type");
+  return type;
+}
+
 static char*
 fetch_path(int iarg)
 {